@@ -1,24 +1,195 @@
+// Build: g++ -O2 -pthread server.cpp -o server -lz
+// Add -DHAVE_BROTLI -lbrotlienc to compress with brotli on the fly as well
+// Add -DALLOC_STATS to count heap allocations on the request path for --check-allocs
+
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <string_view>
+#include <shared_mutex>
+#include <unordered_map>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
 
 // Global Constants
 const int SERVER_PORT = 12345;
-const int LISTENNQ = 5;
+const int LISTENNQ = 1024;
 const int MAXLINE = 8192;
+const int MAX_EVENTS = 256;
+const int MAX_REQUEST_SIZE = 65536;
+const size_t MAX_SENDFILE_CHUNK = 1 << 20;
+const size_t PIPE_CHUNK = 65536;
+const int CACHE_SHARDS = 16;
+const size_t MAX_RANGES = 16;
+const int RETRY_AFTER_SECONDS = 1;
+const size_t MAX_IOVECS = 64;
+const size_t HEADER_RESERVE = 512;
+const size_t ARENA_SIZE = 16384;
+const size_t DIRECTORY_CACHE_MAX = 256;
+const int PATH_INDEX_SHARDS = 16;
+const size_t PATH_INDEX_MAX = 65536;
+const size_t NEGATIVE_CACHE_MAX = 8192;
+const size_t DIRENT_BUFFER_SIZE = 32768;
+const size_t DEFAULT_LISTING_LIMIT = 100;
+const int TIMER_TICK_MS = 100;
+const int TIMER_LEVELS = 4;
+const int TIMER_SLOT_BITS = 6;
+const int TIMER_SLOTS = 1 << TIMER_SLOT_BITS;
+const size_t LOG_RECORD_SIZE = 256;
+const size_t LOG_RING_SIZE = 1024;
+const int LOG_FLUSH_MS = 10;
+const size_t CHECK_ALLOCS_WARMUP = 100;
+const size_t CHECK_ALLOCS_REQUESTS = 1000;
+const int BENCH_MICRO_MS = 500;
+const size_t BENCH_MICRO_WARMUP = 64;
+const size_t BENCH_CONNECT_WAVE = 256;
+const size_t BENCH_FD_RESERVE = 64;
+const size_t BENCH_READ_SIZE = 65536;
+const int BENCH_GRACE_SECONDS = 10;
+const char *const BENCH_NAMES[] = {"parse", "response", "error_template", "listing_template", "content_type",
+                                   "small_keepalive", "large_file", "not_found", "directory_listing", "idle_connections"};
+const size_t METRICS_STATUS_LIMIT = 600;
+const size_t HISTOGRAM_SUB_BUCKETS = 8;
+const size_t HISTOGRAM_BUCKETS = 224;
+const size_t METRICS_RESERVE = 16384;
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_FILES = 4096;
+const unsigned URING_BUFFERS = 512;
+const size_t URING_BUFFER_SIZE = 4096;
+const uint16_t URING_BUFFER_GROUP = 0;
+const int URING_EMPTY_SLOT = -1;
+const size_t H2_FRAME_HEADER = 9;
+const size_t H2_MAX_FRAME = 16384;
+const size_t H2_FRAME_SIZE_LIMIT = 16777215;
+const size_t H2_SEND_FRAME_LIMIT = 65536;
+const size_t H2_MAX_STREAMS = 100;
+const int64_t H2_DEFAULT_WINDOW = 65535;
+const int64_t H2_MAX_WINDOW = 0x7fffffff;
+const size_t H2_PUMP_BYTES = 65536;
+const uint8_t H2_DEFAULT_URGENCY = 3;
+const size_t HPACK_TABLE_SIZE = 4096;
+const size_t HPACK_STATIC_COUNT = 61;
+const size_t HPACK_ENTRY_OVERHEAD = 32;
+const uint32_t PACK_VERSION = 1;
+const size_t PACK_ALIGNMENT = 64;
+const size_t MAX_CHUNK_LINE = 4096;
+const int UPLOAD_ATTEMPTS = 16;
+const size_t LIMITER_SLOTS = 1 << 16;
+const size_t LIMITER_PROBES = 8;
+const uint32_t LIMITER_IDLE_MS = 60000;
+const uint64_t LIMITER_COUNT_BITS = 24;
+const uint64_t LIMITER_TOKEN_SCALE = 1000;
+const size_t TRACE_RING_SIZE = 8192;
+const int TRACE_CALIBRATE_MS = 20;
+const uint32_t TRACE_VERSION = 1;
 
 const std::string SP = " ";
 const std::string CRLF = "\r\n";
+const std::string_view H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const char PACK_MAGIC[8] = {'H', 'T', 'T', 'P', 'A', 'C', 'K', '\0'};
+const char TRACE_MAGIC[8] = {'H', 'T', 'T', 'R', 'A', 'C', 'E', '\0'};
+const char BASE64URL_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+class Connection;
+class EventLoop;
+struct Job;
+class Http2Session;
+struct Http2Stream;
+struct CacheEntry;
+struct ErrorPage;
+struct OutputChunk;
+class ChunkQueue;
+struct DirectoryListing;
+class HtmlTemplate;
+
+// Key and static value of a sorted lookup table
+template <typename Key>
+struct TableEntry
+{
+    Key key;
+    std::string_view value;
+};
+
+// Check at compile time that a table is strictly ascending by key
+template <typename Key, size_t N>
+constexpr bool isStrictlySorted(const TableEntry<Key> (&table)[N])
+{
+    for (size_t i = 1; i < N; ++i)
+    {
+        if (!(table[i - 1].key < table[i].key))
+            return false;
+    }
+    return true;
+}
+
+// Binary search a sorted table, returns an empty view if the key is missing
+template <typename Key, size_t N>
+std::string_view lookupTable(const TableEntry<Key> (&table)[N], Key key)
+{
+    const TableEntry<Key> *it = std::lower_bound(table, table + N, key, [](const TableEntry<Key> &entry, Key value) {
+        return entry.key < value;
+    });
+    return it != table + N && it->key == key ? it->value : std::string_view();
+}
+
+const size_t CONTENT_TYPE_COUNT = 36;
+const size_t REASON_PHRASE_COUNT = 41;
+
+// Content codings in order of preference, zstd is only served precompressed
+enum class ContentEncoding
+{
+    IDENTITY = -1,
+    BROTLI,
+    ZSTD,
+    GZIP,
+};
+const int ENCODING_COUNT = 3;
+const char *const ENCODING_NAMES[ENCODING_COUNT] = {"br", "zstd", "gzip"};
+const char *const ENCODING_SUFFIXES[ENCODING_COUNT] = {".br", ".zst", ".gz"};
 
 enum class HttpMethod
 {
@@ -27,814 +198,9591 @@ enum class HttpMethod
     POST,
 };
 
+// Phases of a traced request, in the order they happen
+enum class TracePhase
+{
+    RECEIVE,
+    PARSE,
+    QUEUE,
+    OPEN,
+    RENDER,
+    SEND,
+};
+const int TRACE_PHASE_COUNT = 6;
+const char *const TRACE_PHASE_NAMES[TRACE_PHASE_COUNT] = {"recv", "parse", "queue", "open", "render", "send"};
+
+// One served request as stored in the binary trace file, times in nanoseconds
+struct TraceRecord
+{
+    uint64_t start;
+    uint64_t bytes;
+    uint32_t phases[TRACE_PHASE_COUNT];
+    uint32_t thread;
+    uint32_t connection;
+    uint16_t status;
+    uint8_t protocol;
+    int8_t method;
+    char url[44];
+};
+
+// Tick stamps of the request being served, zero for phases not reached,
+// and its record from when the response is built until it is sent
+struct TraceSpan
+{
+    uint64_t received = 0;
+    uint64_t parsing = 0;
+    uint64_t parsed = 0;
+    uint64_t picked = 0;
+    uint64_t opened = 0;
+    uint64_t built = 0;
+    bool pending = false;
+    TraceRecord record;
+};
+
+// A request whose fields are views into the connection read buffer
 class HttpRequest
 {
 public:
-    HttpRequest() : method(HttpMethod::UNDEFINED), url(""), version(""), connection("close") {}
+    HttpRequest() : method(HttpMethod::UNDEFINED), url(""), version(""), connection("close"), error_status(0), body_length(0) {}
     HttpMethod method;
     std::string url;
-    std::string version;
-    std::string connection;
+    std::string_view query;
+    std::string_view version;
+    std::string_view connection;
+    std::string_view head;
+    std::vector<std::pair<std::string_view, std::string_view>> headers;
+    int error_status;
+    size_t body_length;
+    TraceSpan trace;
     int status() const;
     bool toCloseConnection() const;
-    bool sendResponse(int conn_fd);
+    bool sendResponse(Connection *conn, ChunkQueue &out);
     std::string toString() const;
-    static HttpRequest *parse(std::string msg);
-    static HttpMethod toMethod(std::string method);
+    std::string_view header(std::string_view name) const;
+    bool contentLength(std::string_view &value) const;
+    std::string_view parameter(std::string_view name) const;
+    void reset();
+    size_t parse(std::string_view data, size_t &scan_pos);
+    void setTarget(std::string_view target);
+    static HttpMethod toMethod(std::string_view method);
+};
+
+// Per-connection read buffer reused across requests
+class ReadBuffer
+{
+public:
+    ReadBuffer() : begin(0), end(0) {}
+    std::string_view data() const;
+    size_t size() const;
+    char *writable(size_t min_space);
+    size_t space() const;
+    void commit(size_t length);
+    void consume(size_t length);
+
+private:
+    std::vector<char> buffer;
+    size_t begin;
+    size_t end;
+};
+
+// Per-thread monotonic arena for the temporaries of the responses being built on the thread.
+// It is rewound in one step once the last of them is gone and keeps its buffer, so only outsized responses reach the heap
+class Arena
+{
+public:
+    static std::pmr::memory_resource *acquire();
+    static void release();
+
+private:
+    // takes the blocks that do not fit the buffer from the heap and counts them
+    class Spill : public std::pmr::memory_resource
+    {
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *pointer, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+    };
+
+    struct State
+    {
+        State() : resource(buffer, sizeof(buffer), &spill), users(0) {}
+        Spill spill;
+        alignas(std::max_align_t) char buffer[ARENA_SIZE];
+        std::pmr::monotonic_buffer_resource resource;
+        size_t users;
+    };
+    static State &local();
 };
 
 class HttpResponse
 {
 public:
-    HttpResponse() : version(""), status_code(503), content_type(""), connection("close") {}
+    HttpResponse() : arena(Arena::acquire()), version(""), status_code(503), content_type(""), connection("close"), file_fd(-1), file_size(0), last_modified(0),
+                     extra_headers(arena), etag(arena), validators(arena), content_encoding(arena), ranges(arena), range_headers(arena), range_length(0), generated(arena) {}
     HttpResponse(HttpRequest *request);
     ~HttpResponse();
+    std::pmr::memory_resource *arena;
     std::string version;
     int status_code;
-    std::string content_type;
+    std::string_view content_type;
     std::string content;
-    std::string connection;
-    int contentLength() const;
+    std::string_view connection;
+    int file_fd;
+    off_t file_size;
+    time_t last_modified;
+    std::shared_ptr<const CacheEntry> cached;
+    std::shared_ptr<const ErrorPage> error_page;
+    std::shared_ptr<const void> shared_owner;
+    std::string_view shared_body;
+    std::pmr::string extra_headers;
+    std::pmr::string etag;
+    std::pmr::string validators;
+    std::pmr::string content_encoding;
+    std::pmr::vector<std::pair<off_t, off_t>> ranges;
+    std::pmr::vector<std::pmr::string> range_headers;
+    long long range_length;
+    std::pmr::string generated;
+    void applyListing(HttpRequest *request, const std::shared_ptr<const DirectoryListing> &listing);
+    void applyEncoding(HttpRequest *request, const std::string &path);
+    bool applyConditionals(HttpRequest *request);
+    void applyRanges(HttpRequest *request);
+    void queueBody(ChunkQueue &out);
+    bool hasFileBody() const;
+    bool hasCachedBody() const;
+    long long contentLength() const;
+    long long bodyLength() const;
+    std::string_view entityTag() const;
     std::string toString(bool debug = false);
-    static const std::map<int, std::string> REASON_PHRASES;
-    static std::string toReasonPhrase(int status_code);
+    std::string_view headerString();
+    static const TableEntry<int> REASON_PHRASES[REASON_PHRASE_COUNT];
+    static std::string_view toReasonPhrase(int status_code);
     static std::string toMessage(int status_code);
-    static const std::map<std::string, std::string> CONTENT_TYPES;
-    static std::string toContentType(std::string name);
-    static std::string currentDateTime();
+    static const TableEntry<std::string_view> CONTENT_TYPES[CONTENT_TYPE_COUNT];
+    static std::string_view toContentType(std::string_view name);
+    static std::atomic<uint64_t> date_sequence;
+    static std::atomic<time_t> date_second;
+    static std::atomic<uint64_t> date_words[4];
+    static void appendDate(std::string &buffer);
+    static std::string toHttpDate(time_t time);
+    static time_t parseHttpDate(std::string_view value);
+    static std::pmr::string toEntityTag(const struct stat &info, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+    static std::pmr::string validatorsOf(std::string_view etag, time_t last_modified, std::string_view name,
+                                         std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+    static bool isCompressible(std::string_view content_type);
+    static int negotiateEncodings(std::string_view accept_encoding, ContentEncoding encodings[ENCODING_COUNT]);
+    static bool compress(ContentEncoding encoding, const std::string &input, std::string &output);
+    static int parseRanges(std::string_view value, off_t size, std::pmr::vector<std::pair<off_t, off_t>> &ranges);
+    static const std::string BYTERANGES_BOUNDARY;
     static std::string htmlTemplateOf(int status_code);
-    static std::string htmlTemplateOf(std::string directory_path);
+    static std::pmr::string htmlTemplateOf(const HtmlTemplate *dirlist, const DirectoryListing &listing, size_t begin, size_t end, std::string_view navigation,
+                                           std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+    static std::pmr::string jsonOf(const DirectoryListing &listing, size_t begin, size_t end, size_t page, size_t limit,
+                                   std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+};
+
+// A html template compiled into literal and placeholder segments
+class HtmlTemplate
+{
+public:
+    HtmlTemplate() : literal_length(0) {}
+    bool compile(const std::string &source, const std::vector<std::string> &names);
+    std::pmr::string render(std::initializer_list<std::string_view> values, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) const;
 
 private:
-    std::ifstream ifs;
+    struct Segment
+    {
+        std::string literal;
+        int placeholder;
+    };
+    std::vector<Segment> segments;
+    size_t literal_length;
 };
 
-class Logger
+// A fully rendered error response apart from the version, Date and Connection
+struct ErrorPage
+{
+    std::string status_line;
+    std::string header;
+    std::string body;
+};
+
+// Templates compiled at startup and recompiled when the files change
+class Templates
 {
 public:
-    static std::ofstream log;
+    struct Set
+    {
+        HtmlTemplate error;
+        HtmlTemplate dirlist;
+        bool has_error = false;
+        bool has_dirlist = false;
+        timespec error_mtime = {0, 0};
+        timespec dirlist_mtime = {0, 0};
+        std::map<int, std::shared_ptr<const ErrorPage>> error_pages;
+    };
+    static std::shared_ptr<const Set> current();
+    static std::shared_ptr<const ErrorPage> errorPageOf(int status_code);
+    static bool reload();
+
+private:
+    static std::shared_ptr<const Set> set;
+    static std::atomic<time_t> checked;
+    static std::shared_ptr<const ErrorPage> renderErrorPage(const Set &set, int status_code);
 };
 
-std::string toLower(std::string original);
-bool startsWith(std::string base, std::string compare);
-bool endsWith(std::string base, std::string compare);
-bool replaceAll(std::string &base, std::string old_value, std::string new_value);
-bool exists(std::string path);
-HttpRequest *parse_request(int conn_fd);
-void request_handler(int conn_fd);
+// A cached static file with its pre-serialized header fields
+struct CacheEntry
+{
+    std::string path;
+    std::string content;
+    std::string content_type;
+    std::string header;
+    std::string validators;
+    std::string etag;
+    ino_t inode;
+    off_t size;
+    timespec mtime;
+    size_t slot;
+    mutable std::atomic<bool> referenced;
+
+    // encoded variants, read from a sibling file or compressed from the content
+    mutable std::shared_ptr<const CacheEntry> variants[ENCODING_COUNT];
+    mutable size_t variant_bytes = 0;
+    bool from_sibling = false;
+    bool usable = true;
+
+    // entries of an asset pack point into the mapping instead of owning their content
+    std::string_view mapped;
+    bool packed = false;
+    std::string_view body() const;
+    size_t footprint() const;
+    bool matches(const struct stat &info) const;
+};
 
-int main()
+// A directory read once, with its entries in display order and the full listings rendered
+struct DirectoryListing
 {
-    Logger::log.open("info.log", std::ofstream::out | std::ofstream::trunc);
-    if (!Logger::log.is_open() || !Logger::log.good())
+    struct Entry
     {
-        std::cerr << "Log file creation failed!" << std::endl;
-        return 0;
-    }
+        std::string_view name;
+        bool directory;
+    };
+    std::string path;
+    std::string names;
+    std::vector<Entry> entries;
+    std::pmr::string html;
+    std::pmr::string json;
+    std::shared_ptr<const Templates::Set> templates;
+    int watch = -1;
+};
 
-    int server_fd, conn_fd;
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0)
-    {
-        std::cerr << "Socket creation failed!" << std::endl;
-        Logger::log << "Socket creation failed!" << std::endl;
-        return 0;
-    }
+// Rendered directory listings kept until inotify reports a change in the directory
+class DirectoryCache
+{
+public:
+    static std::shared_ptr<const DirectoryListing> lookup(const std::string &directory_path);
 
-    sockaddr_in server_addr, client_addr;
-    socklen_t len = sizeof(sockaddr_in);
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+private:
+    static std::shared_mutex mutex;
+    static std::unordered_map<std::string, std::shared_ptr<const DirectoryListing>> listings;
+    static int inotify_fd;
+    static void invalidate();
+    static std::shared_ptr<DirectoryListing> read(const std::string &directory_path);
+};
+
+// The docroot opened once, with paths resolved beneath it and their metadata indexed, missing ones included.
+// Entries are dropped when inotify reports a change to their name, so repeated lookups stay off the file system
+class PathIndex
+{
+public:
+    static bool start();
+    static bool lookup(const std::string &path, struct stat &info);
+    static int open(std::string_view path, int flags);
 
-    if (bind(server_fd, (sockaddr *)&server_addr, sizeof(sockaddr)) < 0)
+private:
+    // metadata of a path, or the fact that it is missing, and the watch of the directory that would change it
+    struct Entry
     {
-        std::cerr << "Bind failed!" << std::endl;
-        Logger::log << "Bind failed!" << std::endl;
-        return 0;
-    }
+        bool found;
+        int watch;
+        struct stat info;
+    };
 
-    if (listen(server_fd, LISTENNQ) < 0)
+    struct Shard
     {
-        std::cerr << "Listen failed!" << std::endl;
-        Logger::log << "Listen failed!" << std::endl;
-        return 0;
-    }
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::deque<std::string> missing;
+    };
+
+    static int root_fd;
+    static int inotify_fd;
+    static bool beneath;
+    static std::atomic<uint64_t> generation;
+    static Shard shards[PATH_INDEX_SHARDS];
+    static std::mutex directories_mutex;
+    static std::unordered_map<int, std::string> directories;
+    static Shard &shardOf(const std::string &path);
+    static int resolve(std::string_view path, int flags, uint64_t resolve);
+    static int watch(const std::string &path);
+    static bool escapes(std::string_view path);
+    static bool plain(std::string_view path);
+    static void run();
+};
 
-    char ip_str[INET_ADDRSTRLEN] = {0};
+// Concurrent size-bounded CLOCK cache of small static files keyed by path
+class FileCache
+{
+public:
+    static std::shared_ptr<const CacheEntry> lookup(const std::string &path, const struct stat &info);
+    static std::shared_ptr<const CacheEntry> load(const std::string &path, std::string_view content_type, std::string_view validators, int fd, const struct stat &info);
+    static std::shared_ptr<const CacheEntry> variantOf(const std::shared_ptr<const CacheEntry> &entry, ContentEncoding encoding);
+    static std::string stats();
 
-    while (true)
+private:
+    struct Shard
     {
-        conn_fd = accept(server_fd, (sockaddr *)&client_addr, &len);
-        if (conn_fd < 0)
-        {
-            std::cerr << "Accept failed!" << std::endl;
-            Logger::log << "Accept failed!" << std::endl;
-            return 0;
-        }
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<CacheEntry>> entries;
+        std::vector<std::shared_ptr<CacheEntry>> ring;
+        size_t hand = 0;
+        size_t bytes = 0;
+    };
+    static Shard shards[CACHE_SHARDS];
+    static Shard &shardOf(const std::string &path);
+    static void evict(Shard &shard, const std::shared_ptr<CacheEntry> &entry);
+    static std::shared_ptr<const CacheEntry> buildVariant(const CacheEntry &entry, ContentEncoding encoding);
+};
 
-        inet_ntop(AF_INET, &(client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+// Read-only docroot packed into one file by --build-pack and mapped at startup by --pack,
+// so lookups hash into the mapped index and bodies are sent from the mapping without touching the filesystem
+class AssetPack
+{
+public:
+    static bool build(const std::string &file);
+    static bool open(const std::string &file);
+    static bool loaded();
+    static std::shared_ptr<const CacheEntry> lookup(std::string_view url);
 
-        std::cout << "Connection from " << ip_str << ":" << ntohs(client_addr.sin_port) << " with conn_fd " << conn_fd << std::endl;
-        Logger::log << "Connection from " << ip_str << ":" << ntohs(client_addr.sin_port) << " with conn_fd " << conn_fd << std::endl;
+private:
+    // a byte range of the pack file
+    struct Span
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
 
-        std::thread t(request_handler, conn_fd);
-        t.detach();
-    }
+    // one packed file, its strings and bodies referenced by range
+    struct Record
+    {
+        uint64_t hash;
+        Span path;
+        Span content_type;
+        Span etag;
+        Span body;
+        Span variant_etags[ENCODING_COUNT];
+        Span variants[ENCODING_COUNT];
+        uint64_t inode;
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+    };
+
+    // fixed header at the start of the pack, followed by the records, the bucket index, the strings and the bodies
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t count;
+        uint32_t buckets;
+        uint64_t records;
+        uint64_t index;
+        uint64_t size;
+    };
+
+    static const char *base;
+    static size_t size;
+    static const Header *header;
+    static std::vector<std::shared_ptr<const CacheEntry>> entries;
+    static uint64_t hashOf(std::string_view path);
+    static void collect(const std::string &directory, std::vector<std::string> &paths);
+    static bool inside(const Span &span);
+    static std::string_view view(const Span &span);
+};
+
+// An open file closed when the last chunk streaming from it is done
+struct FileDescriptor
+{
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    ~FileDescriptor();
+    int fd;
+};
 
-    Logger::log.close();
+// A pending piece of response output, either bytes in memory or a file range
+struct OutputChunk
+{
+    OutputChunk() : offset(0), remaining(0) {}
+    std::string data;
+    std::shared_ptr<const void> owner;
+    std::string_view shared;
+    std::shared_ptr<FileDescriptor> file;
+    off_t offset;
+    size_t remaining;
+    bool isFile() const;
+    std::string_view bytes() const;
+};
 
-    return 0;
-}
+// Ring of output chunks whose slots keep their buffers across requests
+class ChunkQueue
+{
+public:
+    ChunkQueue() : head(0), count(0) {}
+    bool empty() const;
+    size_t size() const;
+    OutputChunk &front();
+    OutputChunk &operator[](size_t index);
+    void pop_front();
+    void clear();
+    void pushBytes(std::string_view bytes);
+    void pushString(std::string &&data);
+    void pushShared(const std::shared_ptr<const void> &owner, std::string_view shared, off_t offset, size_t length);
+    void pushFile(const std::shared_ptr<FileDescriptor> &file, off_t offset, size_t length);
+    void append(ChunkQueue &other);
+
+private:
+    std::vector<OutputChunk> slots;
+    size_t head;
+    size_t count;
+    OutputChunk &push();
+};
 
-void request_handler(int conn_fd)
+// A request handed from an event loop to the worker pool, embedded in its connection
+struct Job
 {
+    Connection *conn = nullptr;
+    EventLoop *loop = nullptr;
     HttpRequest *request = nullptr;
+    Http2Stream *stream = nullptr;
+    ChunkQueue out;
+    std::chrono::steady_clock::time_point queued;
+};
 
-    while (true)
+// A request body stored into the upload directory as it arrives, through the read buffer or a pipe,
+// so memory stays bounded whatever its size. It is written to a hidden file renamed into place once complete,
+// and an existing file of the same name is never replaced
+class Upload
+{
+public:
+    enum class State
     {
-        if (request != nullptr)
-            delete request;
-        request = parse_request(conn_fd);
+        DATA,
+        SIZE,
+        DATA_END,
+        TRAILER,
+        DONE,
+    };
+
+    Upload() : error(0), fd(-1), state(State::DONE), chunked(false), sized(true), remaining(0), received(0)
+    {
+        pipe_fds[0] = -1;
+        pipe_fds[1] = -1;
+    }
+    ~Upload();
+    std::string head;
+    int error;
+    int begin(const HttpRequest &request, bool framed);
+    size_t feed(std::string_view data);
+    int splice(int socket_fd);
+    bool splicing() const;
+    bool done() const;
+    int commit();
+    static bool open(const std::string &path);
+    static int directory;
 
-        if (request == nullptr)
-            continue;
+private:
+    int fd;
+    int pipe_fds[2];
+    State state;
+    bool chunked;
+    bool sized;
+    uint64_t remaining;
+    uint64_t received;
+    std::string name;
+    std::string temporary;
+    std::string line;
+    bool store(std::string_view data);
+    bool onLine();
+    static std::atomic<uint64_t> sequence;
+};
 
-        bool result = request->sendResponse(conn_fd);
+// Intrusive entry of a TimerWheel slot list
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0;
+    Connection *conn = nullptr;
+    bool linked() const;
+};
 
-        if (!result)
-        {
-            std::cerr << "Error sending HTTP response to conn_fd " << conn_fd << std::endl;
-            Logger::log << "Error sending HTTP response to conn_fd " << conn_fd << std::endl;
-        }
+// Hierarchical timing wheel with coarse ticks, advanced by its event loop
+class TimerWheel
+{
+public:
+    TimerWheel();
+    void schedule(TimerNode *node, uint64_t delay_ms);
+    void cancel(TimerNode *node);
+    void advance(std::vector<Connection *> &expired);
+    bool empty() const;
 
-        if (request->toCloseConnection())
-        {
-            delete request;
-            request = nullptr;
-            close(conn_fd);
-            break;
-        }
-    }
-}
+private:
+    TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t current;
+    size_t count;
+    void insert(TimerNode *node);
+    static uint64_t currentTick();
+};
 
-// Generate HttpRequest object with request message
-HttpRequest *parse_request(int conn_fd)
+// Ring state of a connection served by the io_uring backend
+struct UringIo
 {
-    int buffer_size = 0;
-    std::string msg{""};
-    HttpRequest *request = nullptr;
+    int fd_value = -1;
+    int slot = -1;
+    size_t pending = 0;
+    size_t writes = 0;
+    bool receiving = false;
+    std::string held;
+    iovec iov[MAX_IOVECS];
+    msghdr message;
+};
 
-    // receive request message
-    do
+// Minimal io_uring over the raw system calls, with provided buffers for receives and a sparse fixed file table
+class Uring
+{
+public:
+    // kinds of submissions, kept in the low bits of the user data next to the owner pointer
+    enum Tag : uint64_t
     {
-        char buf[MAXLINE] = {0};
-        buffer_size = recv(conn_fd, buf, MAXLINE - 1, 0);
+        TAG_IGNORE,
+        TAG_ACCEPT,
+        TAG_EVENTS,
+        TAG_RECEIVE,
+        TAG_SEND,
+        TAG_SPLICE_IN,
+        TAG_SPLICE_OUT,
+        TAG_CONTROL,
+    };
+    static const uint64_t TAG_MASK = 7;
+
+    Uring() {}
+    ~Uring();
+    bool init(unsigned entries, unsigned files, unsigned buffer_count, size_t buffer_size);
+    io_uring_sqe *sqe(unsigned reserve = 1);
+    int enter(unsigned wait, const timespec *timeout);
+    io_uring_cqe *peek();
+    void advance();
+    char *buffer(uint16_t id);
+    void recycle(uint16_t id);
+    int allocateSlot();
+    void releaseSlot(int slot);
+    bool clearSlot(int slot);
+    static uint64_t tagged(void *owner, Tag tag);
 
-        if (buffer_size < 0)
-        {
-            std::cerr << "Recv failed from conn_fd " << conn_fd << std::endl;
-            Logger::log << "Recv failed from conn_fd " << conn_fd << std::endl;
-            return request;
-        }
-        else if (buffer_size == 0)
-        {
-            continue;
-        }
+private:
+    int fd = -1;
+    void *ring = MAP_FAILED;
+    size_t ring_size = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0;
+    unsigned sq_submitted = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+    char *buffers = (char *)MAP_FAILED;
+    size_t buffers_size = 0;
+    size_t buffer_size = 0;
+    unsigned buffer_count = 0;
+    std::vector<uint16_t> stranded;
+    std::vector<int> free_slots;
+};
 
-        if (buf[buffer_size] != '\0')
-        {
-            buf[buffer_size] = '\0';
-        }
+// Header compression context of one direction of an HTTP/2 connection, RFC 7541
+class Hpack
+{
+public:
+    Hpack() : table_size(0), max_size(HPACK_TABLE_SIZE), resized(false) {}
+    bool decode(std::string_view block, std::vector<std::pair<std::string, std::string>> &fields);
+    void begin(std::string &out);
+    void encode(std::string_view name, std::string_view value, bool indexing, std::string &out);
+    void limit(size_t size);
+    static bool decodeInteger(std::string_view &data, int prefix_bits, size_t &value);
+    static void encodeInteger(size_t value, int prefix_bits, uint8_t flags, std::string &out);
+    static bool decodeString(std::string_view &data, std::string &out);
+    static void encodeString(std::string_view value, std::string &out);
+    static bool huffmanDecode(std::string_view data, std::string &out);
+    static const std::pair<std::string_view, std::string_view> STATIC_TABLE[HPACK_STATIC_COUNT];
+    static const uint32_t HUFFMAN_CODES[256];
+    static const uint8_t HUFFMAN_LENGTHS[256];
 
-        msg += buf;
-    } while (buffer_size == 0 || buffer_size > MAXLINE);
+private:
+    std::deque<std::pair<std::string, std::string>> dynamic;
+    size_t table_size;
+    size_t max_size;
+    bool resized;
+    bool lookup(size_t index, std::string_view &name, std::string_view &value) const;
+    size_t find(std::string_view name, std::string_view value, bool &exact) const;
+    void insert(std::string_view name, std::string_view value);
+    void evict(size_t limit);
+};
 
-    // parse request message
-    request = HttpRequest::parse(msg);
-    int status = request->status();
-    if (status >= 400)
+// One request and response exchange multiplexed on an HTTP/2 connection
+struct Http2Stream
+{
+    uint32_t id = 0;
+    Job job;
+    HttpRequest request;
+    std::unique_ptr<Upload> upload;
+    std::string line;
+    std::vector<std::pair<std::string, std::string>> fields;
+    ChunkQueue body;
+    size_t remaining = 0;
+    int64_t window = 0;
+    uint8_t urgency = H2_DEFAULT_URGENCY;
+    bool incremental = false;
+    bool dispatched = false;
+    bool working = false;
+    bool responded = false;
+    bool reset = false;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point ready;
+};
+
+// HTTP/2 framing, flow control and stream scheduling on top of a connection, RFC 9113.
+// Responses are built by the same workers as HTTP/1.1 ones and their header block is translated on the loop
+class Http2Session
+{
+public:
+    enum FrameType : uint8_t
     {
-        std::cerr << "Error parsing HTTP request:\n"
-                  << msg << std::endl;
-        Logger::log << "Error parsing HTTP request:\n"
-                    << msg << std::endl;
-    }
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9,
+        PRIORITY_UPDATE = 0x10,
+    };
+
+    enum Flag : uint8_t
+    {
+        ACK = 0x1,
+        END_STREAM = 0x1,
+        END_HEADERS = 0x4,
+        PADDED = 0x8,
+        PRIORITY_FLAG = 0x20,
+    };
+
+    enum Setting : uint16_t
+    {
+        SETTINGS_HEADER_TABLE_SIZE = 0x1,
+        SETTINGS_ENABLE_PUSH = 0x2,
+        SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+        SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+        SETTINGS_MAX_FRAME_SIZE = 0x5,
+        SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+        SETTINGS_NO_RFC7540_PRIORITIES = 0x9,
+    };
+
+    enum ErrorCode : uint32_t
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        CANCEL = 0x8,
+        COMPRESSION_ERROR = 0x9,
+        ENHANCE_YOUR_CALM = 0xb,
+    };
+
+    Http2Session(Connection *conn) : conn(conn), working(0), last_stream(0), send_window(H2_DEFAULT_WINDOW), initial_window(H2_DEFAULT_WINDOW),
+                                     max_frame(H2_MAX_FRAME), preface(false), configured(false), draining(false), continuation(0), rotation(0) {}
+    void start();
+    bool upgrade(HttpRequest &request);
+    void process();
+    void finish(Http2Stream *stream);
+    bool pump();
+    bool busy() const;
+    static bool wantsUpgrade(const HttpRequest &request);
 
-    return request;
-}
+private:
+    Connection *conn;
+    size_t working;
+    Hpack decoder;
+    Hpack encoder;
+    std::map<uint32_t, std::unique_ptr<Http2Stream>> streams;
+    uint32_t last_stream;
+    int64_t send_window;
+    int64_t initial_window;
+    size_t max_frame;
+    bool preface;
+    bool configured;
+    bool draining;
+    uint32_t continuation;
+    uint8_t continuation_flags;
+    std::string header_block;
+    std::vector<std::pair<std::string, std::string>> decoded;
+    std::string scratch;
+    std::string field_name;
+    uint32_t rotation;
+    bool onFrame(uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload);
+    bool onHeaders(uint8_t flags, uint32_t stream_id, std::string_view payload);
+    bool onHeaderBlock(uint32_t stream_id, bool end_stream);
+    bool onData(uint8_t flags, uint32_t stream_id, std::string_view payload);
+    bool onSettings(uint8_t flags, uint32_t stream_id, std::string_view payload, bool acknowledge);
+    bool onWindowUpdate(uint32_t stream_id, std::string_view payload);
+    bool onPriorityUpdate(std::string_view payload);
+    Http2Stream *openStream(uint32_t stream_id);
+    bool loadRequest(Http2Stream *stream);
+    void dispatch(Http2Stream *stream);
+    void respond(Http2Stream *stream);
+    Http2Stream *next();
+    void frameData(Http2Stream *stream, size_t length);
+    void close(Http2Stream *stream);
+    void resetStream(uint32_t stream_id, ErrorCode error);
+    bool fail(ErrorCode error, std::string_view reason);
+    void settle();
+    void writeFrameHeader(size_t length, uint8_t type, uint8_t flags, uint32_t stream_id);
+    void writeFrame(uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload);
+    static void parsePriority(std::string_view value, Http2Stream *stream);
+    static uint32_t readUint32(std::string_view data);
+};
 
-// Convert to a string with all lower case characters
-std::string toLower(std::string original)
+// Per-connection state machine driven by an EventLoop
+class Connection
 {
-    std::string result{original};
-    for (int i = 0; i < result.length(); ++i)
+public:
+    enum class State
     {
-        result[i] = static_cast<char>(std::tolower(result[i]));
-    }
-    return result;
-}
+        READING,
+        WRITING,
+    };
 
-// Check if base string starts with compare string
-bool startsWith(std::string base, std::string compare)
-{
-    if (compare.length() <= 0 || base.length() < compare.length())
+    enum class Deadline
     {
-        return false;
+        NONE,
+        HEADER,
+        IDLE,
+        WRITE,
+        BODY,
+    };
+
+    Connection(int fd, EventLoop *loop) : fd(fd), loop(loop), state(State::READING), close_after_write(false), processing(false), closed(false),
+                         deadline(Deadline::NONE), requests(0), timing(false), limit_slot(-1), scan_pos(0), request_length(0), pipe_pending(0)
+    {
+        ip[0] = '\0';
+        timer.conn = this;
+        job.conn = this;
+        job.loop = loop;
+        job.request = &request;
+        pipe_fds[0] = -1;
+        pipe_fds[1] = -1;
     }
-    return base.compare(0, compare.length(), compare) == 0;
-}
+    ~Connection();
+    int fd;
+    char ip[INET6_ADDRSTRLEN];
+    EventLoop *loop;
+    State state;
+    ReadBuffer in;
+    HttpRequest request;
+    ChunkQueue out;
+    Job job;
+    bool close_after_write;
+    bool processing;
+    bool closed;
+    TimerNode timer;
+    Deadline deadline;
+    size_t requests;
+    bool timing;
+    std::chrono::steady_clock::time_point request_start;
+    std::chrono::steady_clock::time_point response_ready;
+    int limit_slot;
+    std::unique_ptr<UringIo> io;
+    std::unique_ptr<Http2Session> h2;
+    std::unique_ptr<Upload> upload;
+    bool onReadable();
+    bool onWritable();
+    bool finishRequest();
+    bool onTimeout();
+    bool armReceive();
+    bool onCompletion(Uring::Tag tag, const io_uring_cqe &cqe);
 
-// Check if base string ends with compare string
-bool endsWith(std::string base, std::string compare)
+private:
+    size_t scan_pos;
+    size_t request_length;
+    int pipe_fds[2];
+    size_t pipe_pending;
+    void processRequests();
+    void startUpload(size_t head_length);
+    bool receiveUpload();
+    int sendMemory();
+    void retire(size_t written);
+    int sendFile(OutputChunk &chunk);
+    int spliceFile(OutputChunk &chunk);
+    int drainPipe();
+    void target(io_uring_sqe *sqe);
+    bool submitOutput();
+    bool onReceived(std::string_view data);
+};
+
+// Edge-triggered epoll reactor owning accept, read, parse and write
+class EventLoop
 {
-    if (compare.length() <= 0 || base.length() < compare.length())
-    {
-        return false;
-    }
-    return base.compare(base.length() - compare.length(), std::string::npos, compare) == 0;
-}
+public:
+    EventLoop(int server_fd, int cpu) : server_fd(server_fd), cpu(cpu), epoll_fd(-1), event_fd(-1) {}
+    ~EventLoop();
+    bool init();
+    void run();
+    void complete(Job *job);
+    Uring *ring();
 
-// Replace substring in base string with specified string
-bool replaceAll(std::string &base, std::string old_value, std::string new_value)
+private:
+    int server_fd;
+    int cpu;
+    int epoll_fd;
+    int event_fd;
+    std::mutex completed_mutex;
+    std::vector<Job *> completed;
+    std::vector<Job *> finishing;
+    std::vector<Connection *> expired;
+    TimerWheel timers;
+    std::unique_ptr<Uring> uring;
+    void acceptConnections();
+    void closeConnection(Connection *conn);
+    void release(Connection *conn);
+    void runUring();
+    bool armAccept();
+    bool armEvents();
+    void adopt(int conn_fd);
+    void onCompletion(const io_uring_cqe &cqe);
+    void finishJobs();
+    void updateDeadline(Connection *conn);
+    void expireDeadlines();
+};
+
+// Fixed pool of workers building responses from a bounded queue
+class WorkerPool
 {
-    int pos = base.find(old_value);
+public:
+    static bool start(unsigned int count);
+    static void stop();
+    static bool submit(Job *job);
+    static size_t depth();
 
-    if (pos == std::string::npos)
-    {
-        return false;
-    }
+private:
+    static std::mutex mutex;
+    static std::condition_variable ready;
+    static std::vector<Job *> queue;
+    static size_t queue_head;
+    static size_t queue_count;
+    static std::vector<std::thread> workers;
+    static bool running;
+    static bool overloaded(std::chrono::steady_clock::time_point now);
+    static void run();
+};
 
-    do
+// Per-client limits on concurrent connections and request rate, keyed by IPv4 prefix.
+// Clients live in a fixed open-addressed table updated with compare-and-swap only, each entry packing
+// its key with the connection count and its token bucket with the time of the last refill into one word.
+// Entries without connections whose bucket sat untouched are taken over by new clients, and a client
+// that finds its probe window full is not limited, so a crowded table degrades to letting traffic through
+class RateLimiter
+{
+public:
+    static void start();
+    static bool acquire(uint32_t address, int &slot);
+    static void release(int slot);
+    static bool allow(int slot);
+
+private:
+    struct alignas(16) Entry
     {
-        base.replace(pos, old_value.length(), new_value);
-        pos = base.find(old_value);
-    } while (pos != std::string::npos);
+        std::atomic<uint64_t> owner{0};
+        std::atomic<uint64_t> bucket{0};
+    };
 
-    return true;
-}
+    static std::unique_ptr<Entry[]> table;
+    static uint64_t capacity;
+    static uint32_t now();
+};
 
-// Check if a path exists in the filesystem
-bool exists(std::string path)
+// Phases of a request timed into the latency histograms
+enum class Phase
 {
-    struct stat info;
-    if (stat(path.c_str(), &info) != 0)
+    QUEUE,
+    BUILD,
+    WRITE,
+    TOTAL,
+};
+const int PHASE_COUNT = 4;
+const char *const PHASE_NAMES[PHASE_COUNT] = {"queue", "build", "write", "total"};
+
+// Counters kept in one padded slot per thread and only merged when scraped
+class Metrics
+{
+public:
+    // written by its own thread alone, so updates need no atomic read-modify-write
+    struct alignas(64) Slot
     {
-        return false;
-    }
+        std::atomic<uint64_t> connections_opened{0};
+        std::atomic<uint64_t> connections_closed{0};
+        std::atomic<uint64_t> connections_refused{0};
+        std::atomic<uint64_t> bytes_sent{0};
+        std::atomic<uint64_t> cache_hits{0};
+        std::atomic<uint64_t> cache_misses{0};
+        std::atomic<uint64_t> path_hits{0};
+        std::atomic<uint64_t> path_misses{0};
+        std::atomic<uint64_t> arena_spills{0};
+        std::atomic<uint64_t> statuses[METRICS_STATUS_LIMIT] = {};
+        std::atomic<uint64_t> latency_sums[PHASE_COUNT] = {};
+        std::atomic<uint64_t> latencies[PHASE_COUNT][HISTOGRAM_BUCKETS] = {};
+    };
+    static Slot *local();
+    static void add(std::atomic<uint64_t> &counter, uint64_t value = 1);
+    static void record(Phase phase, std::chrono::steady_clock::duration elapsed);
+    static void addListener(int fd);
+    static size_t bucketOf(uint64_t micros);
+    static uint64_t bucketLimit(size_t bucket);
+    static std::string render();
+    static unsigned long long cacheHits();
+    static unsigned long long cacheMisses();
 
-    // true for both file or directory
-    return true;
-}
+private:
+    static std::mutex mutex;
+    static std::vector<Slot *> slots;
+    static std::vector<int> listeners;
+};
 
-HttpResponse::HttpResponse(HttpRequest *request)
-    : version(request->version),
-      status_code(500),
-      content_type(""),
-      content(""),
-      connection("close")
+enum class LogLevel
 {
-    std::string connection{request->connection};
-    if (connection.length() > 0)
-    {
-        this->connection = connection;
-    }
+    DEBUG,
+    INFO,
+    ERROR,
+    NONE,
+};
 
-    // check for bad request
-    int status = request->status();
-    if (status >= 400)
-    {
-        this->status_code = status;
-        return;
-    }
+// Asynchronous logger fed by per-thread lock-free rings and drained by a writer thread
+class Logger
+{
+public:
+    static LogLevel level;
+    static std::string access_format;
+    static bool open(const std::string &info_path, const std::string &access_path);
+    static void close();
+    static bool enabled(LogLevel level);
+    static void debug(std::string_view message);
+    static void info(std::string_view message);
+    static void error(std::string_view message);
+    static void error(std::string_view message, std::string_view detail);
+    static void access(const char *ip, const HttpRequest &request, int status_code, long long bytes);
 
-    // parse the requested object
-    int pos = request->url.find_last_of("/");
-    if (pos == std::string::npos || pos + 1 >= request->url.length())
+private:
+    enum Kind : uint8_t
     {
-        this->status_code = 400;
-        std::cerr << "Unknown request object with url " << request->url << std::endl;
-        Logger::log << "Unknown request object with url " << request->url << std::endl;
-        return;
-    }
-
-    std::string name = request->url.substr(pos + 1);
-    std::string contentType = HttpResponse::toContentType(name);
-    if (startsWith(contentType, "Error"))
+        KIND_DEBUG,
+        KIND_INFO,
+        KIND_ERROR,
+        KIND_ACCESS,
+    };
+
+    // messages longer than one record continue in the following records
+    struct Record
     {
-        this->status_code = 415;
-        std::cerr << "Unknown file type with name " << name << std::endl;
-        Logger::log << "Unknown file type with name " << name << std::endl;
-        return;
-    }
+        uint8_t kind;
+        bool more;
+        uint16_t length;
+        char text[LOG_RECORD_SIZE - 4];
+    };
+
+    // single-producer single-consumer ring owned by one thread
+    struct Ring
+    {
+        Record records[LOG_RING_SIZE];
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+        std::atomic<unsigned long long> dropped{0};
+    };
+
+    static int info_fd;
+    static int access_fd;
+    static std::mutex rings_mutex;
+    static std::vector<Ring *> rings;
+    static std::thread writer;
+    static std::atomic<bool> running;
+    static Ring *localRing();
+    static void write(Kind kind, std::string_view message);
+    static bool drain();
+    static void run();
+};
 
-    // directory requested
-    if (endsWith(contentType, "directory"))
+// Per-request phase tracing on the time stamp counter. Spans are stamped as requests go through the loop and the workers,
+// sent requests land in a ring per thread, dumped to a binary file on SIGUSR2 and read back offline by --trace-report
+class Tracer
+{
+public:
+    static bool active;
+    static void start(bool recording);
+    static uint64_t now();
+    static void appendTiming(const TraceSpan &span, std::pmr::string &headers);
+    static void build(HttpRequest &request, int status_code, long long bytes, int fd);
+    static void finish(HttpRequest &request);
+    static bool dump(const std::string &file, size_t &count);
+    static bool report(const std::string &file, const std::string &format);
+
+private:
+    // fixed header at the start of a trace file, followed by the records ordered by start
+    struct Header
     {
-        // this->status_code = 403;
-        // std::cerr << "Missing file extension with name " << name << std::endl;
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t phase_count;
+        uint32_t threads;
+        uint64_t count;
+        int64_t epoch;
+    };
+
+    // single-producer ring owned by one thread, overwriting its oldest records
+    struct Ring
+    {
+        TraceRecord records[TRACE_RING_SIZE];
+        alignas(64) std::atomic<uint64_t> head{0};
+        uint32_t thread = 0;
+    };
+
+    static bool recording;
+    static double nanos_per_tick;
+    static uint64_t epoch_ticks;
+    static int64_t epoch;
+    static std::mutex rings_mutex;
+    static std::vector<Ring *> rings;
+    static Ring *localRing();
+    static uint32_t between(uint64_t from, uint64_t to);
+};
+
+// Runtime configuration parsed from the command line
+class Config
+{
+public:
+    static size_t cache_size;
+    static size_t cache_entry_max;
+    static size_t workers;
+    static size_t queue_size;
+    static size_t queue_timeout;
+    static size_t header_timeout;
+    static size_t idle_timeout;
+    static size_t write_timeout;
+    static size_t max_requests;
+    static size_t port;
+    static size_t backlog;
+    static size_t loops;
+    static size_t accept_batch;
+    static size_t defer_accept;
+    static size_t fastopen;
+    static bool nodelay;
+    static bool pin_cpus;
+    static bool http2;
+    static std::string check_allocs;
+    static std::string bench;
+    static std::string metrics_path;
+    static std::string io;
+    static std::string pack;
+    static std::string build_pack;
+    static std::string upload_dir;
+    static size_t upload_max;
+    static size_t limit_connections;
+    static size_t limit_rate;
+    static size_t limit_burst;
+    static size_t limit_prefix;
+    static std::string trace;
+    static std::string trace_report;
+    static std::string trace_format;
+    static bool server_timing;
+    static size_t bench_duration;
+    static size_t bench_connections;
+    static size_t bench_rate;
+    static size_t bench_idle;
+    static bool parse(int argc, char *argv[]);
+    static bool parseSize(const std::string &value, size_t &result);
+    static bool parseLogLevel(const std::string &value, LogLevel &result);
+    static bool parseSwitch(const std::string &value, bool &result);
+    static bool parseMaxAges(const std::string &value);
+    static bool parseBench(const std::string &value);
+    static std::map<std::string, long> max_ages;
+};
+
+// Microbenchmarks and a loopback load generator run against this process by --bench
+class Benchmark
+{
+public:
+    static void run();
+
+private:
+    // one loopback client connection of the load generator
+    struct Client
+    {
+        int fd = -1;
+        bool busy = false;
+        bool in_body = false;
+        bool close_after = false;
+        int status = 0;
+        size_t sent = 0;
+        size_t requests = 0;
+        size_t remaining = 0;
+        std::string header;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // counters of one load scenario
+    struct Load
+    {
+        size_t requests = 0;
+        size_t errors = 0;
+        size_t non_2xx = 0;
+        unsigned long long bytes = 0;
+        double seconds = 0;
+        std::vector<uint32_t> latencies;
+    };
+
+    static bool wants(const char *name);
+    static void micro(std::string &json, const char *name, const std::function<size_t(size_t)> &body);
+    static void load(std::string &json, const char *name, const std::string &url, size_t connections, size_t idle);
+    static bool drive(std::vector<Client> &clients, const std::string &request, size_t quota, size_t rate, double seconds, Load &result);
+    static int connectClient();
+    static long residentKilobytes();
+};
+
+std::string toLower(std::string_view original);
+bool startsWith(std::string_view base, std::string_view compare);
+bool endsWith(std::string_view base, std::string_view compare);
+bool replaceAll(std::string &base, std::string_view old_value, std::string_view new_value);
+bool setNonBlocking(int fd);
+int createListener();
+bool equalsIgnoreCase(std::string_view base, std::string_view compare);
+void checkAllocations();
+
+std::atomic<bool> report_requested{false};
+std::atomic<bool> trace_requested{false};
+
+#ifdef ALLOC_STATS
+// only event loop and worker threads count, so the checking client does not disturb the figure
+thread_local bool count_allocations = false;
+std::atomic<unsigned long long> allocation_count{0};
+
+void *operator new(size_t size)
+{
+    if (count_allocations)
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void *pointer = malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+// GCC pairs the inlined free with the library operator new and warns about the replacement
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    if (!Config::parse(argc, argv))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--cache-size=BYTES] [--cache-entry-max=BYTES] [--max-age=EXT:SECONDS,...]"
+                  << " [--log-level=debug|info|error|none] [--access-log=combined|common|off]"
+                  << " [--workers=COUNT] [--queue-size=COUNT] [--queue-timeout=MS]"
+                  << " [--port=PORT] [--backlog=COUNT] [--loops=COUNT] [--accept-batch=COUNT]"
+                  << " [--defer-accept=SECONDS] [--fastopen=QUEUE] [--nodelay=on|off] [--pin-cpus=on|off]"
+                  << " [--header-timeout=SECONDS] [--idle-timeout=SECONDS] [--write-timeout=SECONDS] [--max-requests=COUNT]"
+                  << " [--io=epoll|uring] [--http2=on|off] [--pack=FILE] [--build-pack=FILE] [--upload-dir=DIR] [--upload-max=BYTES] [--metrics=PATH|off]"
+                  << " [--limit-connections=COUNT] [--limit-rate=RPS] [--limit-burst=COUNT] [--limit-prefix=BITS]"
+                  << " [--trace=FILE] [--server-timing=on|off] [--trace-report=FILE] [--trace-format=text|chrome] [--check-allocs[=URL]] [--bench[=NAME,...]] [--bench-duration=SECONDS] [--bench-connections=COUNT]"
+                  << " [--bench-rate=RPS] [--bench-idle=COUNT]" << std::endl;
+        return 1;
+    }
+
+    // debug dumps are built per request and would hide the allocations being checked,
+    // and the check needs one connection to outlive all of its requests
+    if (Config::check_allocs.length() > 0)
+    {
+        if (Logger::level == LogLevel::DEBUG)
+            Logger::level = LogLevel::INFO;
+        Config::max_requests = std::max(Config::max_requests, CHECK_ALLOCS_WARMUP + CHECK_ALLOCS_REQUESTS + 1);
+    }
+
+    // benchmark clients hold connections idle on purpose and make as many requests as they can,
+    // and at loopback rates the log rings would only fill up and report dropped records
+    if (Config::bench.length() > 0)
+    {
+        Config::header_timeout = 0;
+        Config::idle_timeout = 0;
+        Config::max_requests = std::numeric_limits<size_t>::max();
+        Logger::access_format = "off";
+        if (Logger::level < LogLevel::ERROR)
+            Logger::level = LogLevel::ERROR;
+    }
+
+    // packing the docroot is done offline, without starting the server
+    if (Config::build_pack.length() > 0)
+    {
+        if (AssetPack::build(Config::build_pack))
+            return 0;
+        std::cerr << "Writing asset pack " << Config::build_pack << " failed!" << std::endl;
+        return 1;
+    }
+
+    // traces are read back offline as well
+    if (Config::trace_report.length() > 0)
+    {
+        if (Tracer::report(Config::trace_report, Config::trace_format))
+            return 0;
+        std::cerr << "Reading trace " << Config::trace_report << " failed!" << std::endl;
+        return 1;
+    }
+
+    if (!Logger::open("info.log", "access.log"))
+    {
+        std::cerr << "Log file creation failed!" << std::endl;
+        return 0;
+    }
+
+    // the templates are read from the pack as well once it is mapped
+    if (Config::pack.length() > 0 && !AssetPack::open(Config::pack))
+    {
+        Logger::error("Mapping asset pack " + Config::pack + " failed!");
+        Logger::close();
+        return 0;
+    }
 
-        if (!exists("." + request->url))
+    // uploads are created relative to the directory, so it has to exist before the first request
+    if (Config::upload_dir.length() > 0 && !Upload::open(Config::upload_dir))
+    {
+        Logger::error("Opening upload directory " + Config::upload_dir + " failed!");
+        Logger::close();
+        return 0;
+    }
+
+    if (!Templates::reload())
+    {
+        Logger::error("Compiling templates failed, using basic pages!");
+    }
+
+    // SIGUSR1 reports the cache counters
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int) { report_requested = true; };
+    sigaction(SIGUSR1, &action, nullptr);
+
+    // SIGUSR2 dumps the trace rings, the time stamp counter is calibrated before the first request
+    if (Config::trace.length() > 0 || Config::server_timing)
+    {
+        Tracer::start(Config::trace.length() > 0);
+        action.sa_handler = [](int) { trace_requested = true; };
+        sigaction(SIGUSR2, &action, nullptr);
+    }
+
+    // one event loop per core, each with its own SO_REUSEPORT listener shard
+    unsigned int cpu_count = std::thread::hardware_concurrency();
+    if (cpu_count == 0)
+    {
+        cpu_count = 1;
+    }
+    unsigned int loop_count = Config::loops > 0 ? Config::loops : cpu_count;
+
+    // the docroot is opened once, requests resolve their paths beneath it
+    if (!PathIndex::start())
+    {
+        Logger::error("Opening the docroot failed!");
+        Logger::close();
+        return 0;
+    }
+    RateLimiter::start();
+
+    // responses are built by a fixed pool sized to the cores unless configured
+    if (!WorkerPool::start(Config::workers > 0 ? Config::workers : cpu_count))
+    {
+        Logger::error("Worker pool creation failed!");
+        Logger::close();
+        return 0;
+    }
+
+    std::vector<EventLoop *> loops;
+    for (unsigned int i = 0; i < loop_count; ++i)
+    {
+        int server_fd = createListener();
+        if (server_fd < 0)
         {
-            this->status_code = 404;
-            std::cerr << "Reading directory failed with path " << request->url << std::endl;
-            Logger::log << "Reading directory failed with path " << request->url << std::endl;
+            Logger::error("Bind failed!");
+            WorkerPool::stop();
+            Logger::close();
+            return 0;
+        }
+
+        EventLoop *loop = new EventLoop(server_fd, Config::pin_cpus ? (int)(i % cpu_count) : -1);
+        if (!loop->init())
+        {
+            Logger::error("Event loop creation failed!");
+            WorkerPool::stop();
+            Logger::close();
+            return 0;
+        }
+        loops.push_back(loop);
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < loop_count; ++i)
+    {
+        threads.emplace_back(&EventLoop::run, loops[i]);
+    }
+    if (Config::check_allocs.length() > 0)
+    {
+        std::thread(checkAllocations).detach();
+    }
+    else if (Config::bench.length() > 0)
+    {
+        std::thread(Benchmark::run).detach();
+    }
+    loops[0]->run();
+
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+
+    WorkerPool::stop();
+
+    for (EventLoop *loop : loops)
+    {
+        delete loop;
+    }
+
+    Logger::close();
+
+    return 0;
+}
+
+Uring::~Uring()
+{
+    if (this->buffers != MAP_FAILED)
+        munmap(this->buffers, this->buffers_size);
+    if (this->sqes != MAP_FAILED)
+        munmap(this->sqes, this->sqes_size);
+    if (this->ring != MAP_FAILED)
+        munmap(this->ring, this->ring_size);
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+// Set up the rings, the fixed file table and the receive buffers, returns false if the kernel lacks a needed feature
+bool Uring::init(unsigned entries, unsigned files, unsigned buffer_count, size_t buffer_size)
+{
+    // multishot completions arrive in bursts, so the completion ring is larger than the submission ring
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;
+    this->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (this->fd < 0)
+        return false;
+
+    // a single mapping holds both rings, and waiting with a timeout needs the extended argument
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_NODROP))
+        return false;
+
+    this->ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    this->ring = mmap(nullptr, this->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+    this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    this->sqes = (io_uring_sqe *)mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQES);
+    if (this->ring == MAP_FAILED || this->sqes == MAP_FAILED)
+        return false;
+
+    char *base = (char *)this->ring;
+    this->sq_head = (unsigned *)(base + params.sq_off.head);
+    this->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    this->sq_array = (unsigned *)(base + params.sq_off.array);
+    this->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    this->sq_entries = params.sq_entries;
+    this->sq_local_tail = *this->sq_tail;
+    this->sq_submitted = this->sq_local_tail;
+    this->cq_head = (unsigned *)(base + params.cq_off.head);
+    this->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    this->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    this->cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // sockets are installed into free slots as they are accepted, so requests skip the file table lookup
+    io_uring_rsrc_register files_register;
+    memset(&files_register, 0, sizeof(files_register));
+    files_register.nr = files;
+    files_register.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_FILES2, &files_register, sizeof(files_register)) == 0)
+    {
+        for (unsigned i = files; i > 0; --i)
+            this->free_slots.push_back(i - 1);
+    }
+
+    // the kernel picks a receive buffer from the group only once data has arrived, so idle sockets hold none.
+    // The buffers are handed over with PROVIDE_BUFFERS, registered buffer rings stay empty on some kernels
+    this->buffer_count = buffer_count;
+    this->buffer_size = buffer_size;
+    this->buffers_size = buffer_count * buffer_size;
+    this->stranded.reserve(buffer_count);
+    this->buffers = (char *)mmap(nullptr, this->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (this->buffers == MAP_FAILED)
+        return false;
+
+    io_uring_sqe *sqe = this->sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = buffer_count;
+    sqe->addr = (uint64_t)this->buffers;
+    sqe->len = buffer_size;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    if (this->enter(1, nullptr) < 0)
+        return false;
+
+    io_uring_cqe *cqe = this->peek();
+    bool provided = cqe != nullptr && cqe->res >= 0;
+    if (cqe != nullptr)
+        this->advance();
+    if (!provided)
+        return false;
+
+    return true;
+}
+
+// Claim a zeroed submission entry, first flushing the ring if fewer than reserve entries are free.
+// The tail is published right away, which is safe because the kernel only reads entries inside enter
+io_uring_sqe *Uring::sqe(unsigned reserve)
+{
+    if (this->sq_local_tail + reserve - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) > this->sq_entries)
+    {
+        this->enter(0, nullptr);
+        if (this->sq_local_tail + reserve - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) > this->sq_entries)
+            return nullptr;
+    }
+
+    unsigned index = this->sq_local_tail & this->sq_mask;
+    io_uring_sqe *sqe = &this->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    this->sq_array[index] = index;
+    ++this->sq_local_tail;
+    __atomic_store_n(this->sq_tail, this->sq_local_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Submit the queued entries and wait for at least wait completions or the timeout, returns a negative errno on failure
+int Uring::enter(unsigned wait, const timespec *timeout)
+{
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout != nullptr)
+    {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_nsec;
+        arg.ts = (uint64_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    int result = syscall(__NR_io_uring_enter, this->fd, this->sq_local_tail - this->sq_submitted, wait, flags, &arg, sizeof(arg));
+    if (result < 0)
+        return -errno;
+
+    this->sq_submitted += result;
+    return result;
+}
+
+// Get the oldest unread completion, or nullptr if there is none
+io_uring_cqe *Uring::peek()
+{
+    unsigned head = *this->cq_head;
+    if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &this->cqes[head & this->cq_mask];
+}
+
+// Hand the oldest completion back to the kernel
+void Uring::advance()
+{
+    __atomic_store_n(this->cq_head, *this->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Get the memory of a provided receive buffer
+char *Uring::buffer(uint16_t id)
+{
+    return this->buffers + (size_t)id * this->buffer_size;
+}
+
+// Give a receive buffer back to the kernel, one whose submission found the ring full goes back with the next
+void Uring::recycle(uint16_t id)
+{
+    this->stranded.push_back(id);
+    while (!this->stranded.empty())
+    {
+        io_uring_sqe *sqe = this->sqe();
+        if (sqe == nullptr)
             return;
+
+        uint16_t next = this->stranded.back();
+        this->stranded.pop_back();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = (uint64_t)this->buffer(next);
+        sqe->len = this->buffer_size;
+        sqe->off = next;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = Uring::tagged(nullptr, TAG_IGNORE);
+    }
+}
+
+// Take a free fixed file slot, returns -1 if the table is full or unavailable
+int Uring::allocateSlot()
+{
+    if (this->free_slots.empty())
+        return -1;
+    int slot = this->free_slots.back();
+    this->free_slots.pop_back();
+    return slot;
+}
+
+// Return a fixed file slot to the free list
+void Uring::releaseSlot(int slot)
+{
+    this->free_slots.push_back(slot);
+}
+
+// Empty a fixed file slot and return it to the free list, returns false if the slot still holds its file.
+// A full submission queue falls back to the synchronous update, since the slot keeps the socket open until cleared
+bool Uring::clearSlot(int slot)
+{
+    io_uring_sqe *sqe = this->sqe();
+    if (sqe != nullptr)
+    {
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)&URING_EMPTY_SLOT;
+        sqe->len = 1;
+        sqe->off = slot;
+        sqe->user_data = Uring::tagged(nullptr, TAG_IGNORE);
+    }
+    else
+    {
+        io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = slot;
+        update.fds = (uint64_t)&URING_EMPTY_SLOT;
+        if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0)
+            return false;
+    }
+
+    this->releaseSlot(slot);
+    return true;
+}
+
+// Pack an owner pointer and a submission kind into user data
+uint64_t Uring::tagged(void *owner, Tag tag)
+{
+    return (uint64_t)owner | tag;
+}
+
+EventLoop::~EventLoop()
+{
+    if (this->server_fd >= 0)
+        close(this->server_fd);
+    if (this->epoll_fd >= 0)
+        close(this->epoll_fd);
+    if (this->event_fd >= 0)
+        close(this->event_fd);
+}
+
+// Create the epoll instance and register the listening socket
+bool EventLoop::init()
+{
+    // the ring backend takes over accept, receive and send, epoll stays the fallback
+    if (Config::io == "uring")
+    {
+        std::unique_ptr<Uring> ring(new Uring());
+        if (ring->init(URING_ENTRIES, URING_FILES, URING_BUFFERS, URING_BUFFER_SIZE))
+            this->uring = std::move(ring);
+        else
+            Logger::error("Setting up io_uring failed, falling back to epoll!");
+    }
+
+    if (this->uring != nullptr)
+    {
+        // the ring waits for the listener and the sockets itself, so they can block
+        int flags = fcntl(this->server_fd, F_GETFL);
+        fcntl(this->server_fd, F_SETFL, flags & ~O_NONBLOCK);
+        Metrics::addListener(this->server_fd);
+        this->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return this->event_fd >= 0;
+    }
+
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd < 0)
+    {
+        return false;
+    }
+
+    // the listener shard belongs to this loop alone, the kernel spreads connections across shards
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->server_fd, &ev) < 0)
+    {
+        return false;
+    }
+    Metrics::addListener(this->server_fd);
+
+    // workers signal finished jobs through the eventfd, registered with the loop itself
+    this->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->event_fd < 0)
+    {
+        return false;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = this;
+    return epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->event_fd, &ev) == 0;
+}
+
+// Wait for socket events and dispatch them to the connections
+void EventLoop::run()
+{
+    epoll_event events[MAX_EVENTS];
+
+    // keep the loop, its connections and their cache lines on one core
+    if (this->cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(this->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        {
+            Logger::error("Pinning event loop to cpu " + std::to_string(this->cpu) + " failed!");
         }
+    }
+
+#ifdef ALLOC_STATS
+    count_allocations = true;
+#endif
+
+    if (this->uring != nullptr)
+    {
+        this->runUring();
+        return;
+    }
 
-        if (!exists("." + request->url + "/index.html"))
+    while (true)
+    {
+        // wake up once per tick while any connection has a deadline
+        int count = epoll_wait(this->epoll_fd, events, MAX_EVENTS, this->timers.empty() ? -1 : TIMER_TICK_MS);
+        if (report_requested.exchange(false))
         {
-            // directory listing
-            this->status_code = 200;
-            this->content_type = "text/html";
-            this->content = HttpResponse::htmlTemplateOf("." + request->url);
+            Logger::info(FileCache::stats());
+        }
+        if (trace_requested.exchange(false))
+        {
+            size_t count = 0;
+            if (Tracer::dump(Config::trace, count))
+                Logger::info("Wrote " + std::to_string(count) + " trace records to " + Config::trace);
+            else
+                Logger::error("Writing trace " + Config::trace + " failed!");
+        }
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            Logger::error("Epoll wait failed!");
             return;
         }
 
-        // redirect to index.html inside the requested directory
-        request->url += "/index.html";
-        contentType = "text/html";
+        this->expireDeadlines();
+
+        for (int i = 0; i < count; ++i)
+        {
+            // the listening socket is registered with a null pointer
+            if (events[i].data.ptr == nullptr)
+            {
+                this->acceptConnections();
+                continue;
+            }
+
+            if (events[i].data.ptr == this)
+            {
+                this->finishJobs();
+                continue;
+            }
+
+            Connection *conn = static_cast<Connection *>(events[i].data.ptr);
+            bool keep = true;
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                keep = conn->onReadable();
+
+            if (keep && (events[i].events & EPOLLOUT))
+                keep = conn->onWritable();
+
+            if (!keep)
+                this->closeConnection(conn);
+            else
+                this->updateDeadline(conn);
+        }
     }
+}
 
-    this->content_type = contentType;
+// Accept all pending connections on the listening socket
+void EventLoop::acceptConnections()
+{
+    sockaddr_in client_addr;
+    socklen_t len = sizeof(sockaddr_in);
+    char ip_str[INET_ADDRSTRLEN] = {0};
 
-    // read the requested file
-    auto flags = std::ifstream::in;
-    if (!startsWith(this->content_type, "text/"))
+    // the listener is level-triggered, so connections left after a batch wake the loop again
+    for (size_t accepted = 0; Config::accept_batch == 0 || accepted < Config::accept_batch; ++accepted)
     {
-        flags |= std::ifstream::binary;
-    }
+        len = sizeof(sockaddr_in);
+        int conn_fd = accept4(this->server_fd, (sockaddr *)&client_addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                Logger::error("Accept failed!");
+            }
+            return;
+        }
+
+        // clients over their connection limit are turned away before any state is set up for them
+        int limit_slot = -1;
+        if (!RateLimiter::acquire(ntohl(client_addr.sin_addr.s_addr), limit_slot))
+        {
+            Metrics::add(Metrics::local()->connections_refused);
+            close(conn_fd);
+            continue;
+        }
+
+        inet_ntop(AF_INET, &(client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+
+        if (Logger::enabled(LogLevel::INFO))
+        {
+            Logger::info("Connection from " + std::string(ip_str) + ":" + std::to_string(ntohs(client_addr.sin_port)) +
+                         " with conn_fd " + std::to_string(conn_fd));
+        }
+
+        Connection *conn = new Connection(conn_fd, this);
+        memcpy(conn->ip, ip_str, sizeof(ip_str));
+        conn->limit_slot = limit_slot;
+
+        // edge-triggered, so the connection drains both directions until EAGAIN
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) < 0)
+        {
+            Logger::error("Registering conn_fd " + std::to_string(conn_fd) + " failed!");
+            delete conn;
+            close(conn_fd);
+            continue;
+        }
+
+        Metrics::add(Metrics::local()->connections_opened);
+        this->updateDeadline(conn);
+    }
+}
+
+// Allocate the client table when any limit is configured
+void RateLimiter::start()
+{
+    if (Config::limit_connections == 0 && Config::limit_rate == 0)
+        return;
+
+    size_t burst = Config::limit_burst > 0 ? Config::limit_burst : std::max<size_t>(Config::limit_rate, 1);
+    RateLimiter::capacity = burst * LIMITER_TOKEN_SCALE;
+    RateLimiter::table.reset(new Entry[LIMITER_SLOTS]);
+}
+
+// Read the coarse monotonic clock in milliseconds, wrapping every 49 days, which the differences tolerate
+uint32_t RateLimiter::now()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+    return (uint32_t)(time.tv_sec * 1000 + time.tv_nsec / 1000000);
+}
+
+// Count a new connection of the client, returns false if it already has as many as allowed.
+// The slot is left at -1 when limits are off or the client could not be given an entry
+bool RateLimiter::acquire(uint32_t address, int &slot)
+{
+    slot = -1;
+    if (RateLimiter::table == nullptr)
+        return true;
+
+    uint32_t mask = Config::limit_prefix == 0 ? 0 : ~0u << (32 - Config::limit_prefix);
+    uint64_t tag = (uint64_t)(address & mask) + 1;
+    size_t start = (size_t)((tag * 0x9e3779b97f4a7c15ull) >> 48) & (LIMITER_SLOTS - 1);
+    uint32_t now = RateLimiter::now();
+
+    // the client is looked up in its whole window first, so an aged entry in front cannot split it in two
+    size_t index = LIMITER_SLOTS;
+    for (size_t i = 0; i < LIMITER_PROBES && index == LIMITER_SLOTS; ++i)
+    {
+        size_t probe = (start + i) & (LIMITER_SLOTS - 1);
+        if (RateLimiter::table[probe].owner.load(std::memory_order_acquire) >> LIMITER_COUNT_BITS == tag)
+            index = probe;
+    }
+
+    for (size_t i = 0; i < LIMITER_PROBES && index == LIMITER_SLOTS; ++i)
+    {
+        size_t probe = (start + i) & (LIMITER_SLOTS - 1);
+        Entry &entry = RateLimiter::table[probe];
+        uint64_t owner = entry.owner.load(std::memory_order_acquire);
+        bool idle = owner == 0 || ((owner & ((1ull << LIMITER_COUNT_BITS) - 1)) == 0 &&
+                                   (int32_t)(now - (uint32_t)(entry.bucket.load(std::memory_order_relaxed) >> 32)) > (int32_t)LIMITER_IDLE_MS);
+        if (idle && entry.owner.compare_exchange_strong(owner, tag << LIMITER_COUNT_BITS, std::memory_order_acq_rel))
+        {
+            entry.bucket.store((uint64_t)now << 32 | RateLimiter::capacity, std::memory_order_relaxed);
+            index = probe;
+        }
+        else if (owner >> LIMITER_COUNT_BITS == tag)
+        {
+            index = probe;
+        }
+    }
+
+    if (index == LIMITER_SLOTS)
+        return true;
+
+    // the count only moves while the entry still belongs to the client, an entry taken over meanwhile lets it through
+    Entry &entry = RateLimiter::table[index];
+    uint64_t owner = entry.owner.load(std::memory_order_acquire);
+    do
+    {
+        if (owner >> LIMITER_COUNT_BITS != tag)
+            return true;
+        if (Config::limit_connections > 0 && (owner & ((1ull << LIMITER_COUNT_BITS) - 1)) >= Config::limit_connections)
+            return false;
+    } while (!entry.owner.compare_exchange_weak(owner, owner + 1, std::memory_order_acq_rel));
+
+    slot = (int)index;
+    return true;
+}
+
+// Uncount a closed connection of the client
+void RateLimiter::release(int slot)
+{
+    if (slot >= 0)
+        RateLimiter::table[slot].owner.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+// Take a token from the bucket of the client, refilled for the time since the last request, returns false if it is empty
+bool RateLimiter::allow(int slot)
+{
+    if (slot < 0 || Config::limit_rate == 0)
+        return true;
+
+    Entry &entry = RateLimiter::table[slot];
+    uint32_t now = RateLimiter::now();
+    uint64_t bucket = entry.bucket.load(std::memory_order_relaxed);
+    uint64_t next;
+    do
+    {
+        // a refill stored by another thread may be a little ahead of this one
+        int32_t elapsed = (int32_t)(now - (uint32_t)(bucket >> 32));
+        uint64_t tokens = std::min<uint64_t>(RateLimiter::capacity, (uint32_t)bucket + (uint64_t)std::max<int32_t>(elapsed, 0) * Config::limit_rate);
+        if (tokens < LIMITER_TOKEN_SCALE)
+            return false;
+        next = (uint64_t)(elapsed > 0 ? now : (uint32_t)(bucket >> 32)) << 32 | (tokens - LIMITER_TOKEN_SCALE);
+    } while (!entry.bucket.compare_exchange_weak(bucket, next, std::memory_order_relaxed));
+
+    return true;
+}
+
+// Create a listener shard bound to the configured port, returns -1 on failure
+int createListener()
+{
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0)
+    {
+        Logger::error("Socket creation failed!");
+        return -1;
+    }
+
+    // every shard binds the same port and gets its own accept queue
+    int enable = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        Logger::error("Setting SO_REUSEPORT failed!");
+        close(server_fd);
+        return -1;
+    }
+
+    // accepted sockets inherit these options, so they cost no syscall per connection
+    if (Config::nodelay && setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+    {
+        Logger::error("Setting TCP_NODELAY failed!");
+    }
+
+    int defer_accept = Config::defer_accept;
+    if (defer_accept > 0 && setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept)) < 0)
+    {
+        Logger::error("Setting TCP_DEFER_ACCEPT failed!");
+    }
+
+    int fastopen = Config::fastopen;
+    if (fastopen > 0 && setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) < 0)
+    {
+        Logger::error("Setting TCP_FASTOPEN failed!");
+    }
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(Config::port);
+
+    if (bind(server_fd, (sockaddr *)&server_addr, sizeof(sockaddr)) < 0 ||
+        listen(server_fd, Config::backlog) < 0)
+    {
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+// Fetch one URL over a keep-alive loopback connection and report the heap allocations per steady-state request
+void checkAllocations()
+{
+    bool passed = false;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(Config::port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd < 0 || connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        std::cerr << "Connecting to the server failed!" << std::endl;
+        Logger::close();
+        _exit(1);
+    }
+
+    std::string request = "GET " + Config::check_allocs + " HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+    std::string buffer;
+    char chunk[MAXLINE];
+
+    // send one request and read exactly one response, returns its status code or 0 on failure
+    auto fetch = [&]() -> int
+    {
+        if (send(fd, request.c_str(), request.length(), MSG_NOSIGNAL) != (ssize_t)request.length())
+            return 0;
+
+        buffer.clear();
+        size_t header_end = std::string::npos;
+        size_t total = 0;
+        while (header_end == std::string::npos || buffer.length() < total)
+        {
+            ssize_t result = recv(fd, chunk, sizeof(chunk), 0);
+            if (result <= 0)
+                return 0;
+            buffer.append(chunk, result);
+
+            if (header_end == std::string::npos && (header_end = buffer.find("\r\n\r\n")) != std::string::npos)
+            {
+                size_t length_pos = toLower(std::string_view(buffer).substr(0, header_end)).find("content-length: ");
+                total = header_end + 4 + (length_pos == std::string::npos ? 0 : strtoull(buffer.c_str() + length_pos + 16, nullptr, 10));
+            }
+        }
+        return atoi(buffer.c_str() + 9);
+    };
+
+    int status = 0;
+    for (size_t i = 0; i < CHECK_ALLOCS_WARMUP; ++i)
+        status = fetch();
+
+    if (status > 0)
+    {
+#ifdef ALLOC_STATS
+        // let the server finish the bookkeeping of the last warm-up request before counting
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        allocation_count = 0;
+        for (size_t i = 0; i < CHECK_ALLOCS_REQUESTS && status > 0; ++i)
+            status = fetch();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        unsigned long long count = allocation_count.load();
+
+        if (status > 0)
+        {
+            std::cout << "GET " << Config::check_allocs << " " << status << ": " << count << " allocations in "
+                      << CHECK_ALLOCS_REQUESTS << " requests, " << (double)count / CHECK_ALLOCS_REQUESTS << " per request" << std::endl;
+            passed = count == 0;
+        }
+#else
+        std::cerr << "Counting allocations needs a build with -DALLOC_STATS" << std::endl;
+#endif
+    }
+
+    if (status == 0)
+        std::cerr << "Fetching " << Config::check_allocs << " failed!" << std::endl;
+
+    close(fd);
+    Logger::close();
+    _exit(passed ? 0 : 1);
+}
+
+// Run the selected microbenchmarks and load scenarios, print the results as JSON and exit
+void Benchmark::run()
+{
+    // thousands of idle connections need two descriptors each in this process
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    size_t idle = Config::bench_idle;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        size_t spare = limit.rlim_cur > 2 * (BENCH_FD_RESERVE + Config::bench_connections) ? limit.rlim_cur - 2 * (BENCH_FD_RESERVE + Config::bench_connections) : 0;
+        idle = std::min(idle, spare / 2);
+    }
+
+    char buffer[256];
+    std::string json{"{"};
+    snprintf(buffer, sizeof(buffer), "\n  \"compiler\": \"%s\",\n  \"timestamp\": %lld,", __VERSION__, (long long)time(nullptr));
+    json += buffer;
+    snprintf(buffer, sizeof(buffer), "\n  \"config\": {\"duration\": %zu, \"connections\": %zu, \"rate\": %zu, \"idle\": %zu, \"loops\": %zu, \"workers\": %zu},",
+             Config::bench_duration, Config::bench_connections, Config::bench_rate, idle, Config::loops, Config::workers);
+    json += buffer;
+
+    // microbenchmarks call the request path directly, without sockets
+    json += "\n  \"micro\": [";
+    std::string head = "GET /index.html?page=1 HTTP/1.1\r\nHost: localhost:12345\r\nUser-Agent: bench\r\n"
+                       "Accept: */*\r\nAccept-Encoding: gzip, deflate, br\r\nConnection: keep-alive\r\n\r\n";
+    HttpRequest request;
+    size_t scan_pos = 0;
+    request.parse(head, scan_pos);
+
+    Benchmark::micro(json, "parse", [&](size_t iterations) {
+        HttpRequest parsed;
+        size_t sink = 0;
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            size_t pos = 0;
+            sink += parsed.parse(head, pos);
+        }
+        return sink;
+    });
+    Benchmark::micro(json, "response", [&](size_t iterations) {
+        size_t sink = 0;
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            HttpResponse response(&request);
+            sink += response.toString().length();
+        }
+        return sink;
+    });
+    Benchmark::micro(json, "error_template", [](size_t iterations) {
+        size_t sink = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            sink += HttpResponse::htmlTemplateOf(404).length();
+        return sink;
+    });
+
+    // a synthetic directory keeps the listing figure independent of the sample assets
+    DirectoryListing listing;
+    listing.path = "/bench/";
+    for (size_t i = 0; i < DEFAULT_LISTING_LIMIT; ++i)
+        listing.names += "entry-" + std::to_string(i) + (i % 4 == 0 ? "" : ".html");
+    size_t name_pos = 0;
+    for (size_t i = 0; i < DEFAULT_LISTING_LIMIT; ++i)
+    {
+        size_t length = std::to_string(i).length() + 6 + (i % 4 == 0 ? 0 : 5);
+        listing.entries.push_back({std::string_view(listing.names).substr(name_pos, length), i % 4 == 0});
+        name_pos += length;
+    }
+    std::shared_ptr<const Templates::Set> templates = Templates::current();
+    Benchmark::micro(json, "listing_template", [&](size_t iterations) {
+        size_t sink = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            sink += HttpResponse::htmlTemplateOf(templates->has_dirlist ? &templates->dirlist : nullptr, listing, 0, listing.entries.size(), "").length();
+        return sink;
+    });
+
+    const std::string_view names[] = {"index.html", "index.css", "app.js", "test.mp4", "photo.jpeg", "README", "data.json", "archive.tar.gz"};
+    Benchmark::micro(json, "content_type", [&](size_t iterations) {
+        size_t sink = 0;
+        for (size_t i = 0; i < iterations; ++i)
+            sink += HttpResponse::toContentType(names[i % (sizeof(names) / sizeof(names[0]))]).length();
+        return sink;
+    });
+    if (json.back() == ',')
+        json.pop_back();
+    json += "\n  ],";
+
+    // load scenarios go through the listeners like any other client
+    json += "\n  \"load\": [";
+    Benchmark::load(json, "small_keepalive", "/index.css", Config::bench_connections, 0);
+    Benchmark::load(json, "large_file", "/resources/test.mp4", Config::bench_connections, 0);
+    Benchmark::load(json, "not_found", "/nope.html", Config::bench_connections, 0);
+    Benchmark::load(json, "directory_listing", "/resources/", Config::bench_connections, 0);
+    Benchmark::load(json, "idle_connections", "/index.css", Config::bench_connections, idle);
+    if (json.back() == ',')
+        json.pop_back();
+    json += "\n  ]\n}\n";
+
+    std::cout << json << std::flush;
+    Logger::close();
+    _exit(0);
+}
+
+// Check if a microbenchmark or load scenario was selected with --bench
+bool Benchmark::wants(const char *name)
+{
+    if (Config::bench == "all")
+        return true;
+
+    std::string_view list{Config::bench};
+    while (list.length() > 0)
+    {
+        size_t comma = list.find(',');
+        if (list.substr(0, comma) == name)
+            return true;
+        if (comma == std::string_view::npos)
+            break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Time a microbenchmark in doubling batches until it ran for the measuring time, then append its result
+void Benchmark::micro(std::string &json, const char *name, const std::function<size_t(size_t)> &body)
+{
+    if (!Benchmark::wants(name))
+        return;
+
+    // the sink keeps the compiler from dropping the measured work
+    static std::atomic<size_t> sink{0};
+    sink += body(BENCH_MICRO_WARMUP);
+
+    size_t iterations = 0;
+    size_t batch = BENCH_MICRO_WARMUP;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{0};
+    while (elapsed < std::chrono::milliseconds(BENCH_MICRO_MS))
+    {
+        sink += body(batch);
+        iterations += batch;
+        batch *= 2;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "\n    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f},",
+             name, iterations, elapsed.count() * 1e9 / iterations, iterations / elapsed.count());
+    json += buffer;
+}
+
+// Run one load scenario, holding idle keep-alive connections open around it when asked, then append its result
+void Benchmark::load(std::string &json, const char *name, const std::string &url, size_t connections, size_t idle)
+{
+    if (!Benchmark::wants(name))
+        return;
+
+    std::string request = "GET " + url + " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nConnection: keep-alive\r\n\r\n";
+    long rss_before = Benchmark::residentKilobytes();
+
+    // idle clients make one request each in bounded waves so the accept queue never overflows, then stay silent
+    std::vector<int> idle_fds;
+    idle_fds.reserve(idle);
+    size_t idle_errors = 0;
+    while (idle_fds.size() + idle_errors < idle)
+    {
+        std::vector<Client> wave(std::min(BENCH_CONNECT_WAVE, idle - idle_fds.size() - idle_errors));
+        Load warm;
+        Benchmark::drive(wave, request, 1, 0, Config::bench_duration, warm);
+        for (Client &client : wave)
+        {
+            if (client.fd >= 0 && client.requests == 1)
+                idle_fds.push_back(client.fd);
+            else
+            {
+                ++idle_errors;
+                if (client.fd >= 0)
+                    close(client.fd);
+            }
+        }
+    }
+    long rss_idle = Benchmark::residentKilobytes();
+
+    std::vector<Client> clients(connections);
+    Load result;
+    Benchmark::drive(clients, request, 0, Config::bench_rate, Config::bench_duration, result);
+    long rss_after = Benchmark::residentKilobytes();
+
+    for (Client &client : clients)
+    {
+        if (client.fd >= 0)
+            close(client.fd);
+    }
+    for (int fd : idle_fds)
+        close(fd);
+
+    std::vector<uint32_t> &latencies = result.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double fraction) -> uint32_t {
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, (size_t)(fraction * latencies.size()))];
+    };
+    double seconds = result.seconds > 0 ? result.seconds : 1;
+
+    char buffer[768];
+    snprintf(buffer, sizeof(buffer),
+             "\n    {\"name\": \"%s\", \"url\": \"%s\", \"mode\": \"%s\", \"connections\": %zu, \"requests\": %zu, \"errors\": %zu, \"non_2xx\": %zu,"
+             " \"seconds\": %.3f, \"requests_per_sec\": %.1f, \"mbytes_per_sec\": %.2f,"
+             " \"latency_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}, \"rss_kb\": %ld",
+             name, url.c_str(), Config::bench_rate > 0 ? "open" : "closed", connections, result.requests, result.errors, result.non_2xx,
+             result.seconds, result.requests / seconds, result.bytes / seconds / (1 << 20),
+             percentile(0.5), percentile(0.99), percentile(0.999), latencies.empty() ? 0 : latencies.back(), rss_after);
+    json += buffer;
+    if (idle > 0)
+    {
+        snprintf(buffer, sizeof(buffer), ", \"idle_connections\": %zu, \"idle_errors\": %zu, \"rss_before_idle_kb\": %ld, \"rss_per_idle_bytes\": %.0f",
+                 idle_fds.size(), idle_errors, rss_before, idle_fds.empty() ? 0.0 : (rss_idle - rss_before) * 1024.0 / idle_fds.size());
+        json += buffer;
+    }
+    json += "},";
+}
+
+// Drive the clients with one request each at a time until the duration passed or each made its quota,
+// back to back when rate is zero and on a fixed schedule otherwise, so latency includes time spent waiting for a client
+bool Benchmark::drive(std::vector<Client> &clients, const std::string &request, size_t quota, size_t rate, double seconds, Load &result)
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return false;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    std::chrono::steady_clock::time_point last = start;
+    std::chrono::steady_clock::duration interval = rate > 0 ? std::chrono::steady_clock::duration(std::chrono::nanoseconds(1000000000 / rate)) : std::chrono::steady_clock::duration(0);
+    std::chrono::steady_clock::time_point next_send = start;
+    std::deque<std::chrono::steady_clock::time_point> scheduled;
+    std::vector<Client *> ready;
+
+    // write as much of the request as the socket takes, returns false on a transport error
+    auto flush = [&](Client &client) -> bool {
+        while (client.sent < request.length())
+        {
+            ssize_t result = send(client.fd, request.data() + client.sent, request.length() - client.sent, MSG_NOSIGNAL);
+            if (result < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            client.sent += result;
+        }
+        return true;
+    };
+    auto connectTo = [&](Client &client) -> bool {
+        client.fd = Benchmark::connectClient();
+        if (client.fd < 0)
+            return false;
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = &client;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.fd, &ev) == 0;
+    };
+    auto reset = [&](Client &client) {
+        if (client.fd >= 0)
+            close(client.fd);
+        client.fd = -1;
+        client.busy = false;
+    };
+    auto issue = [&](Client &client, std::chrono::steady_clock::time_point when) {
+        if (client.fd < 0 && !connectTo(client))
+        {
+            ++result.errors;
+            reset(client);
+            return;
+        }
+        client.busy = true;
+        client.in_body = false;
+        client.close_after = false;
+        client.status = 0;
+        client.sent = 0;
+        client.header.clear();
+        client.start = when;
+        if (!flush(client))
+        {
+            ++result.errors;
+            reset(client);
+        }
+    };
+    auto idle = [&](Client &client, std::chrono::steady_clock::time_point now) {
+        if (quota > 0 && client.requests >= quota)
+            return;
+        if (rate == 0 && now < deadline)
+            issue(client, now);
+        else if (rate > 0)
+            ready.push_back(&client);
+    };
+
+    for (Client &client : clients)
+        idle(client, start);
+
+    char chunk[BENCH_READ_SIZE];
+    epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        // open loop: requests fall due on schedule and queue until a client is free
+        if (rate > 0)
+        {
+            while (next_send <= now && next_send < deadline)
+            {
+                scheduled.push_back(next_send);
+                next_send += interval;
+            }
+            while (!scheduled.empty() && !ready.empty())
+            {
+                Client *client = ready.back();
+                ready.pop_back();
+                issue(*client, scheduled.front());
+                scheduled.pop_front();
+            }
+        }
+
+        size_t busy = 0;
+        size_t waiting = 0;
+        for (Client &client : clients)
+        {
+            busy += client.busy ? 1 : 0;
+            waiting += quota > 0 && client.requests < quota && !client.busy ? 1 : 0;
+        }
+        if (busy == 0 && (now >= deadline || (quota > 0 && waiting == 0) || (rate > 0 && next_send >= deadline && scheduled.empty())))
+            break;
+
+        // stragglers past the grace period count as errors
+        if (now >= deadline + std::chrono::seconds(BENCH_GRACE_SECONDS))
+        {
+            result.errors += busy;
+            break;
+        }
+
+        int timeout = 100;
+        if (rate > 0 && next_send < deadline)
+            timeout = std::max(0, (int)std::chrono::duration_cast<std::chrono::milliseconds>(next_send - now).count());
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+
+        for (int i = 0; i < count; ++i)
+        {
+            Client &client = *(Client *)events[i].data.ptr;
+            if (!client.busy)
+                continue;
+
+            if ((events[i].events & EPOLLOUT) && !flush(client))
+            {
+                ++result.errors;
+                reset(client);
+                idle(client, std::chrono::steady_clock::now());
+                continue;
+            }
+
+            bool complete = false;
+            bool failed = false;
+            while (!complete && !failed)
+            {
+                ssize_t length = recv(client.fd, chunk, sizeof(chunk), 0);
+                if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (length <= 0)
+                {
+                    failed = true;
+                    break;
+                }
+                result.bytes += length;
+
+                std::string_view data(chunk, length);
+                if (!client.in_body)
+                {
+                    size_t before = client.header.length();
+                    client.header.append(data);
+                    size_t header_end = client.header.find("\r\n\r\n");
+                    if (header_end == std::string::npos)
+                        continue;
+
+                    std::string head = toLower(std::string_view(client.header).substr(0, header_end + 2));
+                    size_t length_pos = head.find("\r\ncontent-length:");
+                    client.remaining = length_pos == std::string::npos ? 0 : strtoull(head.c_str() + length_pos + 17, nullptr, 10);
+                    client.close_after = head.find("\r\nconnection: close\r\n") != std::string::npos;
+                    client.status = atoi(head.c_str() + 9);
+                    client.in_body = true;
+                    data.remove_prefix(header_end + 4 - before);
+                }
+                client.remaining -= std::min(client.remaining, data.length());
+                complete = client.remaining == 0;
+            }
+
+            now = std::chrono::steady_clock::now();
+            if (complete)
+            {
+                client.busy = false;
+                ++client.requests;
+                ++result.requests;
+                result.non_2xx += client.status < 200 || client.status >= 300 ? 1 : 0;
+                result.latencies.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - client.start).count());
+                last = now;
+                if (client.close_after)
+                    reset(client);
+                idle(client, now);
+            }
+            else if (failed)
+            {
+                ++result.errors;
+                reset(client);
+                idle(client, now);
+            }
+        }
+    }
+
+    // idle waves keep their connections, everything else still busy is dropped
+    for (Client &client : clients)
+    {
+        if (client.busy)
+            reset(client);
+    }
+    close(epoll_fd);
+    result.seconds = std::chrono::duration<double>(last - start).count();
+    return true;
+}
+
+// Start a non-blocking connect to this server over loopback, returns -1 on failure
+int Benchmark::connectClient()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(Config::port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read the resident set size of this process, which holds both the server and the load generator
+long Benchmark::residentKilobytes()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (startsWith(line, "VmRSS:"))
+            return strtol(line.c_str() + 6, nullptr, 10);
+    }
+    return 0;
+}
+
+// Deregister and release a connection, deferred while a worker still holds it
+void EventLoop::closeConnection(Connection *conn)
+{
+    if (conn->closed)
+        return;
+
+    Metrics::add(Metrics::local()->connections_closed);
+    conn->closed = true;
+    this->timers.cancel(&conn->timer);
+    if (conn->io == nullptr)
+    {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    else
+    {
+        // stop the multishot receive and any write in flight, their completions drop the last references
+        io_uring_sqe *sqe = this->uring->sqe();
+        if (sqe != nullptr)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->io->slot >= 0 ? conn->io->slot : conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD | (conn->io->slot >= 0 ? IORING_ASYNC_CANCEL_FD_FIXED : 0);
+            sqe->user_data = Uring::tagged(conn, Uring::TAG_CONTROL);
+            ++conn->io->pending;
+        }
+        else
+        {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    this->release(conn);
+}
+
+// Free a closed connection once no worker and no ring submission refers to it anymore
+void EventLoop::release(Connection *conn)
+{
+    if (conn->processing || (conn->io != nullptr && conn->io->pending > 0) || (conn->h2 != nullptr && conn->h2->busy()))
+        return;
+
+    // the fixed file table holds its own reference, so the slot is cleared for the socket to really close.
+    // A slot that cannot be cleared stays out of the free list, and the peer is still told the connection ended
+    if (conn->io != nullptr && conn->io->slot >= 0 && !this->uring->clearSlot(conn->io->slot))
+    {
+        Logger::error("Clearing fixed file slot " + std::to_string(conn->io->slot) + " failed!");
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    close(conn->fd);
+    delete conn;
+}
+
+// Post a finished job back to the loop, called from the worker threads
+void EventLoop::complete(Job *job)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->completed_mutex);
+        this->completed.push_back(job);
+    }
+
+    uint64_t value = 1;
+    if (write(this->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        Logger::error("Signaling event loop failed!");
+    }
+}
+
+// Queue the responses built by the workers and resume their connections
+void EventLoop::finishJobs()
+{
+    uint64_t value;
+    while (read(this->event_fd, &value, sizeof(value)) > 0)
+    {
+    }
+
+    // both lists keep their capacity, so finishing jobs does not allocate
+    {
+        std::lock_guard<std::mutex> lock(this->completed_mutex);
+        this->finishing.swap(this->completed);
+    }
+
+    for (Job *job : this->finishing)
+    {
+        Connection *conn = job->conn;
+
+        // streams of a multiplexed connection finish one by one and leave the connection reading
+        if (job->stream != nullptr)
+        {
+            conn->h2->finish(job->stream);
+            if (conn->closed)
+                this->release(conn);
+            else if (!conn->onWritable())
+                this->closeConnection(conn);
+            else
+                this->updateDeadline(conn);
+            continue;
+        }
+
+        conn->processing = false;
+        conn->out.append(job->out);
+        if (!conn->timing)
+        {
+            conn->timing = true;
+            conn->response_ready = std::chrono::steady_clock::now();
+        }
+
+        // the peer went away while the response was being built
+        if (conn->closed)
+        {
+            this->release(conn);
+            continue;
+        }
+
+        // bytes that arrived meanwhile were left in the socket, so read them now
+        bool keep = conn->finishRequest() ? conn->onReadable() : conn->onWritable();
+        if (!keep)
+            this->closeConnection(conn);
+        else
+            this->updateDeadline(conn);
+    }
+    this->finishing.clear();
+}
+
+// Arm the deadline matching what the connection is waiting for
+void EventLoop::updateDeadline(Connection *conn)
+{
+    Connection::Deadline deadline;
+    size_t seconds = 0;
+    if (conn->processing)
+    {
+        // the worker answers within the queue timeout, the write deadline follows
+        deadline = Connection::Deadline::NONE;
+    }
+    else if (conn->state == Connection::State::WRITING)
+    {
+        deadline = Connection::Deadline::WRITE;
+        seconds = Config::write_timeout;
+    }
+    else if (conn->upload != nullptr)
+    {
+        // a body deadline restarts whenever bytes arrive, so a long upload only has to keep moving
+        deadline = Connection::Deadline::BODY;
+        seconds = Config::header_timeout;
+    }
+    else if (conn->h2 != nullptr)
+    {
+        // streams are answered while others are still being built, so any activity restarts the idle deadline
+        deadline = conn->h2->busy() ? Connection::Deadline::NONE : Connection::Deadline::IDLE;
+        seconds = Config::idle_timeout;
+    }
+    else if (conn->in.size() > 0 || conn->requests == 0)
+    {
+        deadline = Connection::Deadline::HEADER;
+        seconds = Config::header_timeout;
+    }
+    else
+    {
+        deadline = Connection::Deadline::IDLE;
+        seconds = Config::idle_timeout;
+    }
+
+    // a header deadline runs from the first byte, so trickling clients cannot extend it
+    if (deadline == conn->deadline && deadline != Connection::Deadline::WRITE && deadline != Connection::Deadline::BODY && conn->h2 == nullptr)
+        return;
+
+    conn->deadline = deadline;
+    if (deadline == Connection::Deadline::NONE || seconds == 0)
+        this->timers.cancel(&conn->timer);
+    else
+        this->timers.schedule(&conn->timer, seconds * 1000);
+}
+
+// Act on the connections whose deadline passed
+void EventLoop::expireDeadlines()
+{
+    this->timers.advance(this->expired);
+
+    for (Connection *conn : this->expired)
+    {
+        bool keep = conn->onTimeout();
+        conn->deadline = Connection::Deadline::NONE;
+        if (!keep)
+            this->closeConnection(conn);
+        else
+            this->updateDeadline(conn);
+    }
+    this->expired.clear();
+}
+
+// Serve the loop from the io_uring backend, one enter both submits the batch and waits for completions
+void EventLoop::runUring()
+{
+    if (!this->armAccept() || !this->armEvents())
+    {
+        Logger::error("Arming io_uring requests failed!");
+        return;
+    }
+
+    while (true)
+    {
+        // wake up once per tick while any connection has a deadline
+        timespec tick = {0, TIMER_TICK_MS * 1000000L};
+        int result = this->uring->enter(1, this->timers.empty() ? nullptr : &tick);
+        if (report_requested.exchange(false))
+        {
+            Logger::info(FileCache::stats());
+        }
+        if (trace_requested.exchange(false))
+        {
+            size_t count = 0;
+            if (Tracer::dump(Config::trace, count))
+                Logger::info("Wrote " + std::to_string(count) + " trace records to " + Config::trace);
+            else
+                Logger::error("Writing trace " + Config::trace + " failed!");
+        }
+
+        if (result < 0 && result != -EINTR && result != -ETIME && result != -EBUSY)
+        {
+            Logger::error("Io_uring enter failed!");
+            return;
+        }
+
+        this->expireDeadlines();
+
+        // each completion is copied out first, so its handler may queue new submissions
+        io_uring_cqe *cqe;
+        while ((cqe = this->uring->peek()) != nullptr)
+        {
+            io_uring_cqe completion = *cqe;
+            this->uring->advance();
+            this->onCompletion(completion);
+        }
+    }
+}
+
+// Arm a multishot accept on the listener shard
+bool EventLoop::armAccept()
+{
+    io_uring_sqe *sqe = this->uring->sqe();
+    if (sqe == nullptr)
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = this->server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = Uring::tagged(this, Uring::TAG_ACCEPT);
+    return true;
+}
+
+// Arm a multishot poll on the eventfd the workers signal
+bool EventLoop::armEvents()
+{
+    io_uring_sqe *sqe = this->uring->sqe();
+    if (sqe == nullptr)
+        return false;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = this->event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = Uring::tagged(this, Uring::TAG_EVENTS);
+    return true;
+}
+
+// Dispatch a completion to the loop itself or to the connection it belongs to
+void EventLoop::onCompletion(const io_uring_cqe &cqe)
+{
+    Uring::Tag tag = (Uring::Tag)(cqe.user_data & Uring::TAG_MASK);
+    void *owner = (void *)(cqe.user_data & ~Uring::TAG_MASK);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (tag == Uring::TAG_IGNORE)
+        return;
+
+    if (tag == Uring::TAG_ACCEPT)
+    {
+        if (cqe.res >= 0)
+            this->adopt(cqe.res);
+        else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED)
+            Logger::error("Accept failed!");
+        if (!more && !this->armAccept())
+            Logger::error("Arming accept failed!");
+        return;
+    }
+
+    if (tag == Uring::TAG_EVENTS)
+    {
+        this->finishJobs();
+        if (!more && !this->armEvents())
+            Logger::error("Arming worker events failed!");
+        return;
+    }
+
+    Connection *conn = static_cast<Connection *>(owner);
+    bool keep = conn->onCompletion(tag, cqe);
+    if (conn->closed)
+        this->release(conn);
+    else if (!keep)
+        this->closeConnection(conn);
+    else
+        this->updateDeadline(conn);
+}
+
+// Set up a connection accepted by the ring, installing its socket in a fixed file slot
+void EventLoop::adopt(int conn_fd)
+{
+    sockaddr_in client_addr;
+    socklen_t len = sizeof(client_addr);
+    char ip_str[INET_ADDRSTRLEN] = {0};
+    int limit_slot = -1;
+    if (getpeername(conn_fd, (sockaddr *)&client_addr, &len) == 0)
+    {
+        if (!RateLimiter::acquire(ntohl(client_addr.sin_addr.s_addr), limit_slot))
+        {
+            Metrics::add(Metrics::local()->connections_refused);
+            close(conn_fd);
+            return;
+        }
+        inet_ntop(AF_INET, &(client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+    }
+
+    if (Logger::enabled(LogLevel::INFO))
+    {
+        Logger::info("Connection from " + std::string(ip_str) + ":" + std::to_string(ntohs(client_addr.sin_port)) +
+                     " with conn_fd " + std::to_string(conn_fd));
+    }
+
+    Connection *conn = new Connection(conn_fd, this);
+    memcpy(conn->ip, ip_str, sizeof(ip_str));
+    conn->limit_slot = limit_slot;
+    conn->io.reset(new UringIo());
+    conn->io->fd_value = conn_fd;
+
+    // the update is linked ahead of the first receive, which then finds the socket in its slot
+    conn->io->slot = this->uring->allocateSlot();
+    if (conn->io->slot >= 0)
+    {
+        io_uring_sqe *sqe = this->uring->sqe(2);
+        if (sqe == nullptr)
+        {
+            this->uring->releaseSlot(conn->io->slot);
+            conn->io->slot = -1;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_FILES_UPDATE;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)&conn->io->fd_value;
+            sqe->len = 1;
+            sqe->off = conn->io->slot;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = Uring::tagged(conn, Uring::TAG_CONTROL);
+            ++conn->io->pending;
+        }
+    }
+
+    Metrics::add(Metrics::local()->connections_opened);
+    if (!conn->armReceive())
+    {
+        Logger::error("Arming receive for conn_fd " + std::to_string(conn_fd) + " failed!");
+        this->closeConnection(conn);
+        return;
+    }
+
+    this->updateDeadline(conn);
+}
+
+// Get the io_uring backend, or nullptr when the loop runs on epoll
+Uring *EventLoop::ring()
+{
+    return this->uring.get();
+}
+
+// Start the worker threads
+bool WorkerPool::start(unsigned int count)
+{
+    WorkerPool::queue.assign(Config::queue_size, nullptr);
+    WorkerPool::running = true;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        try
+        {
+            WorkerPool::workers.emplace_back(&WorkerPool::run);
+        }
+        catch (const std::system_error &)
+        {
+            WorkerPool::stop();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Let the workers finish the queued jobs and join them
+void WorkerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(WorkerPool::mutex);
+        WorkerPool::running = false;
+    }
+    WorkerPool::ready.notify_all();
+
+    for (std::thread &worker : WorkerPool::workers)
+    {
+        worker.join();
+    }
+    WorkerPool::workers.clear();
+}
+
+// Queue the current request of a connection, returns false if it has to be shed
+bool WorkerPool::submit(Job *job)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(WorkerPool::mutex);
+        if (WorkerPool::queue_count >= WorkerPool::queue.size() || WorkerPool::overloaded(now))
+            return false;
+
+        job->queued = now;
+        WorkerPool::queue[(WorkerPool::queue_head + WorkerPool::queue_count) % WorkerPool::queue.size()] = job;
+        ++WorkerPool::queue_count;
+    }
+    WorkerPool::ready.notify_one();
+    return true;
+}
+
+// Get the number of requests waiting for a worker
+size_t WorkerPool::depth()
+{
+    std::lock_guard<std::mutex> lock(WorkerPool::mutex);
+    return WorkerPool::queue_count;
+}
+
+// Check if the oldest queued job has waited past the timeout, the caller holds the lock
+bool WorkerPool::overloaded(std::chrono::steady_clock::time_point now)
+{
+    return WorkerPool::queue_count > 0 &&
+           now - WorkerPool::queue[WorkerPool::queue_head]->queued > std::chrono::milliseconds(Config::queue_timeout);
+}
+
+// Build responses for queued jobs and hand them back to their event loops
+void WorkerPool::run()
+{
+#ifdef ALLOC_STATS
+    count_allocations = true;
+#endif
+
+    while (true)
+    {
+        Job *job;
+        {
+            std::unique_lock<std::mutex> lock(WorkerPool::mutex);
+            WorkerPool::ready.wait(lock, [] { return WorkerPool::queue_count > 0 || !WorkerPool::running; });
+            if (WorkerPool::queue_count == 0)
+                return;
+
+            job = WorkerPool::queue[WorkerPool::queue_head];
+            WorkerPool::queue_head = (WorkerPool::queue_head + 1) % WorkerPool::queue.size();
+            --WorkerPool::queue_count;
+        }
+
+        // jobs that waited too long get the cheap 503 instead of their file
+        HttpRequest &request = *job->request;
+        std::chrono::steady_clock::time_point picked = std::chrono::steady_clock::now();
+        request.trace.picked = Tracer::now();
+        Metrics::record(Phase::QUEUE, picked - job->queued);
+        if (picked - job->queued > std::chrono::milliseconds(Config::queue_timeout))
+            request.error_status = 503;
+
+        request.sendResponse(job->conn, job->out);
+        Metrics::record(Phase::BUILD, std::chrono::steady_clock::now() - picked);
+        job->loop->complete(job);
+    }
+}
+
+// Read all available bytes and serve every complete request in the buffer
+bool Connection::onReadable()
+{
+    // the buffer is in use by a worker, reading resumes when the job is done
+    if (this->processing)
+        return true;
+
+    // the ring already delivered the bytes, those that arrived during the job were held back
+    if (this->io != nullptr && !this->io->held.empty())
+    {
+        memcpy(this->in.writable(this->io->held.length()), this->io->held.data(), this->io->held.length());
+        this->in.commit(this->io->held.length());
+        this->io->held.clear();
+    }
+
+    // an upload empties the buffer as it stores it, so reading goes on for as long as the socket has bytes
+    bool drained = this->io != nullptr;
+    do
+    {
+        // an upload body goes from the socket into its file through a pipe, without passing through the buffer
+        if (!drained && this->upload != nullptr && this->in.size() == 0 && this->upload->splicing())
+        {
+            int result = this->upload->splice(this->fd);
+            if (result < 0)
+                return false;
+            drained = result == 0;
+        }
+
+        while (!drained && this->in.size() < MAX_REQUEST_SIZE)
+        {
+            // receive straight into the reusable read buffer
+            char *buf = this->in.writable(MAXLINE);
+            int buffer_size = recv(this->fd, buf, this->in.space(), 0);
+
+            if (buffer_size < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    drained = true;
+                    break;
+                }
+
+                Logger::error("Recv failed from conn_fd " + std::to_string(this->fd));
+                return false;
+            }
+            else if (buffer_size == 0)
+            {
+                // peer closed the connection
+                return false;
+            }
+
+            this->in.commit(buffer_size);
+            if (this->request.trace.received == 0)
+                this->request.trace.received = Tracer::now();
+        }
+
+        this->processRequests();
+    } while (!drained && this->upload != nullptr && !this->processing && !this->close_after_write);
+
+    return this->onWritable();
+}
+
+Connection::~Connection()
+{
+    RateLimiter::release(this->limit_slot);
+    if (this->pipe_fds[0] >= 0)
+    {
+        close(this->pipe_fds[0]);
+        close(this->pipe_fds[1]);
+    }
+}
+
+// Resume writing the pending response chunks
+bool Connection::onWritable()
+{
+    // ring connections hand the output to the kernel and come back here when it is written
+    if (this->io != nullptr && !this->submitOutput())
+        return false;
+    if (this->io != nullptr && this->io->writes > 0)
+    {
+        this->state = State::WRITING;
+        return true;
+    }
+
+    while (this->io == nullptr && (this->pipe_pending > 0 || !this->out.empty() || (this->h2 != nullptr && this->h2->pump())))
+    {
+        // bytes already spliced into the pipe go out before anything else
+        int result = this->pipe_pending > 0 ? this->drainPipe() : 0;
+
+        if (result == 0 && this->pipe_pending == 0)
+        {
+            OutputChunk &chunk = this->out.front();
+            if (chunk.isFile())
+            {
+                result = this->sendFile(chunk);
+                if (result > 0 && chunk.remaining == 0)
+                    this->out.pop_front();
+            }
+            else
+            {
+                result = this->sendMemory();
+            }
+        }
+
+        if (result < 0)
+        {
+            Logger::error("Error sending HTTP response to conn_fd " + std::to_string(this->fd));
+            return false;
+        }
+
+        if (result == 0)
+        {
+            // wait for EPOLLOUT to resume
+            this->state = State::WRITING;
+            return true;
+        }
+    }
+
+    this->state = State::READING;
+
+    // the phases end when the last response byte is handed to the socket
+    if (this->timing)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        Metrics::record(Phase::WRITE, now - this->response_ready);
+        Metrics::record(Phase::TOTAL, now - this->request_start);
+        this->timing = false;
+    }
+
+    // a worker may be building the next request, its record is then sent when that one is built
+    if (!this->processing)
+        Tracer::finish(this->request);
+
+    if (this->processing)
+        return true;
+
+    if (this->close_after_write)
+        return false;
+
+    // requests held back by the size limit are still waiting in the socket
+    if (this->in.size() >= MAX_REQUEST_SIZE)
+        return this->onReadable();
+
+    return true;
+}
+
+// Gather the leading in-memory chunks into one write, returns 1 on progress, 0 if the socket is full and -1 on error
+int Connection::sendMemory()
+{
+    iovec iov[MAX_IOVECS];
+    size_t count = 0;
+    while (count < MAX_IOVECS && count < this->out.size() && !this->out[count].isFile())
+    {
+        OutputChunk &chunk = this->out[count];
+        iov[count].iov_base = const_cast<char *>(chunk.bytes().data() + chunk.offset);
+        iov[count].iov_len = chunk.remaining;
+        ++count;
+    }
+
+    // hint the kernel that more data follows, so the header and a file body share segments
+    int flags = MSG_NOSIGNAL;
+    if (count < this->out.size())
+        flags |= MSG_MORE;
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+
+    while (true)
+    {
+        ssize_t result = sendmsg(this->fd, &message, flags);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        Metrics::add(Metrics::local()->bytes_sent, result);
+        this->retire(result);
+        return 1;
+    }
+}
+
+// Retire the fully written chunks and advance into the partial one
+void Connection::retire(size_t written)
+{
+    while (written > 0)
+    {
+        OutputChunk &chunk = this->out.front();
+        size_t length = std::min(written, chunk.remaining);
+        chunk.offset += length;
+        chunk.remaining -= length;
+        written -= length;
+        if (chunk.remaining == 0)
+            this->out.pop_front();
+    }
+
+    // drop empty chunks so they never stall the queue
+    while (!this->out.empty() && !this->out.front().isFile() && this->out.front().remaining == 0)
+        this->out.pop_front();
+}
+
+// Stream a file range with sendfile, falling back to splice where unsupported
+int Connection::sendFile(OutputChunk &chunk)
+{
+    if (this->pipe_fds[0] >= 0)
+        return this->spliceFile(chunk);
+
+    while (true)
+    {
+        ssize_t result = sendfile(this->fd, chunk.file->fd, &chunk.offset, std::min(chunk.remaining, MAX_SENDFILE_CHUNK));
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINVAL || errno == ENOSYS)
+            {
+                if (pipe2(this->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0)
+                    return -1;
+                return this->spliceFile(chunk);
+            }
+            return -1;
+        }
+
+        // file truncated underneath us
+        if (result == 0)
+            return -1;
+
+        chunk.remaining -= result;
+        Metrics::add(Metrics::local()->bytes_sent, result);
+        return 1;
+    }
+}
+
+// Move a file range into the socket through the connection pipe
+int Connection::spliceFile(OutputChunk &chunk)
+{
+    while (true)
+    {
+        ssize_t result = splice(chunk.file->fd, &chunk.offset, this->pipe_fds[1], nullptr,
+                                std::min(chunk.remaining, PIPE_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (result == 0)
+            return -1;
+
+        chunk.remaining -= result;
+        this->pipe_pending += result;
+        return this->drainPipe() < 0 ? -1 : 1;
+    }
+}
+
+// Flush the bytes buffered in the connection pipe to the socket
+int Connection::drainPipe()
+{
+    while (this->pipe_pending > 0)
+    {
+        ssize_t result = splice(this->pipe_fds[0], nullptr, this->fd, nullptr,
+                                this->pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        this->pipe_pending -= result;
+        Metrics::add(Metrics::local()->bytes_sent, result);
+    }
+
+    return 1;
+}
+
+// Parse and respond to each complete request in the read buffer
+void Connection::processRequests()
+{
+    if (this->h2 != nullptr)
+    {
+        this->h2->process();
+        return;
+    }
+
+    while (!this->close_after_write && !this->processing)
+    {
+        std::string_view data = this->in.data();
+        size_t head_length = 0;
+
+        // the body of an upload is stored as it arrives, its head was already taken from the buffer
+        if (this->upload != nullptr)
+        {
+            if (!this->receiveUpload())
+                return;
+        }
+        else
+        {
+            // a client with prior knowledge opens with the HTTP/2 preface instead of a request
+            if (this->requests == 0 && Config::http2 && data.length() > 0 && startsWith(H2_PREFACE, data.substr(0, H2_PREFACE.length())))
+            {
+                if (data.length() < H2_PREFACE.length())
+                    return;
+                this->h2.reset(new Http2Session(this));
+                this->h2->start();
+                this->h2->process();
+                return;
+            }
+
+            // tolerate empty lines before a request
+            size_t skip = 0;
+            while (skip + 1 < data.length() && data[skip] == '\r' && data[skip + 1] == '\n')
+                skip += 2;
+            if (skip > 0)
+            {
+                this->in.consume(skip);
+                data = this->in.data();
+                this->scan_pos = 0;
+            }
+
+            // pipelined requests were received along with the one before
+            if (this->request.trace.received == 0 && data.length() > 0)
+                this->request.trace.received = Tracer::now();
+            this->request.trace.parsing = Tracer::now();
+            head_length = this->request.parse(data, this->scan_pos);
+            if (head_length == 0)
+            {
+                // header block too large to ever complete
+                if (data.length() >= MAX_REQUEST_SIZE)
+                {
+                    this->request.reset();
+                    this->request.version = "HTTP/1.1";
+                    this->request.error_status = 400;
+                    this->request.sendResponse(this, this->out);
+                    this->close_after_write = true;
+                }
+                return;
+            }
+            this->request.trace.parsed = Tracer::now();
+
+            // an upload body is not waited for, it streams through the buffer
+            if (this->request.method == HttpMethod::POST && this->request.status() == 0)
+            {
+                this->startUpload(head_length);
+                continue;
+            }
+
+            // wait for the rest of a small request body, which is discarded
+            if (this->request.error_status == 0 && data.length() < head_length + this->request.body_length)
+            {
+                return;
+            }
+        }
+
+        // a client over its request rate gets the pre-rendered 429 page instead, uploads were charged before their body
+        int status = this->request.status();
+        if (status < 400 && this->upload == nullptr && !RateLimiter::allow(this->limit_slot))
+        {
+            this->request.error_status = 429;
+            status = 429;
+        }
+        else if (status >= 400)
+        {
+            std::string message{"Error parsing HTTP request:\n"};
+            message += this->request.head;
+            Logger::error(message);
+        }
+
+        this->request_length = head_length + this->request.body_length;
+
+        // an upgrade to h2c answers the request as stream 1 of the new session
+        if (status < 400 && Config::http2 && this->upload == nullptr && Http2Session::wantsUpgrade(this->request))
+        {
+            std::unique_ptr<Http2Session> session(new Http2Session(this));
+            if (session->upgrade(this->request))
+            {
+                this->in.consume(this->request_length);
+                this->h2 = std::move(session);
+                this->h2->process();
+                return;
+            }
+        }
+        std::chrono::steady_clock::time_point parsed = std::chrono::steady_clock::now();
+        if (!this->timing)
+            this->request_start = parsed;
+
+        // the last request allowed on the connection is answered with Connection: close
+        if (++this->requests >= Config::max_requests)
+            this->request.connection = "close";
+
+        // valid requests touch the file system, so they are built by the worker pool, a stored upload is answered here
+        if (status < 400 && this->upload == nullptr)
+        {
+            if (WorkerPool::submit(&this->job))
+            {
+                this->processing = true;
+                return;
+            }
+
+            // the pool is saturated, shed the request
+            this->request.error_status = 503;
+        }
+
+        this->request.trace.picked = Tracer::now();
+        this->request.sendResponse(this, this->out);
+        if (!this->timing)
+        {
+            this->timing = true;
+            this->response_ready = std::chrono::steady_clock::now();
+            Metrics::record(Phase::BUILD, this->response_ready - parsed);
+        }
+
+        if (!this->finishRequest())
+            return;
+    }
+}
+
+// Handle a passed deadline, returns false if the connection is to be closed now
+bool Connection::onTimeout()
+{
+    bool started = (this->deadline == Deadline::HEADER && this->in.size() > 0) || this->deadline == Deadline::BODY;
+    if (this->h2 != nullptr || !started)
+    {
+        if (Logger::enabled(LogLevel::INFO))
+            Logger::info("Closing timed out conn_fd " + std::to_string(this->fd));
+        return false;
+    }
+
+    // a started request that never completed gets a 408 before closing, a partial upload is removed
+    this->request.reset();
+    this->upload.reset();
+    this->request.version = "HTTP/1.1";
+    this->request.error_status = 408;
+    this->request.sendResponse(this, this->out);
+    this->close_after_write = true;
+    return this->onWritable();
+}
+
+// Consume the served request, returns false if the connection closes after writing
+bool Connection::finishRequest()
+{
+    if (this->request.toCloseConnection() || this->request.error_status != 0)
+    {
+        this->close_after_write = true;
+        return false;
+    }
+
+    // leftover bytes stay in the buffer for the next pipelined request
+    this->in.consume(this->request_length);
+    this->upload.reset();
+    return true;
+}
+
+// Move the head of an upload out of the read buffer so the body can stream through it, and check it can be stored
+void Connection::startUpload(size_t head_length)
+{
+    this->upload.reset(new Upload());
+    this->upload->head.assign(this->in.data().substr(0, head_length));
+    this->in.consume(head_length);
+
+    // the request is parsed again so its views point into the copy
+    size_t scan = 0;
+    this->request.parse(this->upload->head, scan);
+    this->request.error_status = RateLimiter::allow(this->limit_slot) ? this->upload->begin(this->request, false) : 429;
+    if (this->request.error_status != 0)
+        return;
+
+    // a client that waits for permission before sending the body gets it once the body is known to fit
+    std::string_view expect = this->request.header("Expect");
+    if (expect.length() > 0 && !equalsIgnoreCase(expect, "100-continue"))
+        this->request.error_status = 417;
+    else if (expect.length() > 0 && this->request.version == "HTTP/1.1")
+        this->out.pushBytes("HTTP/1.1 100 Continue\r\n\r\n");
+}
+
+// Store the buffered part of an upload body, returns true once it is complete or failed
+bool Connection::receiveUpload()
+{
+    Upload &upload = *this->upload;
+    if (this->request.error_status != 0)
+        return true;
+
+    this->in.consume(upload.feed(this->in.data()));
+    if (upload.error != 0)
+    {
+        this->request.error_status = upload.error;
+        return true;
+    }
+
+    if (!upload.done())
+        return false;
+
+    this->request.error_status = upload.commit();
+    return true;
+}
+
+// Remove the partial file of an upload that did not complete
+Upload::~Upload()
+{
+    if (this->fd >= 0)
+        close(this->fd);
+    if (this->pipe_fds[0] >= 0)
+    {
+        close(this->pipe_fds[0]);
+        close(this->pipe_fds[1]);
+    }
+    if (this->temporary.length() > 0)
+        unlinkat(Upload::directory, this->temporary.c_str(), 0);
+}
+
+// Open the directory uploads are stored in
+bool Upload::open(const std::string &path)
+{
+    Upload::directory = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return Upload::directory >= 0;
+}
+
+// Check the framing of a request body and create its partial file, returns 0 or the status to refuse it with.
+// Framed bodies are delimited by the HTTP/2 stream, so they may come without a length
+int Upload::begin(const HttpRequest &request, bool framed)
+{
+    // the file is named by a url of a single segment, hidden names are kept for partial files and rule out . and ..
+    std::string_view url = request.url;
+    if (!startsWith(url, "/") || url.find('/', 1) != std::string_view::npos)
+        return 403;
+    std::string_view name = url.substr(1);
+    if (name.empty() || name[0] == '.')
+        return 403;
+
+    // stored files are never replaced, checked here to refuse before the body and again when renaming into place
+    this->name.assign(name.data(), name.length());
+    struct stat info;
+    if (fstatat(Upload::directory, this->name.c_str(), &info, AT_SYMLINK_NOFOLLOW) == 0)
+        return 409;
+
+    std::string_view encoding = request.header("Transfer-Encoding");
+    std::string_view content_length;
+    if (!request.contentLength(content_length))
+        return 400;
+    if (encoding.length() > 0)
+    {
+        if (framed || content_length.length() > 0)
+            return 400;
+        if (!equalsIgnoreCase(encoding, "chunked"))
+            return 501;
+        this->chunked = true;
+        this->state = State::SIZE;
+    }
+    else if (content_length.length() > 0)
+    {
+        uint64_t length = 0;
+        for (char c : content_length)
+        {
+            length = length * 10 + (c - '0');
+            if (length > Config::upload_max)
+                return 413;
+        }
+        this->remaining = length;
+        this->state = length > 0 ? State::DATA : State::DONE;
+    }
+    else if (framed)
+    {
+        this->sized = false;
+        this->remaining = std::numeric_limits<uint64_t>::max();
+        this->state = State::DATA;
+    }
+    else
+    {
+        return 411;
+    }
+
+    // the partial file gets a fresh hidden name, so concurrent uploads of one name do not mix
+    for (int attempt = 0; attempt < UPLOAD_ATTEMPTS && this->fd < 0; ++attempt)
+    {
+        std::string temporary = "." + this->name + "." + std::to_string(Upload::sequence.fetch_add(1, std::memory_order_relaxed));
+        this->fd = openat(Upload::directory, temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (this->fd >= 0)
+            this->temporary = temporary;
+        else if (errno != EEXIST)
+            break;
+    }
+
+    if (this->fd < 0)
+    {
+        Logger::error("Creating upload file failed with name " + this->name);
+        return 500;
+    }
+    return 0;
+}
+
+// Store body bytes, decoding the chunked framing on the way, returns how many belonged to the body.
+// Size and trailer lines are collected up to a bound, everything else is written out at once
+size_t Upload::feed(std::string_view data)
+{
+    size_t pos = 0;
+    while (pos < data.length() && this->state != State::DONE && this->error == 0)
+    {
+        if (this->state == State::DATA)
+        {
+            size_t length = std::min<uint64_t>(data.length() - pos, this->remaining);
+            if (!this->sized && this->received + length > Config::upload_max)
+            {
+                this->error = 413;
+                break;
+            }
+            if (!this->store(data.substr(pos, length)))
+                break;
+
+            pos += length;
+            this->remaining -= length;
+            if (this->remaining == 0)
+                this->state = this->chunked ? State::DATA_END : State::DONE;
+            continue;
+        }
+
+        size_t end = data.find('\n', pos);
+        size_t length = (end == std::string_view::npos ? data.length() : end + 1) - pos;
+        if (this->line.length() + length > MAX_CHUNK_LINE)
+        {
+            this->error = 400;
+            break;
+        }
+
+        this->line.append(data.substr(pos, length));
+        pos += length;
+        if (end == std::string_view::npos)
+            continue;
+
+        if (!this->onLine() && this->error == 0)
+            this->error = 400;
+        this->line.clear();
+    }
+
+    return pos;
+}
+
+// Act on a complete line of the chunked framing, returns false if it is malformed
+bool Upload::onLine()
+{
+    std::string_view line = this->line;
+    if (line.length() < 2 || line[line.length() - 2] != '\r')
+        return false;
+    line.remove_suffix(2);
+
+    if (this->state == State::DATA_END)
+    {
+        this->state = State::SIZE;
+        return line.empty();
+    }
+
+    // trailer fields have nothing to add to a stored file
+    if (this->state == State::TRAILER)
+    {
+        if (line.empty())
+            this->state = State::DONE;
+        return true;
+    }
+
+    // chunk extensions are ignored
+    line = line.substr(0, line.find(';'));
+    while (line.length() > 0 && (line.back() == ' ' || line.back() == '\t'))
+        line.remove_suffix(1);
+    if (line.empty())
+        return false;
+
+    uint64_t size = 0;
+    for (char c : line)
+    {
+        int digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+        if (digit < 0)
+            return false;
+        size = size * 16 + digit;
+        if (this->received + size > Config::upload_max)
+        {
+            this->error = 413;
+            return false;
+        }
+    }
+
+    this->remaining = size;
+    this->state = size > 0 ? State::DATA : State::TRAILER;
+    return true;
+}
+
+// Write body bytes to the partial file, returns false if storage failed
+bool Upload::store(std::string_view data)
+{
+    while (data.length() > 0)
+    {
+        ssize_t result = write(this->fd, data.data(), data.length());
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            Logger::error("Writing upload failed with name " + this->name);
+            this->error = 500;
+            return false;
+        }
+
+        data.remove_prefix(result);
+        this->received += result;
+    }
+    return true;
+}
+
+// Check if the rest of the body can be moved from the socket to the file without a copy
+bool Upload::splicing() const
+{
+    return this->state == State::DATA && !this->chunked && this->sized && this->error == 0;
+}
+
+// Move body bytes from the socket through a pipe into the file, returns 1 on progress or completion,
+// 0 if the socket is drained and -1 if it failed or closed
+int Upload::splice(int socket_fd)
+{
+    if (this->pipe_fds[0] < 0 && pipe2(this->pipe_fds, O_CLOEXEC) < 0)
+    {
+        this->error = 500;
+        return 1;
+    }
+
+    while (this->state == State::DATA && this->error == 0)
+    {
+        ssize_t result = ::splice(socket_fd, nullptr, this->pipe_fds[1], nullptr,
+                                  std::min<uint64_t>(this->remaining, PIPE_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        if (result == 0)
+            return -1;
+
+        // the pipe is emptied every round, so it never holds more than one splice
+        size_t pending = result;
+        while (pending > 0)
+        {
+            ssize_t written = ::splice(this->pipe_fds[0], nullptr, this->fd, nullptr, pending, SPLICE_F_MOVE);
+            if (written <= 0)
+            {
+                if (written < 0 && errno == EINTR)
+                    continue;
+                Logger::error("Writing upload failed with name " + this->name);
+                this->error = 500;
+                return 1;
+            }
+            pending -= written;
+        }
+
+        this->received += result;
+        this->remaining -= result;
+        if (this->remaining == 0)
+            this->state = State::DONE;
+    }
+    return 1;
+}
+
+// Check if the whole body was stored
+bool Upload::done() const
+{
+    return this->state == State::DONE || (!this->sized && this->state == State::DATA);
+}
+
+// Move a complete upload into place, returns 0 or the status to answer with
+int Upload::commit()
+{
+    if (!this->done())
+        return 400;
+
+    int result = close(this->fd);
+    this->fd = -1;
+    if (result == 0)
+        result = renameat2(Upload::directory, this->temporary.c_str(), Upload::directory, this->name.c_str(), RENAME_NOREPLACE);
+
+    // a concurrent upload of the same name got there first
+    if (result < 0 && errno == EEXIST)
+        return 409;
+    if (result < 0)
+    {
+        Logger::error("Storing upload failed with name " + this->name);
+        return 500;
+    }
+
+    if (Logger::enabled(LogLevel::INFO))
+        Logger::info("Stored upload " + this->name + " of " + std::to_string(this->received) + " bytes");
+    this->temporary.clear();
+    return 0;
+}
+
+// Point a submission at the socket, through its fixed file slot when it has one
+void Connection::target(io_uring_sqe *sqe)
+{
+    if (this->io->slot >= 0)
+    {
+        sqe->fd = this->io->slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else
+    {
+        sqe->fd = this->fd;
+    }
+}
+
+// Arm a multishot receive that takes its buffers from the provided buffer group
+bool Connection::armReceive()
+{
+    io_uring_sqe *sqe = this->loop->ring()->sqe();
+    if (sqe == nullptr)
+        return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    this->target(sqe);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = Uring::tagged(this, Uring::TAG_RECEIVE);
+    this->io->receiving = true;
+    ++this->io->pending;
+    return true;
+}
+
+// Submit the next piece of pending output unless a write is already in flight, returns false on failure.
+// Memory chunks go out gathered in one sendmsg, file ranges through a linked splice into and out of the pipe
+bool Connection::submitOutput()
+{
+    if (this->io->writes > 0)
+        return true;
+
+    while (!this->out.empty() && this->out.front().remaining == 0)
+        this->out.pop_front();
+
+    Uring *ring = this->loop->ring();
+    if (this->pipe_pending > 0)
+    {
+        io_uring_sqe *sqe = ring->sqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_SPLICE;
+        this->target(sqe);
+        sqe->splice_fd_in = this->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->off = (uint64_t)-1;
+        sqe->len = this->pipe_pending;
+        sqe->user_data = Uring::tagged(this, Uring::TAG_SPLICE_OUT);
+        this->io->writes = 1;
+        ++this->io->pending;
+        return true;
+    }
+
+    // HTTP/2 data frames are only scheduled once the previous ones are on their way
+    if (this->out.empty() && this->h2 != nullptr)
+        this->h2->pump();
+    if (this->out.empty())
+        return true;
+
+    OutputChunk &front = this->out.front();
+    if (front.isFile())
+    {
+        // the splices run in kernel workers, so the pipe blocks instead of failing with EAGAIN
+        if (this->pipe_fds[0] < 0 && pipe2(this->pipe_fds, O_CLOEXEC) < 0)
+            return false;
+
+        io_uring_sqe *sqe = ring->sqe(2);
+        if (sqe == nullptr)
+            return false;
+        unsigned length = std::min(front.remaining, PIPE_CHUNK);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = this->pipe_fds[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = front.file->fd;
+        sqe->splice_off_in = front.offset;
+        sqe->len = length;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = Uring::tagged(this, Uring::TAG_SPLICE_IN);
+
+        // a short first splice breaks the link, and the bytes it moved are drained on their own
+        sqe = ring->sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        this->target(sqe);
+        sqe->splice_fd_in = this->pipe_fds[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->off = (uint64_t)-1;
+        sqe->len = length;
+        sqe->user_data = Uring::tagged(this, Uring::TAG_SPLICE_OUT);
+        this->io->writes = 2;
+        this->io->pending += 2;
+        return true;
+    }
+
+    size_t count = 0;
+    while (count < MAX_IOVECS && count < this->out.size() && !this->out[count].isFile())
+    {
+        OutputChunk &chunk = this->out[count];
+        this->io->iov[count].iov_base = const_cast<char *>(chunk.bytes().data() + chunk.offset);
+        this->io->iov[count].iov_len = chunk.remaining;
+        ++count;
+    }
+
+    io_uring_sqe *sqe = ring->sqe();
+    if (sqe == nullptr)
+        return false;
+    memset(&this->io->message, 0, sizeof(this->io->message));
+    this->io->message.msg_iov = this->io->iov;
+    this->io->message.msg_iovlen = count;
+    sqe->opcode = IORING_OP_SENDMSG;
+    this->target(sqe);
+    sqe->addr = (uint64_t)&this->io->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (count < this->out.size() ? MSG_MORE : 0);
+    sqe->user_data = Uring::tagged(this, Uring::TAG_SEND);
+    this->io->writes = 1;
+    ++this->io->pending;
+    return true;
+}
+
+// Take bytes delivered by the ring, held back while a worker still reads the buffer, returns false to close
+bool Connection::onReceived(std::string_view data)
+{
+    if (this->processing)
+    {
+        if (this->io->held.length() + data.length() > MAX_REQUEST_SIZE)
+            return false;
+        this->io->held.append(data);
+        return true;
+    }
+
+    if (this->in.size() + data.length() > 2 * MAX_REQUEST_SIZE)
+        return false;
+    memcpy(this->in.writable(data.length()), data.data(), data.length());
+    this->in.commit(data.length());
+    if (this->request.trace.received == 0)
+        this->request.trace.received = Tracer::now();
+    return this->onReadable();
+}
+
+// Handle a completion of one of the connection's submissions, returns false if the connection is to be closed
+bool Connection::onCompletion(Uring::Tag tag, const io_uring_cqe &cqe)
+{
+    UringIo &io = *this->io;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more)
+        --io.pending;
+
+    switch (tag)
+    {
+    case Uring::TAG_RECEIVE:
+    {
+        // a receive ends when the buffer group ran dry or the peer closed, the first is rearmed
+        bool keep = cqe.res > 0 || cqe.res == -ENOBUFS;
+        if (!more)
+            io.receiving = false;
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !this->closed)
+                keep = this->onReceived(std::string_view(this->loop->ring()->buffer(id), cqe.res));
+            this->loop->ring()->recycle(id);
+        }
+        if (keep && !io.receiving && !this->closed)
+            keep = this->armReceive();
+        return keep;
+    }
+
+    case Uring::TAG_SEND:
+        --io.writes;
+        if (cqe.res < 0)
+            return false;
+        Metrics::add(Metrics::local()->bytes_sent, cqe.res);
+        this->retire(cqe.res);
+        break;
+
+    case Uring::TAG_SPLICE_IN:
+    {
+        // a file truncated underneath us ends the response
+        --io.writes;
+        if (cqe.res <= 0)
+            return false;
+        OutputChunk &chunk = this->out.front();
+        chunk.offset += cqe.res;
+        chunk.remaining -= cqe.res;
+        this->pipe_pending += cqe.res;
+        if (chunk.remaining == 0)
+            this->out.pop_front();
+        break;
+    }
+
+    case Uring::TAG_SPLICE_OUT:
+        --io.writes;
+        if (cqe.res == -ECANCELED)
+            break;
+        if (cqe.res < 0)
+            return false;
+        this->pipe_pending -= cqe.res;
+        Metrics::add(Metrics::local()->bytes_sent, cqe.res);
+        break;
+
+    default:
+        return cqe.res >= 0 || this->closed;
+    }
+
+    if (this->closed || io.writes > 0)
+        return true;
+    return this->onWritable();
+}
+
+// Decode a header block into its fields, returns false on a compression error
+bool Hpack::decode(std::string_view block, std::vector<std::pair<std::string, std::string>> &fields)
+{
+    fields.clear();
+    std::string_view data = block;
+
+    // the decoded list is bounded like an HTTP/1.1 head, since indexed fields expand a small block many times over
+    size_t list_size = 0;
+    while (data.length() > 0)
+    {
+        uint8_t first = data[0];
+        size_t index;
+        std::string_view name;
+        std::string_view value;
+
+        // indexed field
+        if (first & 0x80)
+        {
+            if (!Hpack::decodeInteger(data, 7, index) || !this->lookup(index, name, value))
+                return false;
+            list_size += name.length() + value.length() + HPACK_ENTRY_OVERHEAD;
+            if (list_size > MAX_REQUEST_SIZE)
+                return false;
+            fields.emplace_back(name, value);
+            continue;
+        }
+
+        // dynamic table size update, bounded by the size this side advertised
+        if ((first & 0xe0) == 0x20)
+        {
+            size_t size;
+            if (!Hpack::decodeInteger(data, 5, size) || size > HPACK_TABLE_SIZE)
+                return false;
+            this->max_size = size;
+            this->evict(size);
+            continue;
+        }
+
+        // literal field with incremental indexing, without indexing or never indexed
+        bool indexing = (first & 0xc0) == 0x40;
+        if (!Hpack::decodeInteger(data, indexing ? 6 : 4, index))
+            return false;
+
+        fields.emplace_back();
+        if (index > 0)
+        {
+            if (!this->lookup(index, name, value))
+                return false;
+            fields.back().first.assign(name.data(), name.length());
+        }
+        else if (!Hpack::decodeString(data, fields.back().first))
+        {
+            return false;
+        }
+
+        if (!Hpack::decodeString(data, fields.back().second))
+            return false;
+        list_size += fields.back().first.length() + fields.back().second.length() + HPACK_ENTRY_OVERHEAD;
+        if (list_size > MAX_REQUEST_SIZE)
+            return false;
+        if (indexing)
+            this->insert(fields.back().first, fields.back().second);
+    }
+
+    return true;
+}
+
+// Start a header block, announcing a table size lowered by the peer since the previous one
+void Hpack::begin(std::string &out)
+{
+    if (this->resized)
+    {
+        Hpack::encodeInteger(this->max_size, 5, 0x20, out);
+        this->resized = false;
+    }
+}
+
+// Append one field to a header block, indexing it for the following blocks when asked
+void Hpack::encode(std::string_view name, std::string_view value, bool indexing, std::string &out)
+{
+    bool exact = false;
+    size_t index = this->find(name, value, exact);
+    if (exact)
+    {
+        Hpack::encodeInteger(index, 7, 0x80, out);
+        return;
+    }
+
+    // fields larger than the whole table would only flush it
+    indexing = indexing && name.length() + value.length() + HPACK_ENTRY_OVERHEAD <= this->max_size;
+    Hpack::encodeInteger(index, indexing ? 6 : 4, indexing ? 0x40 : 0x00, out);
+    if (index == 0)
+        Hpack::encodeString(name, out);
+    Hpack::encodeString(value, out);
+    if (indexing)
+        this->insert(name, value);
+}
+
+// Apply the table size the peer allows the encoder, smaller than the default only
+void Hpack::limit(size_t size)
+{
+    size = std::min(size, HPACK_TABLE_SIZE);
+    if (size == this->max_size)
+        return;
+
+    this->max_size = size;
+    this->evict(size);
+    this->resized = true;
+}
+
+// Decode an integer with an N-bit prefix, consuming it from the data
+bool Hpack::decodeInteger(std::string_view &data, int prefix_bits, size_t &value)
+{
+    if (data.empty())
+        return false;
+
+    size_t mask = (1u << prefix_bits) - 1;
+    value = (uint8_t)data[0] & mask;
+    data.remove_prefix(1);
+    if (value < mask)
+        return true;
+
+    // continuation bytes carry seven bits each, capped well below overflow
+    for (int shift = 0; shift <= 28; shift += 7)
+    {
+        if (data.empty())
+            return false;
+        uint8_t byte = data[0];
+        data.remove_prefix(1);
+        value += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Encode an integer with an N-bit prefix, the flags filling the bits above it
+void Hpack::encodeInteger(size_t value, int prefix_bits, uint8_t flags, std::string &out)
+{
+    size_t mask = (1u << prefix_bits) - 1;
+    if (value < mask)
+    {
+        out += (char)(flags | value);
+        return;
+    }
+
+    out += (char)(flags | mask);
+    value -= mask;
+    while (value >= 0x80)
+    {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+// Decode a string literal, Huffman coded or raw, consuming it from the data
+bool Hpack::decodeString(std::string_view &data, std::string &out)
+{
+    if (data.empty())
+        return false;
+
+    bool huffman = data[0] & 0x80;
+    size_t length;
+    if (!Hpack::decodeInteger(data, 7, length) || length > data.length())
+        return false;
+
+    std::string_view literal = data.substr(0, length);
+    data.remove_prefix(length);
+    out.clear();
+    if (huffman)
+        return Hpack::huffmanDecode(literal, out);
+    out.assign(literal.data(), literal.length());
+    return true;
+}
+
+// Encode a string literal, Huffman coded when that is shorter
+void Hpack::encodeString(std::string_view value, std::string &out)
+{
+    size_t bits = 0;
+    for (unsigned char c : value)
+        bits += Hpack::HUFFMAN_LENGTHS[c];
+    size_t length = (bits + 7) / 8;
+    if (length >= value.length())
+    {
+        Hpack::encodeInteger(value.length(), 7, 0x00, out);
+        out.append(value.data(), value.length());
+        return;
+    }
+
+    Hpack::encodeInteger(length, 7, 0x80, out);
+    uint64_t pending = 0;
+    int pending_bits = 0;
+    for (unsigned char c : value)
+    {
+        pending = (pending << Hpack::HUFFMAN_LENGTHS[c]) | Hpack::HUFFMAN_CODES[c];
+        pending_bits += Hpack::HUFFMAN_LENGTHS[c];
+        while (pending_bits >= 8)
+        {
+            pending_bits -= 8;
+            out += (char)(pending >> pending_bits);
+        }
+    }
+
+    // the last byte is padded with the most significant bits of the end-of-string code, all ones
+    if (pending_bits > 0)
+        out += (char)((pending << (8 - pending_bits)) | (0xff >> pending_bits));
+}
+
+// Decode a Huffman coded string by walking the code tree bit by bit, returns false if malformed
+bool Hpack::huffmanDecode(std::string_view data, std::string &out)
+{
+    // each node has two children, leaves hold the symbol and the root is node 0
+    struct Node
+    {
+        int16_t next[2] = {-1, -1};
+        int16_t symbol = -1;
+    };
+    static const std::vector<Node> tree = [] {
+        std::vector<Node> nodes(1);
+        for (int symbol = 0; symbol <= 256; ++symbol)
+        {
+            uint32_t code = symbol < 256 ? Hpack::HUFFMAN_CODES[symbol] : 0x3fffffff;
+            int length = symbol < 256 ? Hpack::HUFFMAN_LENGTHS[symbol] : 30;
+            size_t node = 0;
+            for (int bit = length - 1; bit >= 0; --bit)
+            {
+                int branch = (code >> bit) & 1;
+                if (nodes[node].next[branch] < 0)
+                {
+                    nodes[node].next[branch] = nodes.size();
+                    nodes.emplace_back();
+                }
+                node = nodes[node].next[branch];
+            }
+            nodes[node].symbol = symbol;
+        }
+        return nodes;
+    }();
+
+    size_t node = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for (unsigned char c : data)
+    {
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            int branch = (c >> bit) & 1;
+            node = tree[node].next[branch];
+            ++depth;
+            all_ones = all_ones && branch == 1;
+            if (tree[node].symbol >= 0)
+            {
+                // the end-of-string code must never appear inside the data
+                if (tree[node].symbol == 256)
+                    return false;
+                out += (char)tree[node].symbol;
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+
+    // padding is shorter than a byte and a prefix of the end-of-string code
+    return depth < 8 && all_ones;
+}
+
+// Resolve a 1-based index into the static table followed by the dynamic table
+bool Hpack::lookup(size_t index, std::string_view &name, std::string_view &value) const
+{
+    if (index == 0)
+        return false;
+
+    if (index <= HPACK_STATIC_COUNT)
+    {
+        name = Hpack::STATIC_TABLE[index - 1].first;
+        value = Hpack::STATIC_TABLE[index - 1].second;
+        return true;
+    }
+
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= this->dynamic.size())
+        return false;
+    name = this->dynamic[index].first;
+    value = this->dynamic[index].second;
+    return true;
+}
+
+// Find the index of a field, or of its name with exact cleared, returns 0 if neither is in a table
+size_t Hpack::find(std::string_view name, std::string_view value, bool &exact) const
+{
+    size_t name_index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_COUNT; ++i)
+    {
+        if (Hpack::STATIC_TABLE[i].first != name)
+            continue;
+        if (Hpack::STATIC_TABLE[i].second == value)
+        {
+            exact = true;
+            return i + 1;
+        }
+        if (name_index == 0)
+            name_index = i + 1;
+    }
+
+    for (size_t i = 0; i < this->dynamic.size(); ++i)
+    {
+        if (this->dynamic[i].first != name)
+            continue;
+        if (this->dynamic[i].second == value)
+        {
+            exact = true;
+            return HPACK_STATIC_COUNT + 1 + i;
+        }
+        if (name_index == 0)
+            name_index = HPACK_STATIC_COUNT + 1 + i;
+    }
+
+    exact = false;
+    return name_index;
+}
+
+// Add a field to the front of the dynamic table, evicting the oldest ones to make room
+void Hpack::insert(std::string_view name, std::string_view value)
+{
+    size_t size = name.length() + value.length() + HPACK_ENTRY_OVERHEAD;
+    if (size > this->max_size)
+    {
+        this->evict(0);
+        return;
+    }
+
+    this->evict(this->max_size - size);
+    this->dynamic.emplace_front(std::string(name), std::string(value));
+    this->table_size += size;
+}
+
+// Drop the oldest entries until the table fits in the limit
+void Hpack::evict(size_t limit)
+{
+    while (this->table_size > limit && !this->dynamic.empty())
+    {
+        const std::pair<std::string, std::string> &oldest = this->dynamic.back();
+        this->table_size -= oldest.first.length() + oldest.second.length() + HPACK_ENTRY_OVERHEAD;
+        this->dynamic.pop_back();
+    }
+}
+
+// Send the server preface, a SETTINGS frame that bounds header lists and opts out of the deprecated priority tree
+void Http2Session::start()
+{
+    char payload[18];
+    const uint32_t values[3][2] = {{SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS}, {SETTINGS_MAX_HEADER_LIST_SIZE, MAX_REQUEST_SIZE}, {SETTINGS_NO_RFC7540_PRIORITIES, 1}};
+    for (int i = 0; i < 3; ++i)
+    {
+        payload[i * 6] = values[i][0] >> 8;
+        payload[i * 6 + 1] = values[i][0];
+        payload[i * 6 + 2] = values[i][1] >> 24;
+        payload[i * 6 + 3] = values[i][1] >> 16;
+        payload[i * 6 + 4] = values[i][1] >> 8;
+        payload[i * 6 + 5] = values[i][1];
+    }
+    this->writeFrame(SETTINGS, 0, 0, std::string_view(payload, sizeof(payload)));
+}
+
+// Switch an HTTP/1.1 connection that asked for h2c, its request becomes stream 1, returns false to stay on HTTP/1.1
+bool Http2Session::upgrade(HttpRequest &request)
+{
+    // the client settings travel base64url encoded and count as received
+    std::string settings;
+    std::string_view encoded = request.header("HTTP2-Settings");
+    uint32_t bits = 0;
+    int bit_count = 0;
+    for (char c : encoded)
+    {
+        const char *digit = strchr(BASE64URL_DIGITS, c);
+        if (c == '=')
+            break;
+        if (c == '\0' || digit == nullptr)
+            return false;
+        bits = (bits << 6) | (digit - BASE64URL_DIGITS);
+        bit_count += 6;
+        if (bit_count >= 8)
+        {
+            bit_count -= 8;
+            settings += (char)(bits >> bit_count);
+        }
+    }
+    if (settings.length() % 6 != 0)
+        return false;
+
+    this->conn->out.pushBytes("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    this->start();
+    if (!this->onSettings(0, 0, settings, false))
+        return true;
+
+    // the upgraded request was complete, so stream 1 starts half closed
+    Http2Stream *stream = this->openStream(1);
+    this->last_stream = 1;
+    std::string path{request.url};
+    if (request.query.length() > 0)
+        path.append("?").append(request.query);
+    stream->fields.emplace_back(":method", request.head.substr(0, request.head.find(' ')));
+    stream->fields.emplace_back(":scheme", "http");
+    stream->fields.emplace_back(":path", std::move(path));
+    for (const auto &field : request.headers)
+    {
+        std::string name = toLower(field.first);
+        if (name != "connection" && name != "upgrade" && name != "http2-settings" && name != "keep-alive")
+            stream->fields.emplace_back(std::move(name), std::string(field.second));
+    }
+
+    if (!this->loadRequest(stream))
+    {
+        this->resetStream(1, PROTOCOL_ERROR);
+        this->close(stream);
+        return true;
+    }
+    this->dispatch(stream);
+    return true;
+}
+
+// Consume the complete frames in the read buffer
+void Http2Session::process()
+{
+    Connection *conn = this->conn;
+    while (!conn->close_after_write)
+    {
+        std::string_view data = conn->in.data();
+        if (!this->preface)
+        {
+            // a partial preface is checked as far as it goes
+            if (H2_PREFACE.substr(0, data.length()) != data.substr(0, H2_PREFACE.length()))
+            {
+                this->fail(PROTOCOL_ERROR, "Invalid connection preface");
+                break;
+            }
+            if (data.length() < H2_PREFACE.length())
+                break;
+            conn->in.consume(H2_PREFACE.length());
+            this->preface = true;
+            continue;
+        }
+
+        if (data.length() < H2_FRAME_HEADER)
+            break;
+
+        size_t length = ((uint8_t)data[0] << 16) | ((uint8_t)data[1] << 8) | (uint8_t)data[2];
+        if (length > H2_MAX_FRAME)
+        {
+            this->fail(FRAME_SIZE_ERROR, "Frame exceeds the maximum size");
+            break;
+        }
+        if (data.length() < H2_FRAME_HEADER + length)
+            break;
+
+        uint8_t type = data[3];
+        uint8_t flags = data[4];
+        uint32_t stream_id = Http2Session::readUint32(data.substr(5)) & 0x7fffffff;
+        bool ok = this->onFrame(type, flags, stream_id, data.substr(H2_FRAME_HEADER, length));
+        conn->in.consume(H2_FRAME_HEADER + length);
+        if (!ok)
+            break;
+    }
+
+    this->settle();
+}
+
+// Turn the response a worker built into frames, or drop it if the stream was reset meanwhile
+void Http2Session::finish(Http2Stream *stream)
+{
+    if (stream->working)
+    {
+        stream->working = false;
+        --this->working;
+    }
+
+    if (this->conn->closed)
+        return;
+
+    if (stream->reset)
+    {
+        stream->job.out.clear();
+        this->close(stream);
+    }
+    else
+    {
+        this->respond(stream);
+    }
+    this->settle();
+}
+
+// Queue DATA frames of the streams with the best priority until the burst is used up or the windows are closed,
+// returns true if anything was queued. Bursts keep the output queue short, so priorities apply as streams come and go
+bool Http2Session::pump()
+{
+    // after an upgrade the body of stream 1 waits for the client preface, clients only buffer so much behind the 101
+    size_t queued = 0;
+    while (this->preface && queued < H2_PUMP_BYTES && this->send_window > 0)
+    {
+        Http2Stream *stream = this->next();
+        if (stream == nullptr)
+            break;
+
+        size_t length = std::min({stream->remaining, (size_t)stream->window, (size_t)this->send_window, this->max_frame});
+        bool last = length == stream->remaining;
+        this->writeFrameHeader(length, DATA, last ? END_STREAM : 0, stream->id);
+        this->frameData(stream, length);
+        stream->window -= length;
+        this->send_window -= length;
+        queued += length + H2_FRAME_HEADER;
+
+        // the phases of a stream end when its last frame is queued
+        if (last)
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            Metrics::record(Phase::WRITE, now - stream->ready);
+            Metrics::record(Phase::TOTAL, now - stream->start);
+            Tracer::finish(stream->request);
+            this->close(stream);
+        }
+    }
+
+    if (queued > 0)
+        this->settle();
+    return queued > 0;
+}
+
+// Check if a worker is still building a response for one of the streams
+bool Http2Session::busy() const
+{
+    return this->working > 0;
+}
+
+// Check if an HTTP/1.1 request asks to switch to h2c and can
+bool Http2Session::wantsUpgrade(const HttpRequest &request)
+{
+    if (request.version != "HTTP/1.1" || request.body_length > 0 || request.header("HTTP2-Settings").length() == 0)
+        return false;
+
+    std::string_view upgrade = request.header("Upgrade");
+    while (upgrade.length() > 0)
+    {
+        size_t comma = upgrade.find(',');
+        std::string_view token = upgrade.substr(0, comma);
+        upgrade = comma == std::string_view::npos ? std::string_view() : upgrade.substr(comma + 1);
+        while (token.length() > 0 && token.front() == ' ')
+            token.remove_prefix(1);
+        while (token.length() > 0 && token.back() == ' ')
+            token.remove_suffix(1);
+        if (equalsIgnoreCase(token, "h2c"))
+            return true;
+    }
+    return false;
+}
+
+// Handle one frame, returns false once the connection failed
+bool Http2Session::onFrame(uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload)
+{
+    // a header block split over frames has to be finished before anything else
+    if (this->continuation != 0 && (type != CONTINUATION || stream_id != this->continuation))
+        return this->fail(PROTOCOL_ERROR, "Expected CONTINUATION frame");
+
+    if (!this->configured && type != SETTINGS)
+        return this->fail(PROTOCOL_ERROR, "Connection preface without SETTINGS");
+
+    switch (type)
+    {
+    case DATA:
+        return this->onData(flags, stream_id, payload);
+
+    case HEADERS:
+        return this->onHeaders(flags, stream_id, payload);
+
+    case PRIORITY:
+        if (stream_id == 0)
+            return this->fail(PROTOCOL_ERROR, "PRIORITY frame on stream 0");
+        if (payload.length() != 5)
+            this->resetStream(stream_id, FRAME_SIZE_ERROR);
+        return true;
+
+    case RST_STREAM:
+    {
+        if (stream_id == 0 || stream_id > this->last_stream)
+            return this->fail(PROTOCOL_ERROR, "RST_STREAM frame on an idle stream");
+        if (payload.length() != 4)
+            return this->fail(FRAME_SIZE_ERROR, "RST_STREAM frame of invalid size");
+        auto it = this->streams.find(stream_id);
+        if (it != this->streams.end())
+            this->close(it->second.get());
+        return true;
+    }
+
+    case SETTINGS:
+        return this->onSettings(flags, stream_id, payload, true);
+
+    case PUSH_PROMISE:
+        return this->fail(PROTOCOL_ERROR, "PUSH_PROMISE frame from a client");
+
+    case PING:
+        if (stream_id != 0)
+            return this->fail(PROTOCOL_ERROR, "PING frame on a stream");
+        if (payload.length() != 8)
+            return this->fail(FRAME_SIZE_ERROR, "PING frame of invalid size");
+        if (!(flags & ACK))
+            this->writeFrame(PING, ACK, 0, payload);
+        return true;
+
+    case GOAWAY:
+        if (stream_id != 0)
+            return this->fail(PROTOCOL_ERROR, "GOAWAY frame on a stream");
+        this->draining = true;
+        return true;
+
+    case WINDOW_UPDATE:
+        return this->onWindowUpdate(stream_id, payload);
+
+    case CONTINUATION:
+        if (this->continuation == 0)
+            return this->fail(PROTOCOL_ERROR, "Unexpected CONTINUATION frame");
+        if (this->header_block.length() + payload.length() > MAX_REQUEST_SIZE)
+            return this->fail(ENHANCE_YOUR_CALM, "Header block too large");
+        this->header_block.append(payload.data(), payload.length());
+        if (flags & END_HEADERS)
+        {
+            this->continuation = 0;
+            return this->onHeaderBlock(stream_id, this->continuation_flags & END_STREAM);
+        }
+        return true;
+
+    case PRIORITY_UPDATE:
+        if (stream_id != 0)
+            return this->fail(PROTOCOL_ERROR, "PRIORITY_UPDATE frame on a stream");
+        return this->onPriorityUpdate(payload);
+
+    default:
+        // unknown frame types are ignored
+        return true;
+    }
+}
+
+// Start collecting a header block, which opens a stream or carries the trailers of one
+bool Http2Session::onHeaders(uint8_t flags, uint32_t stream_id, std::string_view payload)
+{
+    if (stream_id == 0 || stream_id % 2 == 0)
+        return this->fail(PROTOCOL_ERROR, "HEADERS frame on an invalid stream");
+
+    if (flags & PADDED)
+    {
+        size_t padding = payload.length() > 0 ? (uint8_t)payload[0] : 0;
+        if (payload.length() == 0 || padding >= payload.length())
+            return this->fail(PROTOCOL_ERROR, "HEADERS frame with invalid padding");
+        payload = payload.substr(1, payload.length() - 1 - padding);
+    }
+
+    // the dependency and weight of the deprecated priority scheme are skipped
+    if (flags & PRIORITY_FLAG)
+    {
+        if (payload.length() < 5)
+            return this->fail(FRAME_SIZE_ERROR, "HEADERS frame too short for its priority");
+        payload.remove_prefix(5);
+    }
+
+    this->header_block.assign(payload.data(), payload.length());
+    if (!(flags & END_HEADERS))
+    {
+        this->continuation = stream_id;
+        this->continuation_flags = flags;
+        return true;
+    }
+    return this->onHeaderBlock(stream_id, flags & END_STREAM);
+}
+
+// Decode a complete header block and open or end its stream
+bool Http2Session::onHeaderBlock(uint32_t stream_id, bool end_stream)
+{
+    uint64_t received = Tracer::now();
+
+    // refused streams are decoded as well, since the table state depends on every block
+    if (!this->decoder.decode(this->header_block, this->decoded))
+        return this->fail(COMPRESSION_ERROR, "Decoding header block failed");
+
+    if (stream_id <= this->last_stream)
+    {
+        // trailers end the request body of an open stream
+        auto it = this->streams.find(stream_id);
+        if (it == this->streams.end() || it->second->dispatched || !end_stream)
+        {
+            this->resetStream(stream_id, it == this->streams.end() || it->second->dispatched ? STREAM_CLOSED : PROTOCOL_ERROR);
+            if (it != this->streams.end())
+                this->close(it->second.get());
+            return true;
+        }
+        this->dispatch(it->second.get());
+        return true;
+    }
+
+    this->last_stream = stream_id;
+    if (this->draining)
+        return true;
+
+    if (this->streams.size() >= H2_MAX_STREAMS)
+    {
+        this->resetStream(stream_id, REFUSED_STREAM);
+        return true;
+    }
+
+    Http2Stream *stream = this->openStream(stream_id);
+    stream->fields.swap(this->decoded);
+    stream->request.trace.received = received;
+    stream->request.trace.parsing = received;
+    if (!this->loadRequest(stream))
+    {
+        this->resetStream(stream_id, PROTOCOL_ERROR);
+        this->close(stream);
+        return true;
+    }
+    stream->request.trace.parsed = Tracer::now();
+
+    // an upload is stored as its DATA frames arrive, a refused one is answered before its body
+    if (stream->request.method == HttpMethod::POST && stream->request.status() == 0)
+    {
+        stream->upload.reset(new Upload());
+        stream->request.error_status = RateLimiter::allow(this->conn->limit_slot) ? stream->upload->begin(stream->request, true) : 429;
+        if (stream->request.error_status != 0)
+            end_stream = true;
+    }
+
+    if (end_stream)
+        this->dispatch(stream);
+    return true;
+}
+
+// Account for a piece of request body, stored for uploads and discarded otherwise like on HTTP/1.1
+bool Http2Session::onData(uint8_t flags, uint32_t stream_id, std::string_view payload)
+{
+    if (stream_id == 0 || stream_id > this->last_stream)
+        return this->fail(PROTOCOL_ERROR, "DATA frame on an idle stream");
+
+    // the whole frame counts against the windows, which open again at once since nothing is buffered
+    size_t length = payload.length();
+    char increment[4] = {(char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length};
+    if (length > 0)
+        this->writeFrame(WINDOW_UPDATE, 0, 0, std::string_view(increment, 4));
+
+    auto it = this->streams.find(stream_id);
+    if (it == this->streams.end() || it->second->dispatched)
+        return true;
+
+    Http2Stream *stream = it->second.get();
+    size_t padding = 0;
+    if (flags & PADDED)
+    {
+        padding = length > 0 ? (uint8_t)payload[0] + 1 : 0;
+        if (length == 0 || padding > length)
+            return this->fail(PROTOCOL_ERROR, "DATA frame with invalid padding");
+    }
+
+    // uploads store the payload, other bodies are discarded, and either is answered right away when it is refused
+    std::string_view data = payload.substr(padding > 0 ? 1 : 0, length - padding);
+    if (stream->upload != nullptr)
+    {
+        size_t stored = stream->upload->feed(data);
+        stream->request.error_status = stream->upload->error;
+
+        // a body longer than its Content-Length is malformed
+        if (stored < data.length() && stream->request.error_status == 0)
+            stream->request.error_status = 400;
+    }
+    else
+    {
+        stream->request.body_length += data.length();
+        if (stream->request.body_length > MAX_REQUEST_SIZE)
+            stream->request.error_status = 413;
+    }
+
+    if (stream->request.error_status != 0)
+    {
+        this->dispatch(stream);
+        return true;
+    }
+
+    if (flags & END_STREAM)
+        this->dispatch(stream);
+    else if (length > 0)
+        this->writeFrame(WINDOW_UPDATE, 0, stream_id, std::string_view(increment, 4));
+    return true;
+}
+
+// Apply the peer settings and acknowledge them unless they came with the upgrade request
+bool Http2Session::onSettings(uint8_t flags, uint32_t stream_id, std::string_view payload, bool acknowledge)
+{
+    if (stream_id != 0)
+        return this->fail(PROTOCOL_ERROR, "SETTINGS frame on a stream");
+
+    if (flags & ACK)
+    {
+        if (payload.length() > 0)
+            return this->fail(FRAME_SIZE_ERROR, "SETTINGS acknowledgement with a payload");
+        return true;
+    }
+
+    if (payload.length() % 6 != 0)
+        return this->fail(FRAME_SIZE_ERROR, "SETTINGS frame of invalid size");
+
+    for (size_t pos = 0; pos < payload.length(); pos += 6)
+    {
+        uint16_t key = ((uint8_t)payload[pos] << 8) | (uint8_t)payload[pos + 1];
+        uint32_t value = Http2Session::readUint32(payload.substr(pos + 2));
+        switch (key)
+        {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            this->encoder.limit(value);
+            break;
+
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+                return this->fail(PROTOCOL_ERROR, "Invalid SETTINGS_ENABLE_PUSH");
+            break;
+
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            // the change applies to the windows of all open streams
+            if (value > H2_MAX_WINDOW)
+                return this->fail(FLOW_CONTROL_ERROR, "Invalid SETTINGS_INITIAL_WINDOW_SIZE");
+            int64_t delta = (int64_t)value - this->initial_window;
+            for (auto &entry : this->streams)
+            {
+                entry.second->window += delta;
+                if (entry.second->window > H2_MAX_WINDOW)
+                    return this->fail(FLOW_CONTROL_ERROR, "Stream window overflow");
+            }
+            this->initial_window = value;
+            break;
+        }
+
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_MAX_FRAME || value > H2_FRAME_SIZE_LIMIT)
+                return this->fail(PROTOCOL_ERROR, "Invalid SETTINGS_MAX_FRAME_SIZE");
+            this->max_frame = std::min<size_t>(value, H2_SEND_FRAME_LIMIT);
+            break;
+
+        default:
+            // unknown settings are ignored
+            break;
+        }
+    }
+
+    this->configured = true;
+    if (acknowledge)
+        this->writeFrame(SETTINGS, ACK, 0, std::string_view());
+    return true;
+}
+
+// Open the send window of the connection or of a stream
+bool Http2Session::onWindowUpdate(uint32_t stream_id, std::string_view payload)
+{
+    if (payload.length() != 4)
+        return this->fail(FRAME_SIZE_ERROR, "WINDOW_UPDATE frame of invalid size");
+
+    uint32_t increment = Http2Session::readUint32(payload) & 0x7fffffff;
+    if (stream_id == 0)
+    {
+        if (increment == 0)
+            return this->fail(PROTOCOL_ERROR, "WINDOW_UPDATE of zero");
+        this->send_window += increment;
+        if (this->send_window > H2_MAX_WINDOW)
+            return this->fail(FLOW_CONTROL_ERROR, "Connection window overflow");
+        return true;
+    }
+
+    // updates for streams that already finished are expected and ignored
+    auto it = this->streams.find(stream_id);
+    if (it == this->streams.end())
+        return true;
+
+    Http2Stream *stream = it->second.get();
+    stream->window += increment;
+    if (increment == 0 || stream->window > H2_MAX_WINDOW)
+    {
+        this->resetStream(stream_id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        this->close(stream);
+    }
+    return true;
+}
+
+// Change the priority of an open stream, RFC 9218
+bool Http2Session::onPriorityUpdate(std::string_view payload)
+{
+    if (payload.length() < 4)
+        return this->fail(FRAME_SIZE_ERROR, "PRIORITY_UPDATE frame too short");
+
+    auto it = this->streams.find(Http2Session::readUint32(payload) & 0x7fffffff);
+    if (it != this->streams.end())
+        Http2Session::parsePriority(payload.substr(4), it->second.get());
+    return true;
+}
+
+// Create a stream whose job builds its response like a request of an HTTP/1.1 connection
+Http2Stream *Http2Session::openStream(uint32_t stream_id)
+{
+    std::unique_ptr<Http2Stream> stream(new Http2Stream());
+    stream->id = stream_id;
+    stream->window = this->initial_window;
+    stream->start = std::chrono::steady_clock::now();
+    stream->job.conn = this->conn;
+    stream->job.loop = this->conn->loop;
+    stream->job.request = &stream->request;
+    stream->job.stream = stream.get();
+    ++this->conn->requests;
+
+    Http2Stream *result = stream.get();
+    this->streams[stream_id] = std::move(stream);
+    return result;
+}
+
+// Point the request of a stream at its decoded fields, returns false if they are malformed
+bool Http2Session::loadRequest(Http2Stream *stream)
+{
+    HttpRequest &request = stream->request;
+    request.reset();
+
+    std::string_view method;
+    std::string_view path;
+    std::string_view authority;
+    bool scheme = false;
+    bool regular = false;
+    for (const auto &field : stream->fields)
+    {
+        std::string_view name = field.first;
+        std::string_view value = field.second;
+        if (name.empty() || std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; }))
+            return false;
+
+        // pseudo-header fields come first and only the request ones are allowed
+        if (name[0] == ':')
+        {
+            if (regular)
+                return false;
+            if (name == ":method")
+                method = value;
+            else if (name == ":path")
+                path = value;
+            else if (name == ":scheme")
+                scheme = true;
+            else if (name == ":authority")
+                authority = value;
+            else
+                return false;
+            continue;
+        }
+
+        // connection-specific fields have no meaning on a multiplexed connection
+        regular = true;
+        if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" ||
+            name == "upgrade" || (name == "te" && value != "trailers"))
+            return false;
+
+        if (name == "priority")
+            Http2Session::parsePriority(value, stream);
+        request.headers.emplace_back(name, value);
+    }
+
+    if (method.empty() || path.empty() || !scheme)
+        return false;
+    if (authority.length() > 0 && request.header("Host").empty())
+        request.headers.emplace_back("host", authority);
+
+    // the access log and error messages expect a request line
+    stream->line.assign(method.data(), method.length()).append(SP).append(path).append(" HTTP/2");
+    request.head = stream->line;
+    request.method = HttpRequest::toMethod(method);
+    request.version = "HTTP/2";
+    request.connection = "keep-alive";
+    request.setTarget(path);
+    return true;
+}
+
+// Hand a complete request to the workers, answering it inline if it is invalid or has to be shed
+void Http2Session::dispatch(Http2Stream *stream)
+{
+    stream->dispatched = true;
+    HttpRequest &request = stream->request;
+    if (stream->upload != nullptr && request.error_status == 0)
+        request.error_status = stream->upload->commit();
+
+    int status = request.status();
+    if (status < 400 && stream->upload == nullptr && !RateLimiter::allow(this->conn->limit_slot))
+    {
+        request.error_status = 429;
+        status = 429;
+    }
+
+    if (status < 400)
+    {
+        if (WorkerPool::submit(&stream->job))
+        {
+            stream->working = true;
+            ++this->working;
+            return;
+        }
+        request.error_status = 503;
+    }
+
+    request.trace.picked = Tracer::now();
+    request.sendResponse(this->conn, stream->job.out);
+    this->finish(stream);
+}
+
+// Send the head of a built response as HEADERS, re-encoding the HTTP/1.1 fields the worker rendered.
+// The encoder runs on the loop in wire order, so its dynamic table stays in step with the peer
+void Http2Session::respond(Http2Stream *stream)
+{
+    ChunkQueue &out = stream->job.out;
+    OutputChunk &head_chunk = out.front();
+    std::string_view head = head_chunk.bytes().substr(head_chunk.offset, head_chunk.remaining);
+
+    std::string &block = this->scratch;
+    block.clear();
+    this->encoder.begin(block);
+    size_t line_end = head.find(CRLF);
+    size_t space = head.find(' ');
+    this->encoder.encode(":status", head.substr(space + 1, 3), true, block);
+
+    size_t pos = line_end + 2;
+    while (pos < head.length())
+    {
+        size_t end = head.find(CRLF, pos);
+        std::string_view line = head.substr(pos, end - pos);
+        pos = end + 2;
+        size_t colon = line.find(':');
+        if (line.empty() || colon == std::string_view::npos)
+            break;
+
+        this->field_name.assign(line.data(), colon);
+        for (char &c : this->field_name)
+            c = tolower((unsigned char)c);
+        std::string_view value = line.substr(colon + 1);
+        while (value.length() > 0 && value.front() == ' ')
+            value.remove_prefix(1);
+
+        if (this->field_name == "connection" || this->field_name == "keep-alive" || this->field_name == "transfer-encoding")
+            continue;
+
+        // fields that differ on every response would only churn the table
+        bool indexing = this->field_name != "content-length" && this->field_name != "content-range";
+        this->encoder.encode(this->field_name, value, indexing, block);
+    }
+
+    out.pop_front();
+    stream->body.append(out);
+    stream->remaining = 0;
+    for (size_t i = 0; i < stream->body.size(); ++i)
+        stream->remaining += stream->body[i].remaining;
+    stream->responded = true;
+    stream->ready = std::chrono::steady_clock::now();
+
+    // HEADERS are not flow controlled, so the head goes out at once, split to the frame size of the peer
+    size_t offset = 0;
+    do
+    {
+        size_t length = std::min(block.length() - offset, this->max_frame);
+        uint8_t flags = offset + length == block.length() ? END_HEADERS : 0;
+        if (offset == 0 && stream->remaining == 0)
+            flags |= END_STREAM;
+        this->writeFrameHeader(length, offset == 0 ? HEADERS : CONTINUATION, flags, stream->id);
+        this->conn->out.pushBytes(std::string_view(block).substr(offset, length));
+        offset += length;
+    } while (offset < block.length());
+
+    if (stream->remaining == 0)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        Metrics::record(Phase::WRITE, now - stream->ready);
+        Metrics::record(Phase::TOTAL, now - stream->start);
+        Tracer::finish(stream->request);
+        this->close(stream);
+    }
+}
+
+// Pick the stream to send the next DATA frame of, RFC 9218: lower urgency first,
+// within it non-incremental streams in order of their id and incremental ones in turn
+Http2Stream *Http2Session::next()
+{
+    Http2Stream *best = nullptr;
+    for (auto &entry : this->streams)
+    {
+        Http2Stream *stream = entry.second.get();
+        if (!stream->responded || stream->remaining == 0 || stream->window <= 0)
+            continue;
+
+        if (best == nullptr || stream->urgency < best->urgency)
+        {
+            best = stream;
+        }
+        else if (stream->urgency == best->urgency && best->incremental)
+        {
+            if (!stream->incremental || (best->id <= this->rotation && stream->id > this->rotation))
+                best = stream;
+        }
+    }
+
+    if (best != nullptr && best->incremental)
+        this->rotation = best->id;
+    return best;
+}
+
+// Move the next bytes of a response body to the output as the payload of a DATA frame
+void Http2Session::frameData(Http2Stream *stream, size_t length)
+{
+    ChunkQueue &out = this->conn->out;
+    stream->remaining -= length;
+    while (length > 0)
+    {
+        // files and shared bodies are referenced, only generated bodies are copied
+        OutputChunk &chunk = stream->body.front();
+        size_t part = std::min(length, chunk.remaining);
+        if (chunk.isFile())
+            out.pushFile(chunk.file, chunk.offset, part);
+        else if (chunk.owner != nullptr)
+            out.pushShared(chunk.owner, chunk.shared, chunk.offset, part);
+        else
+            out.pushBytes(std::string_view(chunk.data).substr(chunk.offset, part));
+
+        chunk.offset += part;
+        chunk.remaining -= part;
+        length -= part;
+        if (chunk.remaining == 0)
+            stream->body.pop_front();
+    }
+}
+
+// Forget a finished or reset stream, kept until its worker is done with it
+void Http2Session::close(Http2Stream *stream)
+{
+    if (stream->working)
+    {
+        stream->reset = true;
+        return;
+    }
+    this->streams.erase(stream->id);
+}
+
+// Tell the peer a stream is abandoned
+void Http2Session::resetStream(uint32_t stream_id, ErrorCode error)
+{
+    char payload[4] = {(char)(error >> 24), (char)(error >> 16), (char)(error >> 8), (char)error};
+    this->writeFrame(RST_STREAM, 0, stream_id, std::string_view(payload, 4));
+}
+
+// Fail the connection with a GOAWAY that closes it once written, returns false for the caller to pass on
+bool Http2Session::fail(ErrorCode error, std::string_view reason)
+{
+    Logger::error("HTTP/2 error on conn_fd " + std::to_string(this->conn->fd) + ": " + std::string(reason));
+
+    char payload[8];
+    for (int i = 0; i < 4; ++i)
+    {
+        payload[i] = this->last_stream >> (24 - i * 8);
+        payload[i + 4] = (uint32_t)error >> (24 - i * 8);
+    }
+    this->writeFrame(GOAWAY, 0, 0, std::string_view(payload, 8));
+    this->conn->close_after_write = true;
+    return false;
+}
+
+// Close the connection after a GOAWAY from the peer once the remaining streams are done
+void Http2Session::settle()
+{
+    if (this->draining && this->streams.empty())
+        this->conn->close_after_write = true;
+}
+
+// Queue a frame header
+void Http2Session::writeFrameHeader(size_t length, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+    char header[H2_FRAME_HEADER] = {(char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags,
+                                    (char)(stream_id >> 24), (char)(stream_id >> 16), (char)(stream_id >> 8), (char)stream_id};
+    this->conn->out.pushBytes(std::string_view(header, H2_FRAME_HEADER));
+}
+
+// Queue a complete frame
+void Http2Session::writeFrame(uint8_t type, uint8_t flags, uint32_t stream_id, std::string_view payload)
+{
+    this->writeFrameHeader(payload.length(), type, flags, stream_id);
+    if (payload.length() > 0)
+        this->conn->out.pushBytes(payload);
+}
+
+// Read the urgency and incremental parameters of a Priority field value, RFC 9218
+void Http2Session::parsePriority(std::string_view value, Http2Stream *stream)
+{
+    while (value.length() > 0)
+    {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+        while (item.length() > 0 && item.front() == ' ')
+            item.remove_prefix(1);
+        while (item.length() > 0 && item.back() == ' ')
+            item.remove_suffix(1);
+
+        if (item.length() == 3 && item.substr(0, 2) == "u=" && item[2] >= '0' && item[2] <= '7')
+            stream->urgency = item[2] - '0';
+        else if (item == "i" || item == "i=?1")
+            stream->incremental = true;
+        else if (item == "i=?0")
+            stream->incremental = false;
+    }
+}
+
+// Read a big-endian 32-bit number
+uint32_t Http2Session::readUint32(std::string_view data)
+{
+    return ((uint32_t)(uint8_t)data[0] << 24) | ((uint32_t)(uint8_t)data[1] << 16) | ((uint32_t)(uint8_t)data[2] << 8) | (uint8_t)data[3];
+}
+
+// Get the unconsumed bytes
+std::string_view ReadBuffer::data() const
+{
+    return std::string_view(this->buffer.data() + this->begin, this->end - this->begin);
+}
+
+// Get the number of unconsumed bytes
+size_t ReadBuffer::size() const
+{
+    return this->end - this->begin;
+}
+
+// Make room for at least min_space bytes at the end, invalidating views into the buffer
+char *ReadBuffer::writable(size_t min_space)
+{
+    if (this->buffer.size() - this->end < min_space)
+    {
+        // move the unconsumed bytes to the front before growing
+        if (this->begin > 0)
+        {
+            memmove(this->buffer.data(), this->buffer.data() + this->begin, this->end - this->begin);
+            this->end -= this->begin;
+            this->begin = 0;
+        }
+
+        if (this->buffer.size() - this->end < min_space)
+        {
+            this->buffer.resize(std::max(this->buffer.size() * 2, this->end + min_space));
+        }
+    }
+
+    return this->buffer.data() + this->end;
+}
+
+// Get the free space at the end
+size_t ReadBuffer::space() const
+{
+    return this->buffer.size() - this->end;
+}
+
+// Append bytes written into the space returned by writable
+void ReadBuffer::commit(size_t length)
+{
+    this->end += length;
+}
+
+// Drop bytes from the front
+void ReadBuffer::consume(size_t length)
+{
+    this->begin += std::min(length, this->end - this->begin);
+    if (this->begin == this->end)
+    {
+        this->begin = 0;
+        this->end = 0;
+    }
+}
+
+// Check if the node is in a wheel slot
+bool TimerNode::linked() const
+{
+    return this->next != nullptr;
+}
+
+TimerWheel::TimerWheel() : current(TimerWheel::currentTick()), count(0)
+{
+    // every slot is the sentinel of a circular list
+    for (int level = 0; level < TIMER_LEVELS; ++level)
+    {
+        for (int slot = 0; slot < TIMER_SLOTS; ++slot)
+        {
+            this->slots[level][slot].prev = &this->slots[level][slot];
+            this->slots[level][slot].next = &this->slots[level][slot];
+        }
+    }
+}
+
+// Get the monotonic time in ticks
+uint64_t TimerWheel::currentTick()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+// Check if no timer is pending
+bool TimerWheel::empty() const
+{
+    return this->count == 0;
+}
+
+// Move a node to expire after the delay, rounded up to whole ticks
+void TimerWheel::schedule(TimerNode *node, uint64_t delay_ms)
+{
+    this->cancel(node);
+
+    // an empty wheel is not advanced while the loop sleeps, so catch up first
+    if (this->count == 0)
+        this->current = TimerWheel::currentTick();
+
+    node->expires = this->current + std::max<uint64_t>(1, (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+    this->insert(node);
+    ++this->count;
+}
+
+// Unlink a node if it is pending
+void TimerWheel::cancel(TimerNode *node)
+{
+    if (!node->linked())
+        return;
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+    --this->count;
+}
+
+// Link a node into the slot of the coarsest level that still resolves its expiry
+void TimerWheel::insert(TimerNode *node)
+{
+    uint64_t delta = node->expires > this->current ? node->expires - this->current : 0;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))))
+        ++level;
+
+    // beyond the last level the node waits in its farthest slot and cascades again
+    uint64_t limit = ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+    uint64_t expires = delta > limit ? this->current + limit : node->expires;
+
+    TimerNode *head = &this->slots[level][(expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+// Advance to the current tick, collecting the owners of expired nodes
+void TimerWheel::advance(std::vector<Connection *> &expired)
+{
+    uint64_t target = TimerWheel::currentTick();
+    while (this->current < target)
+    {
+        ++this->current;
+
+        // when a level wraps, the next slot of the level above is redistributed
+        for (int level = 1; level < TIMER_LEVELS; ++level)
+        {
+            if ((this->current & (((uint64_t)1 << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+                break;
+
+            TimerNode *head = &this->slots[level][(this->current >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+            TimerNode *node = head->next;
+            head->prev = head;
+            head->next = head;
+            while (node != head)
+            {
+                TimerNode *next = node->next;
+                this->insert(node);
+                node = next;
+            }
+        }
+
+        TimerNode *head = &this->slots[0][this->current & (TIMER_SLOTS - 1)];
+        while (head->next != head)
+        {
+            TimerNode *node = head->next;
+            if (node->expires > this->current)
+            {
+                // clamped far timers are rescheduled into the remaining distance
+                this->cancel(node);
+                this->insert(node);
+                ++this->count;
+                continue;
+            }
+            this->cancel(node);
+            expired.push_back(node->conn);
+        }
+    }
+}
+
+// Convert to a string with all lower case characters
+std::string toLower(std::string_view original)
+{
+    std::string result{original};
+    for (size_t i = 0; i < result.length(); ++i)
+    {
+        result[i] = static_cast<char>(std::tolower(result[i]));
+    }
+    return result;
+}
+
+// Check if base string starts with compare string
+bool startsWith(std::string_view base, std::string_view compare)
+{
+    if (compare.length() <= 0 || base.length() < compare.length())
+    {
+        return false;
+    }
+    return base.compare(0, compare.length(), compare) == 0;
+}
+
+// Check if base string ends with compare string
+bool endsWith(std::string_view base, std::string_view compare)
+{
+    if (compare.length() <= 0 || base.length() < compare.length())
+    {
+        return false;
+    }
+    return base.compare(base.length() - compare.length(), std::string_view::npos, compare) == 0;
+}
+
+// Replace substring in base string with specified string
+bool replaceAll(std::string &base, std::string_view old_value, std::string_view new_value)
+{
+    size_t pos = base.find(old_value);
+
+    if (pos == std::string::npos)
+    {
+        return false;
+    }
+
+    // continue after the replacement instead of rescanning from the start
+    do
+    {
+        base.replace(pos, old_value.length(), new_value);
+        pos = base.find(old_value, pos + new_value.length());
+    } while (pos != std::string::npos);
+
+    return true;
+}
+
+// Compare two strings ignoring ASCII case
+bool equalsIgnoreCase(std::string_view base, std::string_view compare)
+{
+    if (base.length() != compare.length())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < base.length(); ++i)
+    {
+        if (std::tolower(base[i]) != std::tolower(compare[i]))
+            return false;
+    }
+    return true;
+}
+
+// Switch a file descriptor to non-blocking mode
+bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+    {
+        return false;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+HttpResponse::HttpResponse(HttpRequest *request)
+    : arena(Arena::acquire()),
+      version(request->version),
+      status_code(500),
+      content_type(""),
+      content(""),
+      connection("close"),
+      file_fd(-1),
+      file_size(0),
+      last_modified(0),
+      extra_headers(arena),
+      etag(arena),
+      validators(arena),
+      content_encoding(arena),
+      ranges(arena),
+      range_headers(arena),
+      range_length(0),
+      generated(arena)
+{
+    // a request refused before its end was found leaves the connection unusable, so it closes after the response
+    this->connection = request->toCloseConnection() || request->error_status != 0 ? "close" : "keep-alive";
+
+    // check for bad request
+    int status = request->status();
+    if (status >= 400)
+    {
+        this->status_code = status;
+        if (status == 503 || status == 429)
+        {
+            this->connection = "close";
+            this->extra_headers += "Retry-After: ";
+            this->extra_headers += std::to_string(RETRY_AFTER_SECONDS);
+            this->extra_headers += CRLF;
+        }
+        return;
+    }
+
+    // the connection stored the body before the request got here, so only the outcome is left to report
+    if (request->method == HttpMethod::POST)
+    {
+        this->status_code = 201;
+        return;
+    }
+
+    // live counters merged from all threads, never cached
+    if (Config::metrics_path.length() > 0 && request->url == Config::metrics_path)
+    {
+        this->status_code = 200;
+        this->content_type = "text/plain; version=0.0.4; charset=utf-8";
+        this->content = Metrics::render();
+        this->extra_headers += "Cache-Control: no-store\r\n";
+        return;
+    }
+
+    // parse the requested object
+    size_t pos = request->url.find_last_of("/");
+    if (pos == std::string::npos || pos + 1 >= request->url.length())
+    {
+        this->status_code = 400;
+        Logger::error("Unknown request object with url ", request->url);
+        return;
+    }
+
+    std::string_view name = std::string_view(request->url).substr(pos + 1);
+    std::string_view contentType = HttpResponse::toContentType(name);
+    if (startsWith(contentType, "Error"))
+    {
+        this->status_code = 415;
+        Logger::error("Unknown file type with name " + std::string(name));
+        return;
+    }
+
+    // directory requested
+    if (endsWith(contentType, "directory"))
+    {
+        // this->status_code = 403;
+        // std::cerr << "Missing file extension with name " << name << std::endl;
+
+        // a directory whose index.html is packed needs no filesystem checks, listings are still read from disk
+        bool packed_index = AssetPack::loaded() && AssetPack::lookup(request->url + "/index.html") != nullptr;
+        thread_local std::string directory;
+        directory.assign(".").append(request->url);
+        struct stat info;
+        if (!packed_index && !PathIndex::lookup(directory, info))
+        {
+            this->status_code = 404;
+            Logger::error("Reading directory failed with path ", request->url);
+            return;
+        }
+
+        if (!packed_index && !PathIndex::lookup(directory.append("/index.html"), info))
+        {
+            // directory listing, read and rendered once until the directory changes
+            std::shared_ptr<const DirectoryListing> listing = DirectoryCache::lookup("." + request->url);
+            if (listing == nullptr)
+            {
+                this->status_code = 404;
+                Logger::error("Listing directory failed with path ", request->url);
+                return;
+            }
+
+            this->status_code = 200;
+            this->applyListing(request, listing);
+            return;
+        }
+
+        // redirect to index.html inside the requested directory
+        request->url += "/index.html";
+        contentType = "text/html";
+    }
+
+    this->content_type = contentType;
+
+    // the path is built in a per-thread buffer that keeps its capacity
+    thread_local std::string path;
+    path.assign(".").append(request->url);
+
+    // a mapped asset pack answers for every file, anything it does not hold is missing
+    if (AssetPack::loaded())
+    {
+        this->cached = AssetPack::lookup(request->url);
+        if (this->cached == nullptr)
+        {
+            this->status_code = 404;
+            Logger::error("Packed file missing with path ", request->url);
+            return;
+        }
+    }
+    else
+    {
+        // the index knows missing files as well, so floods of 404s do not reach the file system
+        struct stat info;
+        if (!PathIndex::lookup(path, info) || !S_ISREG(info.st_mode))
+        {
+            this->status_code = 404;
+            Logger::error("Reading file failed with path ", request->url);
+            return;
+        }
+
+        // serve hot files straight from the shared cache
+        this->cached = FileCache::lookup(path, info);
+    }
+
+    if (this->cached == nullptr)
+    {
+        // open the requested file beneath the docroot, the body is streamed later without copying
+        this->file_fd = PathIndex::open(path, O_RDONLY);
+        if (this->file_fd < 0)
+        {
+            this->status_code = 404;
+            Logger::error("Reading file failed with path ", request->url);
+            return;
+        }
+
+        struct stat info;
+        if (fstat(this->file_fd, &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            close(this->file_fd);
+            this->file_fd = -1;
+            this->status_code = 404;
+            Logger::error("Reading file size failed with path ", request->url);
+            return;
+        }
+
+        this->file_size = info.st_size;
+        this->last_modified = info.st_mtime;
+        this->etag = HttpResponse::toEntityTag(info, this->arena);
+        this->validators = HttpResponse::validatorsOf(this->etag, this->last_modified, request->url, this->arena);
+
+        // keep small files in memory for the following requests
+        this->cached = FileCache::load(path, this->content_type, this->validators, this->file_fd, info);
+        if (this->cached != nullptr)
+        {
+            close(this->file_fd);
+            this->file_fd = -1;
+        }
+    }
+
+    // open file successful
+    this->status_code = 200;
+    this->applyEncoding(request, path);
+
+    if (this->cached != nullptr)
+    {
+        this->last_modified = this->cached->mtime.tv_sec;
+    }
+
+    if (!this->applyConditionals(request))
+        this->applyRanges(request);
+}
+
+// Select the listing format and page from the query and the Accept header
+void HttpResponse::applyListing(HttpRequest *request, const std::shared_ptr<const DirectoryListing> &listing)
+{
+    std::string_view format = request->parameter("format");
+    bool json = format == "json" || (format.length() == 0 && request->header("Accept").find("application/json") != std::string_view::npos);
+    this->content_type = json ? "application/json" : "text/html";
+    this->extra_headers += "Vary: Accept\r\n";
+
+    std::string_view page_value = request->parameter("page");
+    std::string_view limit_value = request->parameter("limit");
+    if (page_value.length() == 0 && limit_value.length() == 0)
+    {
+        // the whole listing is shared with the cache without copying
+        this->shared_owner = listing;
+        this->shared_body = json ? listing->json : listing->html;
+        return;
+    }
+
+    size_t page = 1;
+    size_t limit = DEFAULT_LISTING_LIMIT;
+    if ((page_value.length() > 0 && !Config::parseSize(std::string(page_value), page)) ||
+        (limit_value.length() > 0 && !Config::parseSize(std::string(limit_value), limit)) ||
+        page == 0 || limit == 0)
+    {
+        this->status_code = 400;
+        return;
+    }
+
+    size_t total = listing->entries.size();
+    size_t begin = std::min(total, (page - 1) * limit);
+    size_t end = std::min(total, begin + limit);
+
+    // a page is rendered in the arena and copied into the output queue
+    if (json)
+    {
+        this->generated = HttpResponse::jsonOf(*listing, begin, end, page, limit, this->arena);
+        return;
+    }
+
+    char navigation[160];
+    int length = 0;
+    if (page > 1)
+        length += snprintf(navigation, sizeof(navigation), "\n<li><a href=\"?page=%zu&limit=%zu\">Previous page</a></li>", page - 1, limit);
+    if (end < total)
+        length += snprintf(navigation + length, sizeof(navigation) - length, "\n<li><a href=\"?page=%zu&limit=%zu\">Next page</a></li>", page + 1, limit);
+
+    this->generated = HttpResponse::htmlTemplateOf(listing->templates->has_dirlist ? &listing->templates->dirlist : nullptr,
+                                                   *listing, begin, end, std::string_view(navigation, length), this->arena);
+}
+
+// Switch to the best encoded variant the client accepts
+void HttpResponse::applyEncoding(HttpRequest *request, const std::string &path)
+{
+    if (!HttpResponse::isCompressible(this->content_type))
+    {
+        return;
+    }
+
+    ContentEncoding encodings[ENCODING_COUNT];
+    int count = HttpResponse::negotiateEncodings(request->header("Accept-Encoding"), encodings);
+
+    for (int i = 0; i < count; ++i)
+    {
+        // cached files keep their variants in memory next to the identity body
+        if (this->cached != nullptr)
+        {
+            std::shared_ptr<const CacheEntry> variant = FileCache::variantOf(this->cached, encodings[i]);
+            if (variant != nullptr)
+            {
+                this->cached = variant;
+                this->content_encoding = ENCODING_NAMES[(int)encodings[i]];
+                return;
+            }
+            continue;
+        }
+
+        // large files are only served from precompressed siblings
+        int index = (int)encodings[i];
+        thread_local std::string sibling;
+        sibling.assign(path).append(ENCODING_SUFFIXES[index]);
+        struct stat info;
+        if (!PathIndex::lookup(sibling, info) || !S_ISREG(info.st_mode))
+        {
+            continue;
+        }
+
+        int fd = PathIndex::open(sibling, O_RDONLY);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            close(fd);
+            continue;
+        }
+
+        close(this->file_fd);
+        this->file_fd = fd;
+        this->file_size = info.st_size;
+        this->last_modified = info.st_mtime;
+        this->etag = HttpResponse::toEntityTag(info, this->arena);
+        this->etag.insert(this->etag.length() - 1, "-");
+        this->etag.insert(this->etag.length() - 1, ENCODING_NAMES[index]);
+        this->validators = HttpResponse::validatorsOf(this->etag, this->last_modified, path, this->arena);
+        this->content_encoding = ENCODING_NAMES[index];
+        return;
+    }
+}
+
+// Answer 304 Not Modified when the client copy is still valid, returns true if so
+bool HttpResponse::applyConditionals(HttpRequest *request)
+{
+    // If-None-Match takes precedence over If-Modified-Since
+    std::string_view if_none_match = request->header("If-None-Match");
+    if (if_none_match.length() > 0)
+    {
+        while (if_none_match.length() > 0)
+        {
+            size_t comma = if_none_match.find(',');
+            std::string_view tag = if_none_match.substr(0, comma);
+            if_none_match = comma == std::string_view::npos ? std::string_view() : if_none_match.substr(comma + 1);
+
+            while (tag.length() > 0 && tag.front() == ' ')
+                tag.remove_prefix(1);
+            while (tag.length() > 0 && tag.back() == ' ')
+                tag.remove_suffix(1);
+
+            // weak comparison
+            if (tag.substr(0, 2) == "W/")
+                tag.remove_prefix(2);
+
+            if (tag == "*" || tag == this->entityTag())
+            {
+                this->status_code = 304;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string_view if_modified_since = request->header("If-Modified-Since");
+    if (if_modified_since.length() > 0)
+    {
+        time_t since = HttpResponse::parseHttpDate(if_modified_since);
+        if (since >= 0 && this->last_modified <= since)
+        {
+            this->status_code = 304;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Select the byte ranges of the file body requested with Range and If-Range
+void HttpResponse::applyRanges(HttpRequest *request)
+{
+    std::string_view range = request->header("Range");
+    if (range.length() == 0)
+    {
+        return;
+    }
+
+    // a stale validator turns the request into a full download
+    std::string_view if_range = request->header("If-Range");
+    if (if_range.length() > 0)
+    {
+        // entity tags need a strong match, anything else is a date
+        bool is_tag = if_range.front() == '"' || if_range.substr(0, 2) == "W/";
+        if (is_tag ? if_range != this->entityTag() : if_range != HttpResponse::toHttpDate(this->last_modified))
+            return;
+    }
+
+    off_t size = this->contentLength();
+    int result = HttpResponse::parseRanges(range, size, this->ranges);
+    if (result < 0)
+    {
+        this->ranges.clear();
+        return;
+    }
+
+    // the headers are formatted in place, so they are carved from the arena like their containers
+    char line[96];
+    if (result == 0)
+    {
+        this->status_code = 416;
+        this->extra_headers.append(line, snprintf(line, sizeof(line), "Content-Range: bytes */%lld\r\n", (long long)size));
+        return;
+    }
+
+    this->status_code = 206;
+    if (this->ranges.size() == 1)
+    {
+        off_t start = this->ranges[0].first;
+        off_t length = this->ranges[0].second;
+        this->range_length = length;
+        this->extra_headers.append(line, snprintf(line, sizeof(line), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                                                  (long long)start, (long long)(start + length - 1), (long long)size));
+        return;
+    }
+
+    // each part of a multipart/byteranges body carries its own header
+    this->range_length = 0;
+    this->range_headers.reserve(this->ranges.size() + 1);
+    for (size_t i = 0; i < this->ranges.size(); ++i)
+    {
+        off_t start = this->ranges[i].first;
+        off_t length = this->ranges[i].second;
+        std::pmr::string &part = this->range_headers.emplace_back(i == 0 ? "" : CRLF);
+        part += "--";
+        part += HttpResponse::BYTERANGES_BOUNDARY;
+        part += CRLF;
+        part += "Content-Type: ";
+        part += this->content_type;
+        part += CRLF;
+        part.append(line, snprintf(line, sizeof(line), "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                                   (long long)start, (long long)(start + length - 1), (long long)size));
+        this->range_length += part.length() + length;
+    }
+
+    std::pmr::string &closing = this->range_headers.emplace_back(CRLF);
+    closing += "--";
+    closing += HttpResponse::BYTERANGES_BOUNDARY;
+    closing += "--";
+    closing += CRLF;
+    this->range_length += closing.length();
+}
+
+// Queue the file or cached body, or the selected ranges of it, on the output queue
+void HttpResponse::queueBody(ChunkQueue &out)
+{
+    // pre-rendered error pages are shared, generated pages are moved into the queue
+    if (this->error_page != nullptr)
+    {
+        out.pushShared(this->error_page, this->error_page->body, 0, this->error_page->body.length());
+        return;
+    }
+
+    if (!this->hasFileBody() && !this->hasCachedBody())
+    {
+        if (this->shared_owner != nullptr && this->status_code == 200)
+            out.pushShared(this->shared_owner, this->shared_body, 0, this->shared_body.length());
+        else if (this->status_code == 200 && this->generated.length() > 0)
+            out.pushBytes(this->generated);
+        else if (this->status_code != 304 && this->content.length() > 0)
+            out.pushString(std::move(this->content));
+        return;
+    }
+
+    // all chunks share the opened file, which closes after the last one is sent
+    long long length = this->contentLength();
+    std::shared_ptr<FileDescriptor> file;
+    if (this->hasFileBody())
+    {
+        file = std::make_shared<FileDescriptor>(this->file_fd);
+        this->file_fd = -1;
+    }
+
+    auto queueRange = [&](off_t start, size_t length) {
+        if (length == 0)
+            return;
+        if (file != nullptr)
+            out.pushFile(file, start, length);
+        else
+            out.pushShared(this->cached, this->cached->body(), start, length);
+    };
+
+    if (this->ranges.empty())
+    {
+        queueRange(0, length);
+        return;
+    }
+
+    if (this->ranges.size() == 1)
+    {
+        queueRange(this->ranges[0].first, this->ranges[0].second);
+        return;
+    }
+
+    for (size_t i = 0; i < this->ranges.size(); ++i)
+    {
+        out.pushBytes(this->range_headers[i]);
+        queueRange(this->ranges[i].first, this->ranges[i].second);
+    }
+    out.pushBytes(this->range_headers.back());
+}
+
+HttpResponse::~HttpResponse()
+{
+    if (this->file_fd >= 0)
+        close(this->file_fd);
+
+    // the members still to be destroyed only hand their blocks back to the arena, which ignores them
+    Arena::release();
+}
+
+// Get the arena of the calling thread, created on first use
+Arena::State &Arena::local()
+{
+    thread_local State state;
+    return state;
+}
+
+// Take the arena of the calling thread for one more response
+std::pmr::memory_resource *Arena::acquire()
+{
+    State &state = Arena::local();
+    ++state.users;
+    return &state.resource;
+}
+
+// Give the arena back, rewinding it to the start of its buffer once no response uses it
+void Arena::release()
+{
+    State &state = Arena::local();
+    if (--state.users == 0)
+        state.resource.release();
+}
+
+// Allocate a block past the arena buffer from the heap
+void *Arena::Spill::do_allocate(size_t bytes, size_t alignment)
+{
+    Metrics::add(Metrics::local()->arena_spills);
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+// Free a block taken from the heap when the arena is rewound
+void Arena::Spill::do_deallocate(void *pointer, size_t bytes, size_t alignment)
+{
+    std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+}
+
+// Spilled blocks can only be freed by the spill of the same arena
+bool Arena::Spill::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+    return this == &other;
+}
+
+// Check if the body is streamed from the opened file
+bool HttpResponse::hasFileBody() const
+{
+    return this->file_fd >= 0 && (this->status_code == 200 || this->status_code == 206);
+}
+
+// Check if the body is shared with the file cache
+bool HttpResponse::hasCachedBody() const
+{
+    return this->cached != nullptr && (this->status_code == 200 || this->status_code == 206);
+}
+
+// Get the length of the stored content
+long long HttpResponse::contentLength() const
+{
+    if (this->status_code == 206)
+        return this->range_length;
+    if (this->cached != nullptr)
+        return this->cached->body().length();
+    if (this->file_fd >= 0)
+        return this->file_size;
+    if (this->shared_owner != nullptr)
+        return this->shared_body.length();
+    if (this->generated.length() > 0)
+        return this->generated.length();
+    return this->content.length();
+}
+
+// Get the entity tag of the selected representation
+std::string_view HttpResponse::entityTag() const
+{
+    return this->cached != nullptr ? std::string_view(this->cached->etag) : std::string_view(this->etag);
+}
+
+// Get the length of the body actually sent, including error pages
+long long HttpResponse::bodyLength() const
+{
+    if (this->error_page != nullptr)
+        return this->error_page->body.length();
+    if (this->status_code == 304)
+        return 0;
+    return this->contentLength();
+}
+
+// Generate the response message or debug message
+std::string HttpResponse::toString(bool debug)
+{
+    // construct the debug message
+    if (debug)
+    {
+        std::string value{""};
+        value += "HttpResponse {";
+        value += ("\n\tversion: " + this->version);
+        value += ("\n\tstatus_code: " + std::to_string(this->status_code));
+        value += "\n\tcontent_type: ";
+        value += this->content_type;
+        value += ("\n\tcontent_length: " + std::to_string(this->contentLength()));
+        value += "\n\tconnection: ";
+        value += this->connection;
+        value += ("\n\tis_file_opened: ");
+        value += (this->file_fd >= 0) ? "true" : "false";
+        value += ("\n\tis_cached: ");
+        value += (this->cached != nullptr) ? "true" : "false";
+        value += "\n}\n";
+        return value;
+    }
+
+    std::string response{this->headerString()};
+
+    if (this->error_page != nullptr)
+    {
+        response += this->error_page->body;
+        return response;
+    }
+
+    // file and cached bodies are sent separately by the connection
+    if (!this->hasFileBody() && !this->hasCachedBody())
+        response += this->shared_owner != nullptr ? this->shared_body : this->generated.length() > 0 ? std::string_view(this->generated) : std::string_view(this->content);
+
+    return response;
+}
+
+// Generate the status line and header block, valid until the next call on the same thread
+std::string_view HttpResponse::headerString()
+{
+    if (this->status_code < 200 || this->status_code >= 400)
+    {
+        this->error_page = Templates::errorPageOf(this->status_code);
+    }
+
+    // format into a per-thread buffer that keeps its capacity, the caller copies it out once
+    thread_local std::string response;
+    response.clear();
+    response.reserve(HEADER_RESERVE);
+
+    response += this->version;
+    if (this->error_page != nullptr)
+    {
+        response += this->error_page->status_line;
+    }
+    else
+    {
+        char code[8];
+        response += SP;
+        response.append(code, snprintf(code, sizeof(code), "%d", this->status_code));
+        response += SP;
+        response += HttpResponse::toReasonPhrase(this->status_code);
+        response += CRLF;
+    }
+
+    response += "Date: ";
+    HttpResponse::appendDate(response);
+    response += CRLF;
+
+    response += "Connection: ";
+    response += this->connection;
+    response += CRLF;
+    if (this->connection == "keep-alive")
+    {
+        char keep_alive[64];
+        response.append(keep_alive, snprintf(keep_alive, sizeof(keep_alive), "Keep-Alive: timeout=%zu, max=%zu\r\n",
+                                             Config::idle_timeout, Config::max_requests));
+    }
+
+    response += this->extra_headers;
+
+    // validators of the file, pre-serialized in the cache entry when cached
+    if (this->status_code == 200 || this->status_code == 206 || this->status_code == 304)
+    {
+        response += this->cached != nullptr ? std::string_view(this->cached->validators) : std::string_view(this->validators);
+    }
+
+    // a 304 carries the Vary of the 200 it stands for, RFC 9110 section 15.4.5
+    if (this->status_code == 304)
+    {
+        if (HttpResponse::isCompressible(this->content_type))
+            response += "Vary: Accept-Encoding\r\n";
+        response += CRLF;
+        return response;
+    }
+
+    // error pages and cached files carry their pre-serialized Content-Type and Content-Length
+    if (this->error_page != nullptr)
+    {
+        response += this->error_page->header;
+        response += CRLF;
+        return response;
+    }
+
+    if (this->hasCachedBody() && this->status_code == 200)
+    {
+        response += this->cached->header;
+        response += CRLF;
+        return response;
+    }
+
+    response += "Content-Type: ";
+    if (this->ranges.size() > 1)
+    {
+        response += "multipart/byteranges; boundary=";
+        response += HttpResponse::BYTERANGES_BOUNDARY;
+    }
+    else if (this->status_code >= 200 && this->status_code < 400 &&
+             this->content_type.length() > 0 && !startsWith(this->content_type, "Error"))
+    {
+        response += this->content_type;
+    }
+    else
+    {
+        response += "text/html";
+    }
+    response += CRLF;
+
+    if (this->content_encoding.length() > 0)
+    {
+        response += "Content-Encoding: ";
+        response += this->content_encoding;
+        response += CRLF;
+    }
+
+    if ((this->hasFileBody() || this->hasCachedBody()) && HttpResponse::isCompressible(this->content_type))
+    {
+        response += "Vary: Accept-Encoding\r\n";
+    }
+
+    if (this->hasFileBody() || this->hasCachedBody())
+    {
+        response += "Accept-Ranges: bytes\r\n";
+    }
+
+    char content_length[48];
+    response.append(content_length, snprintf(content_length, sizeof(content_length), "Content-Length: %lld\r\n\r\n",
+                                             this->contentLength()));
+
+    return response;
+}
+
+// Convert filename to content type based on extension
+std::string_view HttpResponse::toContentType(std::string_view name)
+{
+    // filename is directory if no extension
+    size_t pos = name.find_last_of(".");
+    if (pos == std::string_view::npos || pos + 1 >= name.length())
+    {
+        return "text/directory";
+    }
+
+    std::string_view content_type = lookupTable(HttpResponse::CONTENT_TYPES, name.substr(pos + 1));
+    if (content_type.length() > 0)
+    {
+        return content_type;
+    }
+
+    return "Error: Unknown content type";
+}
+
+// Convert status code to reason phrase
+std::string_view HttpResponse::toReasonPhrase(int status_code)
+{
+    std::string_view reason = lookupTable(HttpResponse::REASON_PHRASES, status_code);
+    if (reason.length() > 0)
+    {
+        return reason;
+    }
+    return "Error: Unknown status code";
+}
+
+// Convert status code to user-friendly message
+std::string HttpResponse::toMessage(int status_code)
+{
+    std::string message{""};
+    switch (status_code)
+    {
+    case 400:
+        message += "Please check the request format.";
+        break;
+
+    case 403:
+        message += "Directory listing is not allowed.";
+        break;
+
+    case 404:
+        message += "The requested file or directory cannot be found.";
+        break;
+
+    case 405:
+    case 501:
+        // POST stores uploads only when there is a directory to put them in
+        message += Config::upload_dir.empty() ? "GET is currently the only supported method." : "Only GET and POST are supported.";
+        break;
+
+    case 408:
+        message += "The request was not received in time.";
+        break;
+
+    case 415:
+        message += "The requested file format is currently not supported.";
+        break;
+
+    case 429:
+        message += "Too many requests were made. Please try again later.";
+        break;
+
+    case 500:
+        message += "The server is experiencing some unknown errors.";
+        break;
+
+    case 503:
+        message += "The server is currently busy. Please try again later.";
+        break;
+
+    case 505:
+        message += "The requested HTTP version is not supported. Please consider using HTTP/1.1.";
+        break;
+
+    default:
+        message += "No message available.";
+        break;
+    }
+
+    return message;
+}
+
+// Append the http-date of the current second, formatted by the first thread to see it and shared through a seqlock
+void HttpResponse::appendDate(std::string &buffer)
+{
+    const size_t length = 29;
+    time_t now = time(nullptr);
+
+    while (true)
+    {
+        uint64_t sequence = HttpResponse::date_sequence.load(std::memory_order_acquire);
+        if (sequence % 2 == 0 && HttpResponse::date_second.load(std::memory_order_relaxed) != now)
+        {
+            // the writer owns the sequence while it is odd
+            if (!HttpResponse::date_sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire))
+                continue;
+
+            // example: Wed, 19 Dec 2010 16:00:21 GMT
+            tm gmt;
+            gmtime_r(&now, &gmt);
+            uint64_t words[4] = {0, 0, 0, 0};
+            strftime(reinterpret_cast<char *>(words), sizeof(words), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+            for (int i = 0; i < 4; ++i)
+                HttpResponse::date_words[i].store(words[i], std::memory_order_relaxed);
+            HttpResponse::date_second.store(now, std::memory_order_relaxed);
+            HttpResponse::date_sequence.store(sequence + 2, std::memory_order_release);
+            continue;
+        }
+
+        if (sequence % 2 != 0)
+            continue;
+
+        uint64_t words[4];
+        for (int i = 0; i < 4; ++i)
+            words[i] = HttpResponse::date_words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (HttpResponse::date_sequence.load(std::memory_order_relaxed) == sequence)
+        {
+            buffer.append(reinterpret_cast<const char *>(words), length);
+            return;
+        }
+    }
+}
+
+// Get http-date formatted string of the given time
+std::string HttpResponse::toHttpDate(time_t time)
+{
+    tm gmtTime;
+    gmtime_r(&time, &gmtTime);
+    char buf[80];
+    strftime(buf, 80, "%a, %d %b %Y %H:%M:%S GMT", &gmtTime);
+    return std::string{buf};
+}
+
+// Parse a http-date in IMF-fixdate format, returns -1 if malformed
+time_t HttpResponse::parseHttpDate(std::string_view value)
+{
+    std::string date{value};
+    tm gmtTime;
+    memset(&gmtTime, 0, sizeof(gmtTime));
+    const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &gmtTime);
+    if (end == nullptr || *end != '\0')
+    {
+        return -1;
+    }
+    return timegm(&gmtTime);
+}
+
+// Derive a strong entity tag from the inode, size and modification time
+std::pmr::string HttpResponse::toEntityTag(const struct stat &info, std::pmr::memory_resource *resource)
+{
+    char buf[80];
+    int length = snprintf(buf, sizeof(buf), "\"%lx-%lx-%lx.%lx\"", (unsigned long)info.st_ino, (unsigned long)info.st_size,
+                          (unsigned long)info.st_mtim.tv_sec, (unsigned long)info.st_mtim.tv_nsec);
+    return std::pmr::string(buf, length, resource);
+}
+
+// Serialize the ETag, Last-Modified and configured Cache-Control header fields, formatted in place
+// so a response can build them in its arena
+std::pmr::string HttpResponse::validatorsOf(std::string_view etag, time_t last_modified, std::string_view name, std::pmr::memory_resource *resource)
+{
+    std::pmr::string header{resource};
+    header += "ETag: ";
+    header += etag;
+    header += CRLF;
+
+    tm gmtTime;
+    gmtime_r(&last_modified, &gmtTime);
+    char line[80];
+    header += "Last-Modified: ";
+    header.append(line, strftime(line, sizeof(line), "%a, %d %b %Y %H:%M:%S GMT", &gmtTime));
+    header += CRLF;
+
+    // max-age of the extension, falling back to the * default
+    size_t pos = name.find_last_of(".");
+    std::string extension = pos == std::string_view::npos ? "" : toLower(name.substr(pos + 1));
+    auto it = Config::max_ages.find(extension);
+    if (it == Config::max_ages.end())
+    {
+        it = Config::max_ages.find("*");
+    }
+
+    if (it != Config::max_ages.end())
+    {
+        header.append(line, snprintf(line, sizeof(line), "Cache-Control: max-age=%ld\r\n", it->second));
+    }
+
+    return header;
+}
+
+// Check if the content type benefits from compression
+bool HttpResponse::isCompressible(std::string_view content_type)
+{
+    return startsWith(content_type, "text/") ||
+           content_type == "application/json" ||
+           content_type == "application/xhtml+xml" ||
+           content_type == "image/svg+xml";
+}
+
+// Parse Accept-Encoding into the acceptable codings ordered by q-value, then server preference
+int HttpResponse::negotiateEncodings(std::string_view accept_encoding, ContentEncoding encodings[ENCODING_COUNT])
+{
+    int qualities[ENCODING_COUNT] = {-1, -1, -1};
+    int wildcard = -1;
+
+    while (accept_encoding.length() > 0)
+    {
+        size_t comma = accept_encoding.find(',');
+        std::string_view item = accept_encoding.substr(0, comma);
+        accept_encoding = comma == std::string_view::npos ? std::string_view() : accept_encoding.substr(comma + 1);
+
+        // q-values are kept in thousandths
+        int quality = 1000;
+        size_t semicolon = item.find(';');
+        if (semicolon != std::string_view::npos)
+        {
+            std::string_view parameter = item.substr(semicolon + 1);
+            item = item.substr(0, semicolon);
+            size_t q = parameter.find("q=");
+            if (q != std::string_view::npos)
+            {
+                std::string value{parameter.substr(q + 2)};
+                quality = (int)(strtod(value.c_str(), nullptr) * 1000);
+            }
+        }
+
+        while (item.length() > 0 && item.front() == ' ')
+            item.remove_prefix(1);
+        while (item.length() > 0 && item.back() == ' ')
+            item.remove_suffix(1);
+
+        if (item == "*")
+            wildcard = quality;
+        for (int i = 0; i < ENCODING_COUNT; ++i)
+        {
+            if (equalsIgnoreCase(item, ENCODING_NAMES[i]))
+                qualities[i] = quality;
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < ENCODING_COUNT; ++i)
+    {
+        if (qualities[i] < 0)
+            qualities[i] = wildcard;
+        if (qualities[i] > 0)
+            encodings[count++] = (ContentEncoding)i;
+    }
+
+    // stable insertion sort keeps the server preference among equal q-values
+    for (int i = 1; i < count; ++i)
+    {
+        for (int j = i; j > 0 && qualities[(int)encodings[j]] > qualities[(int)encodings[j - 1]]; --j)
+        {
+            std::swap(encodings[j], encodings[j - 1]);
+        }
+    }
+
+    return count;
+}
+
+// Compress the input with the coding, returns false if it is not supported
+bool HttpResponse::compress(ContentEncoding encoding, const std::string &input, std::string &output)
+{
+    if (encoding == ContentEncoding::GZIP)
+    {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // 15 window bits plus 16 selects the gzip wrapper
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        output.resize(deflateBound(&stream, input.length()));
+        stream.next_in = (Bytef *)input.data();
+        stream.avail_in = input.length();
+        stream.next_out = (Bytef *)&output[0];
+        stream.avail_out = output.length();
+
+        int result = deflate(&stream, Z_FINISH);
+        output.resize(stream.total_out);
+        deflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+
+#ifdef HAVE_BROTLI
+    if (encoding == ContentEncoding::BROTLI)
+    {
+        size_t length = BrotliEncoderMaxCompressedSize(input.length());
+        if (length == 0)
+            return false;
+
+        output.resize(length);
+        if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input.length(),
+                                   (const uint8_t *)input.data(), &length, (uint8_t *)&output[0]))
+            return false;
+        output.resize(length);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+// Parse a bytes Range header into (offset, length) pairs, returns -1 if it should be ignored, 0 if unsatisfiable and 1 otherwise
+int HttpResponse::parseRanges(std::string_view value, off_t size, std::pmr::vector<std::pair<off_t, off_t>> &ranges)
+{
+    const std::string_view unit{"bytes="};
+    if (value.substr(0, unit.length()) != unit)
+    {
+        return -1;
+    }
+    value.remove_prefix(unit.length());
+
+    // parse a decimal number, returns -1 if empty or malformed
+    auto parseNumber = [](std::string_view digits) -> off_t {
+        if (digits.length() == 0 || digits.length() > 18)
+            return -1;
+        off_t number = 0;
+        for (char c : digits)
+        {
+            if (c < '0' || c > '9')
+                return -1;
+            number = number * 10 + (c - '0');
+        }
+        return number;
+    };
+
+    size_t specs = 0;
+    while (value.length() > 0)
+    {
+        size_t comma = value.find(',');
+        std::string_view spec = value.substr(0, comma);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+
+        while (spec.length() > 0 && spec.front() == ' ')
+            spec.remove_prefix(1);
+        while (spec.length() > 0 && spec.back() == ' ')
+            spec.remove_suffix(1);
+        if (spec.length() == 0)
+            continue;
+
+        if (++specs > MAX_RANGES)
+            return -1;
+
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos)
+            return -1;
+
+        off_t first = dash == 0 ? -1 : parseNumber(spec.substr(0, dash));
+        off_t last = dash + 1 == spec.length() ? -1 : parseNumber(spec.substr(dash + 1));
+
+        if (dash == 0)
+        {
+            // suffix range of the last bytes
+            if (last < 0)
+                return -1;
+            if (last == 0 || size == 0)
+                continue;
+            first = std::max<off_t>(0, size - last);
+            last = size - 1;
+        }
+        else
+        {
+            if (first < 0 || (dash + 1 < spec.length() && last < 0) || (last >= 0 && last < first))
+                return -1;
+            if (first >= size)
+                continue;
+            if (last < 0 || last >= size)
+                last = size - 1;
+        }
+
+        ranges.emplace_back(first, last - first + 1);
+    }
+
+    if (specs == 0)
+    {
+        return -1;
+    }
+
+    return ranges.empty() ? 0 : 1;
+}
+
+// Generate html template based of status code
+std::string HttpResponse::htmlTemplateOf(int status_code)
+{
+    return Templates::errorPageOf(status_code)->body;
+}
+
+// Generate html template for directory listing based on the path
+std::pmr::string HttpResponse::htmlTemplateOf(const HtmlTemplate *dirlist, const DirectoryListing &listing, size_t begin, size_t end, std::string_view navigation,
+                                              std::pmr::memory_resource *resource)
+{
+    if (dirlist == nullptr)
+    {
+        return std::pmr::string("<h1>Missing file template</h1>", resource);
+    }
+
+    std::pmr::string list{resource};
+    list.reserve((end - begin) * 64 + navigation.length());
+
+    // append / character after directory name
+    for (size_t i = begin; i < end; ++i)
+    {
+        const DirectoryListing::Entry &entry = listing.entries[i];
+        const char *slash = entry.directory ? "/" : "";
+        list.append("\n<li><a href=\"").append(entry.name).append(slash).append("\">").append(entry.name).append(slash).append("</a></li>");
+    }
+    list += navigation;
+
+    return dirlist->render({listing.path, list}, resource);
+}
+
+// Generate the JSON listing of the entries in [begin, end), paginated when limit is non-zero
+std::pmr::string HttpResponse::jsonOf(const DirectoryListing &listing, size_t begin, size_t end, size_t page, size_t limit,
+                                      std::pmr::memory_resource *resource)
+{
+    auto appendString = [](std::pmr::string &json, std::string_view value) {
+        json += '"';
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                json += '\\';
+                json += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                json += escaped;
+            }
+            else
+            {
+                json += c;
+            }
+        }
+        json += '"';
+    };
+
+    std::pmr::string json{"{\"path\":", resource};
+    json.reserve((end - begin) * 48 + 64);
+    appendString(json, listing.path);
+
+    char counts[96];
+    json.append(counts, snprintf(counts, sizeof(counts), ",\"total\":%zu", listing.entries.size()));
+    if (limit > 0)
+    {
+        json.append(counts, snprintf(counts, sizeof(counts), ",\"page\":%zu,\"limit\":%zu", page, limit));
+    }
+
+    json += ",\"entries\":[";
+    for (size_t i = begin; i < end; ++i)
+    {
+        if (i > begin)
+            json += ',';
+        json += "{\"name\":";
+        appendString(json, listing.entries[i].name);
+        json += listing.entries[i].directory ? ",\"type\":\"directory\"}" : ",\"type\":\"file\"}";
+    }
+    json += "]}";
+
+    return json;
+}
+
+// Parse the template into segments, returns false if a placeholder is missing
+bool HtmlTemplate::compile(const std::string &source, const std::vector<std::string> &names)
+{
+    this->segments.clear();
+    this->literal_length = 0;
+
+    std::vector<bool> found(names.size(), false);
+    size_t start_pos = 0;
+
+    while (start_pos < source.length())
+    {
+        size_t open_pos = source.find("{%", start_pos);
+        size_t close_pos = open_pos == std::string::npos ? std::string::npos : source.find("%}", open_pos + 2);
+        if (close_pos == std::string::npos)
+        {
+            open_pos = source.length();
+        }
+
+        // literal text before the placeholder
+        if (open_pos > start_pos)
+        {
+            this->segments.push_back({source.substr(start_pos, open_pos - start_pos), -1});
+            this->literal_length += open_pos - start_pos;
+        }
+
+        if (open_pos >= source.length())
+        {
+            break;
+        }
+
+        std::string name = source.substr(open_pos + 2, close_pos - open_pos - 2);
+        int index = -1;
+        for (size_t i = 0; i < names.size(); ++i)
+        {
+            if (names[i] == name)
+            {
+                index = i;
+                found[i] = true;
+                break;
+            }
+        }
+
+        // unknown placeholders are kept as literal text
+        if (index < 0)
+        {
+            this->segments.push_back({source.substr(open_pos, close_pos + 2 - open_pos), -1});
+            this->literal_length += close_pos + 2 - open_pos;
+        }
+        else
+        {
+            this->segments.push_back({"", index});
+        }
+
+        start_pos = close_pos + 2;
+    }
+
+    for (bool result : found)
+    {
+        if (!result)
+            return false;
+    }
+
+    return true;
+}
+
+// Render the template into a single pre-sized buffer
+std::pmr::string HtmlTemplate::render(std::initializer_list<std::string_view> values, std::pmr::memory_resource *resource) const
+{
+    size_t length = this->literal_length;
+    for (const Segment &segment : this->segments)
+    {
+        if (segment.placeholder >= 0)
+            length += values.begin()[segment.placeholder].length();
+    }
+
+    std::pmr::string html{resource};
+    html.reserve(length);
+
+    for (const Segment &segment : this->segments)
+    {
+        if (segment.placeholder >= 0)
+            html.append(values.begin()[segment.placeholder]);
+        else
+            html.append(segment.literal);
+    }
+
+    return html;
+}
+
+// Get the compiled templates, recompiling them if the files changed
+std::shared_ptr<const Templates::Set> Templates::current()
+{
+    // at most one thread per second checks the template files
+    // packed templates never change
+    time_t now = time(nullptr);
+    time_t last = Templates::checked.load(std::memory_order_relaxed);
+    if (!AssetPack::loaded() && last != now && Templates::checked.compare_exchange_strong(last, now))
+    {
+        std::shared_ptr<const Set> templates = std::atomic_load(&Templates::set);
+        struct stat error_info, dirlist_info;
+        bool error_exists = stat("./templates/error.html", &error_info) == 0;
+        bool dirlist_exists = stat("./templates/dirlist.html", &dirlist_info) == 0;
+
+        if (error_exists != templates->has_error || dirlist_exists != templates->has_dirlist ||
+            (error_exists && (error_info.st_mtim.tv_sec != templates->error_mtime.tv_sec ||
+                              error_info.st_mtim.tv_nsec != templates->error_mtime.tv_nsec)) ||
+            (dirlist_exists && (dirlist_info.st_mtim.tv_sec != templates->dirlist_mtime.tv_sec ||
+                                dirlist_info.st_mtim.tv_nsec != templates->dirlist_mtime.tv_nsec)))
+        {
+            Templates::reload();
+        }
+    }
+
+    return std::atomic_load(&Templates::set);
+}
+
+// Compile both templates and pre-render the error page of every known status
+bool Templates::reload()
+{
+    std::shared_ptr<Set> templates = std::make_shared<Set>();
+    bool result = true;
+
+    // read a template from the mapped pack or from disk, returns false if it is missing
+    auto read = [](const std::string &path, std::string &html, timespec &mtime) {
+        if (AssetPack::loaded())
+        {
+            std::shared_ptr<const CacheEntry> entry = AssetPack::lookup(path.substr(1));
+            if (entry == nullptr)
+                return false;
+            html = entry->body();
+            mtime = entry->mtime;
+            return true;
+        }
+
+        std::ifstream ifs{path};
+        if (!ifs.is_open() || !ifs.good())
+            return false;
+        html.assign((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0)
+            mtime = info.st_mtim;
+        return true;
+    };
+
+    std::string html;
+    if (read("./templates/error.html", html, templates->error_mtime))
+    {
+        templates->has_error = templates->error.compile(html, {"status_code", "reason_phrase", "message"});
+        if (!templates->has_error)
+        {
+            Logger::error("Substituting template error.html failed!\nContent:\n" + html);
+        }
+    }
+    result = result && templates->has_error;
+
+    if (read("./templates/dirlist.html", html, templates->dirlist_mtime))
+    {
+        templates->has_dirlist = templates->dirlist.compile(html, {"path", "list"});
+        if (!templates->has_dirlist)
+        {
+            Logger::error("Substituting template dirlist.html failed!\nContent:\n" + html);
+        }
+    }
+    result = result && templates->has_dirlist;
+
+    for (const auto &phrase : HttpResponse::REASON_PHRASES)
+    {
+        if (phrase.key < 200 || phrase.key >= 400)
+            templates->error_pages[phrase.key] = Templates::renderErrorPage(*templates, phrase.key);
+    }
+
+    std::atomic_store(&Templates::set, std::shared_ptr<const Set>(templates));
+    return result;
+}
+
+// Get the pre-rendered error page of the status code
+std::shared_ptr<const ErrorPage> Templates::errorPageOf(int status_code)
+{
+    std::shared_ptr<const Set> templates = Templates::current();
+
+    auto it = templates->error_pages.find(status_code);
+    if (it != templates->error_pages.end())
+    {
+        return it->second;
+    }
+
+    // status codes without a reason phrase are rendered on demand
+    return Templates::renderErrorPage(*templates, status_code);
+}
+
+// Render the status line, header fields and body of an error page
+std::shared_ptr<const ErrorPage> Templates::renderErrorPage(const Set &set, int status_code)
+{
+    std::shared_ptr<ErrorPage> page = std::make_shared<ErrorPage>();
+    std::string code = std::to_string(status_code);
+    std::string reason{HttpResponse::toReasonPhrase(status_code)};
+
+    if (set.has_error)
+    {
+        page->body = set.error.render({code, reason, HttpResponse::toMessage(status_code)});
+    }
+    else
+    {
+        // basic error message
+        page->body = "<h1>" + code + " " + reason + "</h1>";
+    }
+
+    page->status_line = SP + code + SP + reason + CRLF;
+    page->header = "Content-Type: text/html" + CRLF +
+                   "Content-Length: " + std::to_string(page->body.length()) + CRLF;
+
+    return page;
+}
+
+// Check the status of the request
+int HttpRequest::status() const
+{
+    if (this->error_status != 0)
+        return this->error_status;
+
+    if (this->method == HttpMethod::UNDEFINED)
+        return 501;
+
+    // POST only stores uploads, which are off without a directory to put them in
+    if (this->method == HttpMethod::POST && Config::upload_dir.empty())
+        return 501;
+
+    if (!startsWith(this->url, "/"))
+        return 400;
+
+    if (!startsWith(this->version, "HTTP/"))
+        return 505;
+
+    return 0; // good request
+}
+
+// Check the connection state
+bool HttpRequest::toCloseConnection() const
+{
+    return equalsIgnoreCase(this->connection, "close");
+}
+
+// Queue a http response based on the request on the connection
+bool HttpRequest::sendResponse(Connection *conn, ChunkQueue &out)
+{
+    HttpResponse response(this);
+    this->trace.opened = Tracer::now();
+    if (Config::server_timing)
+        Tracer::appendTiming(this->trace, response.extra_headers);
+
+    // the verbose dump is only built when it is going to be logged
+    if (Logger::enabled(LogLevel::DEBUG))
+    {
+        Logger::debug("\nconn_fd: " + std::to_string(conn->fd) + "\n" + this->toString() + response.toString(true));
+    }
+
+    // the event loop gathers the header and body chunks into one write and resumes it on EPOLLOUT
+    out.pushBytes(response.headerString());
+
+    // cached bodies are shared without copying and files are handed over for sendfile
+    long long body_length = response.bodyLength();
+    response.queueBody(out);
+
+    Logger::access(conn->ip, *this, response.status_code, body_length);
+    Tracer::build(*this, response.status_code, body_length, conn->fd);
+    if (response.status_code >= 0 && (size_t)response.status_code < METRICS_STATUS_LIMIT)
+        Metrics::add(Metrics::local()->statuses[response.status_code]);
+
+    return true;
+}
+
+// Generate the debug message
+std::string HttpRequest::toString() const
+{
+    std::string value{""};
+    value += "HttpRequest {";
+    value += ("\n\tstatus: " + std::to_string(this->status()));
+    value += "\n\tmethod: ";
+    switch (this->method)
+    {
+    case HttpMethod::GET:
+        value += "GET";
+        break;
+    case HttpMethod::POST:
+        value += "POST";
+        break;
+    case HttpMethod::UNDEFINED:
+    default:
+        value += "UNDEFINED";
+    }
+    value += ("\n\turl: " + this->url);
+    value += "\n\tversion: ";
+    value += this->version;
+    value += "\n\tconnection: ";
+    value += this->connection;
+    value += "\n}\n";
+    return value;
+}
+
+// Find the value of a header field, ignoring case of the name
+std::string_view HttpRequest::header(std::string_view name) const
+{
+    for (const auto &field : this->headers)
+    {
+        if (equalsIgnoreCase(field.first, name))
+            return field.second;
+    }
+    return std::string_view();
+}
+
+// Find the Content-Length of the request, empty if it is missing. Returns false if a field is not a plain
+// number or the fields disagree, since the end of the request would then be ambiguous, RFC 9112 section 6.3
+bool HttpRequest::contentLength(std::string_view &value) const
+{
+    value = std::string_view();
+    for (const auto &field : this->headers)
+    {
+        if (!equalsIgnoreCase(field.first, "Content-Length"))
+            continue;
+
+        if (field.second.empty() || field.second.find_first_not_of("0123456789") != std::string_view::npos)
+            return false;
+        if (value.length() > 0 && value != field.second)
+            return false;
+        value = field.second;
+    }
+    return true;
+}
+
+// Find the value of a query parameter, empty if it is missing
+std::string_view HttpRequest::parameter(std::string_view name) const
+{
+    std::string_view query = this->query;
+    while (query.length() > 0)
+    {
+        size_t amp = query.find('&');
+        std::string_view pair = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+
+        size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == name)
+            return eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+    }
+    return std::string_view();
+}
+
+// Clear the fields while keeping the allocated capacity
+void HttpRequest::reset()
+{
+    this->method = HttpMethod::UNDEFINED;
+    this->url.clear();
+    this->query = std::string_view();
+    this->version = std::string_view();
+    this->connection = "close";
+    this->head = std::string_view();
+    this->headers.clear();
+    this->error_status = 0;
+    this->body_length = 0;
+}
+
+// Parse a request head from the buffer, returns its length or 0 if more bytes are needed
+size_t HttpRequest::parse(std::string_view data, size_t &scan_pos)
+{
+    // resume the boundary search where the previous attempt stopped
+    size_t search_pos = scan_pos > 3 ? scan_pos - 3 : 0;
+    size_t boundary = data.find("\r\n\r\n", search_pos);
+    if (boundary == std::string_view::npos)
+    {
+        scan_pos = data.length();
+        return 0;
+    }
+    scan_pos = 0;
+
+    this->reset();
+    size_t head_length = boundary + 4;
+    std::string_view msg = data.substr(0, head_length);
+    this->head = msg;
+
+    // a request line cut short is still answered in the version of the server
+    this->version = "HTTP/1.1";
+
+    // parse the method
+    size_t start_pos = 0;
+    size_t end_pos = msg.find(SP, start_pos);
+    if (end_pos == std::string_view::npos)
+    {
+        return head_length;
+    }
+
+    this->method = HttpRequest::toMethod(msg.substr(start_pos, end_pos - start_pos));
+
+    // parse the url
+    start_pos = end_pos + 1;
+    end_pos = msg.find(SP, start_pos);
+    if (end_pos == std::string_view::npos)
+    {
+        return head_length;
+    }
+
+    this->setTarget(msg.substr(start_pos, end_pos - start_pos));
+
+    // parse the HTTP version
+    start_pos = end_pos + 1;
+    end_pos = msg.find(CRLF, start_pos);
+    this->version = msg.substr(start_pos, end_pos - start_pos);
+
+    // parse the header fields
+    start_pos = end_pos + 2;
+    while (start_pos < boundary + 2)
+    {
+        end_pos = msg.find(CRLF, start_pos);
+        std::string_view line = msg.substr(start_pos, end_pos - start_pos);
+        start_pos = end_pos + 2;
+
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0)
+        {
+            this->error_status = 400;
+            return head_length;
+        }
+
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = line.substr(colon + 1);
+        while (value.length() > 0 && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (value.length() > 0 && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+
+        this->headers.emplace_back(name, value);
+    }
+
+    std::string_view connection = this->header("Connection");
+    if (connection.length() > 0)
+    {
+        this->connection = connection;
+    }
+
+    // uploads frame their body themselves while it streams to disk
+    if (this->method == HttpMethod::POST && Config::upload_dir.length() > 0)
+    {
+        return head_length;
+    }
+
+    // other bodies are not supported, chunked ones cannot be skipped, small ones are and large ones refused
+    if (this->header("Transfer-Encoding").length() > 0)
+    {
+        this->error_status = 400;
+        return head_length;
+    }
+
+    std::string_view content_length;
+    if (!this->contentLength(content_length))
+    {
+        this->error_status = 400;
+        return head_length;
+    }
+
+    if (content_length.length() > 0)
+    {
+        size_t length = 0;
+        for (char c : content_length)
+        {
+            if (length > MAX_REQUEST_SIZE)
+            {
+                this->error_status = 413;
+                return head_length;
+            }
+            length = length * 10 + (c - '0');
+        }
+
+        if (length > MAX_REQUEST_SIZE)
+        {
+            this->error_status = 413;
+            return head_length;
+        }
+        this->body_length = length;
+    }
+
+    return head_length;
+}
+
+// Split a request target into the url and the query string
+void HttpRequest::setTarget(std::string_view target)
+{
+    size_t query_pos = target.find('?');
+    if (query_pos != std::string_view::npos)
+    {
+        this->query = target.substr(query_pos + 1);
+        target = target.substr(0, query_pos);
+    }
+
+    this->url.assign(target.data(), target.length());
+
+    // an upload names its file exactly, so its target is kept as sent
+    if (this->method == HttpMethod::POST)
+        return;
+
+    // redirect to index.html if root directory is requested
+    if (this->url == "/")
+    {
+        this->url = "/index.html";
+    }
+
+    // strip the / characters at the end
+    while (endsWith(this->url, "/"))
+    {
+        this->url.erase(this->url.length() - 1);
+    }
+}
+
+// Find the enum of the given HTTP method
+HttpMethod HttpRequest::toMethod(std::string_view method)
+{
+    if (method == "GET")
+        return HttpMethod::GET;
+
+    if (method == "POST")
+        return HttpMethod::POST;
+
+    // * ignore other methods for now
+    return HttpMethod::UNDEFINED;
+}
+
+// Get the body, owned or mapped from the asset pack
+std::string_view CacheEntry::body() const
+{
+    return this->packed ? this->mapped : std::string_view(this->content);
+}
+
+// Get the approximate memory held by the entry
+size_t CacheEntry::footprint() const
+{
+    return sizeof(CacheEntry) + this->path.capacity() + this->content.capacity() +
+           this->content_type.capacity() + this->header.capacity() + this->validators.capacity() +
+           this->etag.capacity() + this->variant_bytes;
+}
+
+// Check if the entry still reflects the file on disk
+bool CacheEntry::matches(const struct stat &info) const
+{
+    return info.st_ino == this->inode && info.st_size == this->size &&
+           info.st_mtim.tv_sec == this->mtime.tv_sec && info.st_mtim.tv_nsec == this->mtime.tv_nsec;
+}
+
+FileDescriptor::~FileDescriptor()
+{
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+// Check if the chunk streams from a file
+bool OutputChunk::isFile() const
+{
+    return this->file != nullptr;
+}
+
+// Get the bytes held by the chunk, either its own or those kept alive by the owner
+std::string_view OutputChunk::bytes() const
+{
+    return this->owner != nullptr ? this->shared : std::string_view(this->data);
+}
+
+// Check if no chunks are queued
+bool ChunkQueue::empty() const
+{
+    return this->count == 0;
+}
+
+// Get the number of queued chunks
+size_t ChunkQueue::size() const
+{
+    return this->count;
+}
+
+// Get the oldest queued chunk
+OutputChunk &ChunkQueue::front()
+{
+    return this->slots[this->head];
+}
+
+// Get the queued chunk at a position counted from the oldest
+OutputChunk &ChunkQueue::operator[](size_t index)
+{
+    return this->slots[(this->head + index) & (this->slots.size() - 1)];
+}
+
+// Drop the oldest chunk, keeping the capacity of its buffer for later pushes
+void ChunkQueue::pop_front()
+{
+    OutputChunk &chunk = this->slots[this->head];
+    chunk.data.clear();
+    chunk.owner.reset();
+    chunk.shared = std::string_view();
+    chunk.file.reset();
+    chunk.offset = 0;
+    chunk.remaining = 0;
+    this->head = (this->head + 1) & (this->slots.size() - 1);
+    --this->count;
+}
+
+// Drop all queued chunks
+void ChunkQueue::clear()
+{
+    while (this->count > 0)
+        this->pop_front();
+}
+
+// Claim the next free slot, growing the ring only when it is full
+OutputChunk &ChunkQueue::push()
+{
+    if (this->count == this->slots.size())
+    {
+        std::vector<OutputChunk> grown(std::max<size_t>(8, this->slots.size() * 2));
+        for (size_t i = 0; i < this->count; ++i)
+            std::swap(grown[i], (*this)[i]);
+        this->slots.swap(grown);
+        this->head = 0;
+    }
+    ++this->count;
+    return (*this)[this->count - 1];
+}
+
+// Queue a copy of some bytes, always on the heap so a growing ring never moves bytes a pending send points into
+void ChunkQueue::pushBytes(std::string_view bytes)
+{
+    OutputChunk &chunk = this->push();
+    chunk.data.reserve(std::max(bytes.length(), sizeof(std::string)));
+    chunk.data.assign(bytes.data(), bytes.length());
+    chunk.remaining = chunk.data.length();
+}
+
+// Queue a string taking over its buffer, copying it when it is short enough to live inline
+void ChunkQueue::pushString(std::string &&data)
+{
+    if (data.capacity() < sizeof(std::string))
+    {
+        this->pushBytes(data);
+        return;
+    }
+
+    OutputChunk &chunk = this->push();
+    chunk.data = std::move(data);
+    chunk.remaining = chunk.data.length();
+}
+
+// Queue a range of bytes kept alive by their owner
+void ChunkQueue::pushShared(const std::shared_ptr<const void> &owner, std::string_view shared, off_t offset, size_t length)
+{
+    OutputChunk &chunk = this->push();
+    chunk.owner = owner;
+    chunk.shared = shared;
+    chunk.offset = offset;
+    chunk.remaining = length;
+}
+
+// Queue a range of an open file
+void ChunkQueue::pushFile(const std::shared_ptr<FileDescriptor> &file, off_t offset, size_t length)
+{
+    OutputChunk &chunk = this->push();
+    chunk.file = file;
+    chunk.offset = offset;
+    chunk.remaining = length;
+}
+
+// Move all chunks of another queue to the end of this one, swapping buffers so neither side allocates once warm
+void ChunkQueue::append(ChunkQueue &other)
+{
+    for (size_t i = 0; i < other.count; ++i)
+        std::swap(this->push(), other[i]);
+    other.clear();
+}
+
+// Open the docroot and start following changes below it, returns false if the working directory cannot be opened
+bool PathIndex::start()
+{
+    PathIndex::root_fd = ::open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (PathIndex::root_fd < 0)
+        return false;
+
+    // kernels before 5.6 lack openat2, paths are then checked by name and never indexed
+    int fd = PathIndex::resolve(".", O_PATH, RESOLVE_BENEATH);
+    PathIndex::beneath = fd >= 0;
+    if (fd >= 0)
+        close(fd);
+
+    PathIndex::inotify_fd = PathIndex::beneath ? inotify_init1(IN_CLOEXEC) : -1;
+    if (PathIndex::inotify_fd >= 0)
+        std::thread(PathIndex::run).detach();
+    return true;
+}
+
+// Get the metadata of a path below the docroot, returns false if it is missing or outside
+bool PathIndex::lookup(const std::string &path, struct stat &info)
+{
+    Shard &shard = PathIndex::shardOf(path);
+    if (PathIndex::inotify_fd >= 0)
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.entries.find(path);
+        if (it != shard.entries.end())
+        {
+            Metrics::add(Metrics::local()->path_hits);
+            info = it->second.info;
+            return it->second.found;
+        }
+    }
+    Metrics::add(Metrics::local()->path_misses);
+
+    bool found = false;
+    bool indexed = PathIndex::inotify_fd >= 0;
+    int watch = -1;
+    uint64_t generation = PathIndex::generation.load(std::memory_order_acquire);
+
+    // paths climbing out of the docroot by name never resolve whatever happens on disk, so they need no watch
+    if (!PathIndex::escapes(path))
+    {
+        // the watch is added before resolving, so no change in between can be missed.
+        // Events name the directory by its watch, so only paths spelled one way are indexed
+        indexed = indexed && PathIndex::plain(path);
+        if (indexed)
+            watch = PathIndex::watch(path);
+
+        // paths through symlinks are resolved every time, their targets may be in directories nobody watches
+        bool direct = indexed;
+        int fd = indexed ? PathIndex::resolve(path, O_PATH, RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS) : PathIndex::open(path, O_PATH);
+        if (fd < 0 && errno == ELOOP && indexed)
+        {
+            direct = false;
+            fd = PathIndex::open(path, O_PATH);
+        }
+        int error = errno;
+        found = fd >= 0 && fstat(fd, &info) == 0;
+        if (fd >= 0)
+            close(fd);
+
+        bool missing = !found && (error == ENOENT || error == ENOTDIR);
+        indexed = watch >= 0 && direct && (found || missing);
+    }
+
+    if (!found)
+        memset(&info, 0, sizeof(info));
+    if (!indexed)
+        return found;
+
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    if (PathIndex::generation.load(std::memory_order_acquire) != generation)
+        return found;
+
+    // an arbitrary entry makes room, missing paths are bounded separately and leave oldest first
+    if (shard.entries.size() >= PATH_INDEX_MAX / PATH_INDEX_SHARDS)
+        shard.entries.erase(shard.entries.begin());
+    if (!shard.entries.emplace(path, Entry{found, watch, info}).second || found)
+        return found;
+
+    shard.missing.push_back(path);
+    if (shard.missing.size() > NEGATIVE_CACHE_MAX / PATH_INDEX_SHARDS)
+    {
+        auto it = shard.entries.find(shard.missing.front());
+        if (it != shard.entries.end() && !it->second.found)
+            shard.entries.erase(it);
+        shard.missing.pop_front();
+    }
+    return found;
+}
+
+// Open a path beneath the docroot, given as ./name or /name, returns -1 with errno set if it fails or leads outside
+int PathIndex::open(std::string_view path, int flags)
+{
+    if (PathIndex::beneath)
+        return PathIndex::resolve(path, flags, RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS);
+
+    if (PathIndex::escapes(path))
+    {
+        errno = EXDEV;
+        return -1;
+    }
+    return PathIndex::resolve(path, flags, 0);
+}
+
+// Find the shard responsible for a path
+PathIndex::Shard &PathIndex::shardOf(const std::string &path)
+{
+    return PathIndex::shards[std::hash<std::string>{}(path) % PATH_INDEX_SHARDS];
+}
+
+// Open a path relative to the docroot with openat2, or openat when no resolve flags are given
+int PathIndex::resolve(std::string_view path, int flags, uint64_t resolve)
+{
+    while (startsWith(path, "./"))
+        path.remove_prefix(2);
+    while (startsWith(path, "/"))
+        path.remove_prefix(1);
+
+    thread_local std::string name;
+    name.assign(path.length() > 0 ? path : ".");
+    if (resolve == 0)
+        return openat(PathIndex::root_fd, name.c_str(), flags | O_CLOEXEC);
+
+    open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = resolve;
+    return syscall(SYS_openat2, PathIndex::root_fd, name.c_str(), &how, sizeof(how));
+}
+
+// Watch the existing directories above a path, from the docroot down, since a change to any of them
+// can make the path appear or go away, returns the watch of the closest one or -1
+int PathIndex::watch(const std::string &path)
+{
+    int watch = -1;
+    size_t slash = 1;
+    while (slash != std::string::npos)
+    {
+        std::string directory = path.substr(0, slash);
+        int result = inotify_add_watch(PathIndex::inotify_fd, directory.c_str(),
+                                       IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY |
+                                           IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (result < 0)
+            return errno == ENOENT || errno == ENOTDIR ? watch : -1;
+
+        // a directory renamed back and forth keeps its watch, which names it as last looked up
+        {
+            std::lock_guard<std::mutex> lock(PathIndex::directories_mutex);
+            PathIndex::directories[result] = directory;
+        }
+        watch = result;
+        slash = path.find('/', slash + 1);
+    }
+    return watch;
+}
+
+// Check if the .. segments of a path climb above where it starts
+bool PathIndex::escapes(std::string_view path)
+{
+    int depth = 0;
+    while (path.length() > 0)
+    {
+        size_t slash = path.find('/');
+        std::string_view segment = path.substr(0, slash);
+        path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+
+        if (segment == "..")
+        {
+            if (--depth < 0)
+                return true;
+        }
+        else if (segment.length() > 0 && segment != ".")
+        {
+            ++depth;
+        }
+    }
+    return false;
+}
+
+// Check if a path is spelled as ./ followed by names, without empty, . or .. segments
+bool PathIndex::plain(std::string_view path)
+{
+    if (!startsWith(path, "./") || path.length() == 2)
+        return false;
+
+    path.remove_prefix(2);
+    while (true)
+    {
+        size_t slash = path.find('/');
+        std::string_view segment = path.substr(0, slash);
+        if (segment.empty() || segment == "." || segment == "..")
+            return false;
+        if (slash == std::string_view::npos)
+            return true;
+        path.remove_prefix(slash + 1);
+    }
+}
+
+// Drop the entries named by the events. A changed file drops its own entry, while a new name may end missing entries
+// below it and a directory going away ends all entries below it, which takes a scan
+void PathIndex::run()
+{
+    alignas(inotify_event) char buffer[4096];
+    std::vector<std::string> prefixes;
+    std::string key;
+    while (true)
+    {
+        ssize_t length = ::read(PathIndex::inotify_fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+            return;
+
+        // lookups resolving meanwhile see the new generation and do not store what they found
+        PathIndex::generation.fetch_add(1, std::memory_order_acq_rel);
+
+        bool overflow = false;
+        prefixes.clear();
+        for (ssize_t pos = 0; pos < length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + pos);
+            pos += sizeof(inotify_event) + event->len;
+            overflow = overflow || (event->mask & IN_Q_OVERFLOW);
+
+            {
+                std::lock_guard<std::mutex> lock(PathIndex::directories_mutex);
+                auto it = PathIndex::directories.find(event->wd);
+                if (it == PathIndex::directories.end())
+                    continue;
+                key.assign(it->second);
+            }
+            if (event->len > 0)
+                key.append("/").append(event->name);
+
+            bool below = event->len == 0 || (event->mask & (IN_CREATE | IN_MOVED_TO)) ||
+                         ((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM)));
+            if (below)
+            {
+                prefixes.push_back(key + "/");
+                if (event->len == 0)
+                    continue;
+            }
+
+            Shard &shard = PathIndex::shardOf(key);
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.entries.erase(key);
+        }
+
+        if (!overflow && prefixes.empty())
+            continue;
+
+        for (Shard &shard : PathIndex::shards)
+        {
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            for (auto it = shard.entries.begin(); it != shard.entries.end();)
+            {
+                bool changed = it->second.watch >= 0 && overflow;
+                for (size_t i = 0; !changed && i < prefixes.size(); ++i)
+                    changed = startsWith(it->first, prefixes[i]);
+
+                if (changed)
+                    it = shard.entries.erase(it);
+                else
+                    ++it;
+            }
+        }
+    }
+}
+
+// Get the listing of a directory, reading it again if it changed or the templates were reloaded
+std::shared_ptr<const DirectoryListing> DirectoryCache::lookup(const std::string &directory_path)
+{
+    // one spelling per directory regardless of trailing slashes
+    std::string key{directory_path};
+    while (key.length() > 1 && key.back() == '/')
+        key.pop_back();
+
+    DirectoryCache::invalidate();
+    std::shared_ptr<const Templates::Set> templates = Templates::current();
+
+    if (DirectoryCache::inotify_fd >= 0)
+    {
+        std::shared_lock<std::shared_mutex> lock(DirectoryCache::mutex);
+        auto it = DirectoryCache::listings.find(key);
+        if (it != DirectoryCache::listings.end() && it->second->templates == templates)
+            return it->second;
+    }
+
+    // the watch is added before reading, so no change in between can be missed
+    int watch = -1;
+    if (DirectoryCache::inotify_fd >= 0)
+    {
+        watch = inotify_add_watch(DirectoryCache::inotify_fd, key.c_str(),
+                                  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+
+    std::shared_ptr<DirectoryListing> listing = DirectoryCache::read(key);
+    if (listing == nullptr)
+        return nullptr;
+
+    listing->templates = templates;
+    listing->watch = watch;
+    listing->html = HttpResponse::htmlTemplateOf(templates->has_dirlist ? &templates->dirlist : nullptr,
+                                                 *listing, 0, listing->entries.size(), "");
+    listing->json = HttpResponse::jsonOf(*listing, 0, listing->entries.size(), 0, 0);
+
+    if (watch < 0)
+        return listing;
+
+    std::unique_lock<std::shared_mutex> lock(DirectoryCache::mutex);
+    if (DirectoryCache::listings.size() >= DIRECTORY_CACHE_MAX && DirectoryCache::listings.count(key) == 0)
+    {
+        // drop an arbitrary listing, its watch stays while another listing shares it
+        auto victim = DirectoryCache::listings.begin();
+        int victim_watch = victim->second->watch;
+        DirectoryCache::listings.erase(victim);
+        bool shared = victim_watch == watch;
+        for (const auto &item : DirectoryCache::listings)
+            shared = shared || item.second->watch == victim_watch;
+        if (!shared)
+            inotify_rm_watch(DirectoryCache::inotify_fd, victim_watch);
+    }
+    DirectoryCache::listings[key] = listing;
+
+    return listing;
+}
+
+// Drop the listings of directories that changed since the last check
+void DirectoryCache::invalidate()
+{
+    if (DirectoryCache::inotify_fd < 0)
+        return;
+
+    alignas(inotify_event) char buffer[4096];
+    while (true)
+    {
+        ssize_t length = ::read(DirectoryCache::inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0)
+            return;
+
+        std::unique_lock<std::shared_mutex> lock(DirectoryCache::mutex);
+        for (ssize_t pos = 0; pos < length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(buffer + pos);
+            for (auto it = DirectoryCache::listings.begin(); it != DirectoryCache::listings.end();)
+            {
+                if (it->second->watch == event->wd)
+                    it = DirectoryCache::listings.erase(it);
+                else
+                    ++it;
+            }
+            pos += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+
+// Read a directory with getdents64 into one name buffer, directories listed first
+std::shared_ptr<DirectoryListing> DirectoryCache::read(const std::string &directory_path)
+{
+    int fd = PathIndex::open(directory_path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return nullptr;
+
+    struct LinuxDirent64
+    {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    std::shared_ptr<DirectoryListing> listing = std::make_shared<DirectoryListing>();
+    std::vector<std::pair<size_t, size_t>> spans;
+    std::vector<bool> directories;
+    alignas(LinuxDirent64) char buffer[DIRENT_BUFFER_SIZE];
+
+    while (true)
+    {
+        long length = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+        if (length < 0)
+        {
+            close(fd);
+            return nullptr;
+        }
+        if (length == 0)
+            break;
+
+        for (long pos = 0; pos < length;)
+        {
+            const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64 *>(buffer + pos);
+            pos += entry->d_reclen;
+
+            // ignore current directory and parent entry
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            bool directory = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat info;
+                directory = fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
+            }
+
+            size_t name_length = strlen(name);
+            spans.emplace_back(listing->names.length(), name_length);
+            directories.push_back(directory);
+            listing->names.append(name, name_length);
+        }
+    }
+    close(fd);
+
+    // views are taken once the name buffer stops growing
+    listing->entries.reserve(spans.size());
+    for (size_t i = 0; i < spans.size(); ++i)
+    {
+        listing->entries.push_back({std::string_view(listing->names).substr(spans[i].first, spans[i].second), directories[i]});
+    }
+
+    // directories before files, each in descending name order
+    std::sort(listing->entries.begin(), listing->entries.end(), [](const DirectoryListing::Entry &a, const DirectoryListing::Entry &b) {
+        if (a.directory != b.directory)
+            return a.directory;
+        return a.name > b.name;
+    });
+
+    listing->path = directory_path;
+    if (startsWith(listing->path, "."))
+    {
+        listing->path.erase(0, 1);
+    }
+
+    if (!endsWith(listing->path, "/"))
+    {
+        listing->path += "/";
+    }
+
+    return listing;
+}
+
+// Find the shard responsible for a path
+FileCache::Shard &FileCache::shardOf(const std::string &path)
+{
+    return FileCache::shards[std::hash<std::string>{}(path) % CACHE_SHARDS];
+}
+
+// Find a cached entry still matching the metadata the path index has for the file
+std::shared_ptr<const CacheEntry> FileCache::lookup(const std::string &path, const struct stat &info)
+{
+    if (Config::cache_size == 0)
+        return nullptr;
+
+    std::shared_ptr<const CacheEntry> entry;
+    Shard &shard = FileCache::shardOf(path);
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.entries.find(path);
+        if (it != shard.entries.end())
+            entry = it->second;
+    }
+
+    if (entry == nullptr)
+    {
+        Metrics::add(Metrics::local()->cache_misses);
+        return nullptr;
+    }
+
+    if (!entry->matches(info))
+    {
+        // stale entries are replaced by the following load
+        Metrics::add(Metrics::local()->cache_misses);
+        return nullptr;
+    }
+
+    entry->referenced.store(true, std::memory_order_relaxed);
+    Metrics::add(Metrics::local()->cache_hits);
+    return entry;
+}
+
+// Read a small file into the cache, evicting cold entries to stay within the limit
+std::shared_ptr<const CacheEntry> FileCache::load(const std::string &path, std::string_view content_type, std::string_view validators, int fd, const struct stat &info)
+{
+    size_t shard_limit = Config::cache_size / CACHE_SHARDS;
+    if (info.st_size < 0 || (size_t)info.st_size > Config::cache_entry_max || (size_t)info.st_size > shard_limit)
+        return nullptr;
+
+    std::shared_ptr<CacheEntry> entry = std::make_shared<CacheEntry>();
+    entry->path = path;
+    entry->content_type = content_type;
+    entry->validators = validators;
+    entry->etag = HttpResponse::toEntityTag(info);
+    entry->inode = info.st_ino;
+    entry->size = info.st_size;
+    entry->mtime = info.st_mtim;
+    entry->referenced = true;
+
+    entry->content.resize(info.st_size);
+    size_t total = 0;
+    while (total < entry->content.length())
+    {
+        ssize_t result = pread(fd, &entry->content[total], entry->content.length() - total, total);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return nullptr;
+        total += result;
+    }
+
+    entry->header = "Content-Type: ";
+    entry->header += content_type;
+    entry->header += CRLF;
+    if (HttpResponse::isCompressible(content_type))
+        entry->header += "Vary: Accept-Encoding" + CRLF;
+    entry->header += "Accept-Ranges: bytes" + CRLF +
+                     "Content-Length: " + std::to_string(entry->content.length()) + CRLF;
+
+    Shard &shard = FileCache::shardOf(path);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+
+    auto it = shard.entries.find(path);
+    if (it != shard.entries.end())
+        FileCache::evict(shard, it->second);
+
+    // CLOCK sweep: referenced entries get a second chance
+    while (shard.bytes + entry->footprint() > shard_limit && !shard.ring.empty())
+    {
+        if (shard.hand >= shard.ring.size())
+            shard.hand = 0;
+
+        std::shared_ptr<CacheEntry> victim = shard.ring[shard.hand];
+        if (victim->referenced.exchange(false, std::memory_order_relaxed))
+        {
+            ++shard.hand;
+            continue;
+        }
+        FileCache::evict(shard, victim);
+    }
+
+    entry->slot = shard.ring.size();
+    shard.ring.push_back(entry);
+    shard.entries[path] = entry;
+    shard.bytes += entry->footprint();
+
+    return entry;
+}
+
+// Get the encoded variant of a cached file, or null if it is not available or not smaller
+std::shared_ptr<const CacheEntry> FileCache::variantOf(const std::shared_ptr<const CacheEntry> &entry, ContentEncoding encoding)
+{
+    int index = (int)encoding;
+
+    // packed entries hold every variant the pack has and never build one
+    if (entry->packed)
+        return entry->variants[index];
+
+    std::shared_ptr<const CacheEntry> variant = std::atomic_load(&entry->variants[index]);
+
+    if (variant != nullptr)
+    {
+        // sibling variants follow their file, compressed ones stay valid while no sibling exists
+        struct stat info;
+        bool exists = PathIndex::lookup(variant->path, info);
+        if (variant->from_sibling ? !exists || !variant->matches(info) : exists)
+            variant = nullptr;
+    }
+
+    if (variant == nullptr)
+    {
+        variant = FileCache::buildVariant(*entry, encoding);
+        if (variant == nullptr)
+            return nullptr;
+
+        // account the variant to the shard while the entry is still cached
+        Shard &shard = FileCache::shardOf(entry->path);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        std::shared_ptr<const CacheEntry> previous = std::atomic_load(&entry->variants[index]);
+        auto it = shard.entries.find(entry->path);
+        if (it != shard.entries.end() && it->second == entry)
+        {
+            size_t added = variant->footprint() - (previous != nullptr ? previous->footprint() : 0);
+            entry->variant_bytes += added;
+            shard.bytes += added;
+        }
+        std::atomic_store(&entry->variants[index], variant);
+    }
+
+    return variant->usable ? variant : nullptr;
+}
+
+// Read the precompressed sibling of a cached file or compress its content
+std::shared_ptr<const CacheEntry> FileCache::buildVariant(const CacheEntry &entry, ContentEncoding encoding)
+{
+    int index = (int)encoding;
+    std::shared_ptr<CacheEntry> variant = std::make_shared<CacheEntry>();
+    variant->path = entry.path + ENCODING_SUFFIXES[index];
+    variant->content_type = entry.content_type;
+    variant->referenced = false;
+    variant->slot = 0;
+
+    struct stat info;
+    int fd = PathIndex::open(variant->path, O_RDONLY);
+    if (fd >= 0)
+    {
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || (size_t)info.st_size > Config::cache_entry_max)
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        variant->from_sibling = true;
+        variant->content.resize(info.st_size);
+        size_t total = 0;
+        while (total < variant->content.length())
+        {
+            ssize_t result = pread(fd, &variant->content[total], variant->content.length() - total, total);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                break;
+            total += result;
+        }
+        close(fd);
+
+        if (total < variant->content.length())
+            return nullptr;
+    }
+    else
+    {
+        // without a sibling the identity content is compressed once, marking the variant unusable if it does not help
+        info.st_ino = entry.inode;
+        info.st_size = entry.size;
+        info.st_mtim = entry.mtime;
+        variant->usable = HttpResponse::compress(encoding, entry.content, variant->content) &&
+                          variant->content.length() < entry.content.length();
+        if (!variant->usable)
+        {
+            variant->content.clear();
+            variant->content.shrink_to_fit();
+        }
+    }
+
+    variant->inode = info.st_ino;
+    variant->size = info.st_size;
+    variant->mtime = info.st_mtim;
+    variant->etag = HttpResponse::toEntityTag(info);
+    variant->etag.insert(variant->etag.length() - 1, std::string{"-"} + ENCODING_NAMES[index]);
+    variant->validators = HttpResponse::validatorsOf(variant->etag, variant->mtime.tv_sec, entry.path);
+    variant->header = "Content-Type: " + entry.content_type + CRLF +
+                      "Content-Encoding: " + ENCODING_NAMES[index] + CRLF +
+                      "Vary: Accept-Encoding" + CRLF +
+                      "Accept-Ranges: bytes" + CRLF +
+                      "Content-Length: " + std::to_string(variant->content.length()) + CRLF;
+
+    return variant;
+}
+
+// Remove an entry from its shard, the caller holds the exclusive lock
+void FileCache::evict(Shard &shard, const std::shared_ptr<CacheEntry> &entry)
+{
+    std::shared_ptr<CacheEntry> victim = entry;
+    size_t slot = victim->slot;
+
+    if (slot + 1 != shard.ring.size())
+    {
+        shard.ring[slot] = shard.ring.back();
+        shard.ring[slot]->slot = slot;
+    }
+    shard.ring.pop_back();
+
+    shard.entries.erase(victim->path);
+    shard.bytes -= victim->footprint();
+}
+
+// Summarize the cache counters and usage
+std::string FileCache::stats()
+{
+    size_t bytes = 0;
+    size_t count = 0;
+    for (Shard &shard : FileCache::shards)
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        bytes += shard.bytes;
+        count += shard.entries.size();
+    }
+
+    return "FileCache { hits: " + std::to_string(Metrics::cacheHits()) +
+           ", misses: " + std::to_string(Metrics::cacheMisses()) +
+           ", entries: " + std::to_string(count) +
+           ", bytes: " + std::to_string(bytes) +
+           ", limit: " + std::to_string(Config::cache_size) + " }";
+}
+
+// Pack every servable file below the working directory with the precompressed variants of the compressible ones,
+// written next to the target and renamed over it, returns false if the pack could not be written
+bool AssetPack::build(const std::string &file)
+{
+    struct Asset
+    {
+        std::string url;
+        std::string_view content_type;
+        struct stat info;
+        std::string etag;
+        std::string variant_etags[ENCODING_COUNT];
+        std::string variants[ENCODING_COUNT];
+        Record record;
+    };
+
+    std::vector<std::string> paths;
+    AssetPack::collect(".", paths);
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<Asset> assets(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        Asset &asset = assets[i];
+        asset.url = paths[i].substr(1);
+        asset.content_type = HttpResponse::toContentType(asset.url.substr(asset.url.find_last_of('/') + 1));
+        if (stat(paths[i].c_str(), &asset.info) != 0)
+            return false;
+        asset.etag = HttpResponse::toEntityTag(asset.info);
+
+        // siblings win over compressing the content here, like in the file cache
+        std::string content;
+        bool compressible = HttpResponse::isCompressible(asset.content_type);
+        if (compressible)
+        {
+            std::ifstream ifs{paths[i], std::ios::binary};
+            content.assign((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        }
+
+        for (int e = 0; e < ENCODING_COUNT; ++e)
+        {
+            std::string sibling = paths[i] + ENCODING_SUFFIXES[e];
+            struct stat info;
+            if (stat(sibling.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+            {
+                std::ifstream ifs{sibling, std::ios::binary};
+                asset.variants[e].assign((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+                asset.variant_etags[e] = HttpResponse::toEntityTag(info);
+            }
+            else if (!compressible || !HttpResponse::compress((ContentEncoding)e, content, asset.variants[e]) ||
+                     asset.variants[e].length() >= content.length())
+            {
+                asset.variants[e].clear();
+                continue;
+            }
+            else
+            {
+                asset.variant_etags[e] = asset.etag;
+            }
+            asset.variant_etags[e].insert(asset.variant_etags[e].length() - 1, std::string{"-"} + ENCODING_NAMES[e]);
+        }
+    }
+
+    // the bucket index stays at most half full, so every probe ends at an empty bucket
+    uint32_t buckets = 1;
+    while (buckets <= 2 * assets.size())
+        buckets <<= 1;
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.record_size = sizeof(Record);
+    header.count = assets.size();
+    header.buckets = buckets;
+    header.records = sizeof(Header);
+    header.index = header.records + assets.size() * sizeof(Record);
+
+    // strings follow the index and bodies start aligned after them
+    std::string strings;
+    uint64_t strings_offset = header.index + buckets * sizeof(uint32_t);
+    auto addString = [&](std::string_view value) {
+        Span span = {strings_offset + strings.length(), value.length()};
+        strings.append(value.data(), value.length());
+        return span;
+    };
+
+    std::vector<uint32_t> index(buckets, 0);
+    for (size_t i = 0; i < assets.size(); ++i)
+    {
+        Asset &asset = assets[i];
+        Record &record = asset.record;
+        memset(&record, 0, sizeof(record));
+        record.hash = AssetPack::hashOf(asset.url);
+        record.path = addString(asset.url);
+        record.content_type = addString(asset.content_type);
+        record.etag = addString(asset.etag);
+        for (int e = 0; e < ENCODING_COUNT; ++e)
+        {
+            if (asset.variants[e].length() > 0)
+                record.variant_etags[e] = addString(asset.variant_etags[e]);
+        }
+        record.inode = asset.info.st_ino;
+        record.mtime_sec = asset.info.st_mtim.tv_sec;
+        record.mtime_nsec = asset.info.st_mtim.tv_nsec;
+
+        uint32_t bucket = record.hash & (buckets - 1);
+        while (index[bucket] != 0)
+            bucket = (bucket + 1) & (buckets - 1);
+        index[bucket] = i + 1;
+    }
+
+    auto align = [](uint64_t offset) { return (offset + PACK_ALIGNMENT - 1) & ~(uint64_t)(PACK_ALIGNMENT - 1); };
+    uint64_t offset = align(strings_offset + strings.length());
+    uint64_t bodies = offset;
+    for (Asset &asset : assets)
+    {
+        asset.record.body = {offset, (uint64_t)asset.info.st_size};
+        offset = align(offset + asset.info.st_size);
+        for (int e = 0; e < ENCODING_COUNT; ++e)
+        {
+            if (asset.variants[e].length() == 0)
+                continue;
+            asset.record.variants[e] = {offset, asset.variants[e].length()};
+            offset = align(offset + asset.variants[e].length());
+        }
+    }
+    header.size = offset;
+
+    std::string temporary = file + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    uint64_t written = 0;
+    auto write = [&](const char *data, size_t length) {
+        while (length > 0)
+        {
+            ssize_t result = ::write(fd, data, length);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return false;
+            data += result;
+            length -= result;
+            written += result;
+        }
+        return true;
+    };
+    auto pad = [&](uint64_t target) {
+        static const char zeros[PACK_ALIGNMENT] = {};
+        return target >= written && write(zeros, target - written);
+    };
+
+    bool result = write((const char *)&header, sizeof(header));
+    for (size_t i = 0; result && i < assets.size(); ++i)
+        result = write((const char *)&assets[i].record, sizeof(Record));
+    result = result && write((const char *)index.data(), index.size() * sizeof(uint32_t)) &&
+             write(strings.data(), strings.length()) && pad(bodies);
+
+    // bodies are copied file by file, a file that changed size meanwhile fails the build
+    for (size_t i = 0; result && i < assets.size(); ++i)
+    {
+        Asset &asset = assets[i];
+        int input = ::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+        result = input >= 0;
+        char buffer[PIPE_CHUNK];
+        uint64_t remaining = asset.record.body.length;
+        while (result && remaining > 0)
+        {
+            ssize_t length = read(input, buffer, std::min<uint64_t>(sizeof(buffer), remaining));
+            if (length < 0 && errno == EINTR)
+                continue;
+            result = length > 0 && write(buffer, length);
+            remaining -= result ? length : 0;
+        }
+        if (input >= 0)
+            close(input);
+        result = result && pad(align(written));
+
+        for (int e = 0; result && e < ENCODING_COUNT; ++e)
+        {
+            if (asset.variants[e].length() > 0)
+                result = write(asset.variants[e].data(), asset.variants[e].length()) && pad(align(written));
+        }
+    }
+
+    result = close(fd) == 0 && result && written == header.size && rename(temporary.c_str(), file.c_str()) == 0;
+    if (!result)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    std::cout << "Packed " << assets.size() << " files into " << file << " (" << header.size << " bytes)" << std::endl;
+    return true;
+}
+
+// Map a pack and prepare the cache entries of its files, returns false if it is missing or malformed
+bool AssetPack::open(const std::string &file)
+{
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header))
+    {
+        close(fd);
+        return false;
+    }
+
+    // the mapping outlives the descriptor and stays until the process exits
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    AssetPack::base = (const char *)mapping;
+    AssetPack::size = info.st_size;
+    const Header *header = (const Header *)AssetPack::base;
+    bool valid = memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) == 0 && header->version == PACK_VERSION &&
+                 header->record_size == sizeof(Record) && header->size == AssetPack::size &&
+                 header->buckets > header->count && (header->buckets & (header->buckets - 1)) == 0 &&
+                 AssetPack::inside({header->records, (uint64_t)header->count * sizeof(Record)}) &&
+                 AssetPack::inside({header->index, (uint64_t)header->buckets * sizeof(uint32_t)});
+
+    const Record *records = (const Record *)(AssetPack::base + header->records);
+    for (uint32_t i = 0; valid && i < header->count; ++i)
+    {
+        const Record &record = records[i];
+        valid = AssetPack::inside(record.path) && AssetPack::inside(record.content_type) &&
+                AssetPack::inside(record.etag) && AssetPack::inside(record.body);
+        for (int e = 0; e < ENCODING_COUNT; ++e)
+            valid = valid && AssetPack::inside(record.variant_etags[e]) && AssetPack::inside(record.variants[e]);
+        if (!valid)
+            break;
+
+        // validators and header fields are serialized once here, they depend on the configured max ages
+        std::shared_ptr<CacheEntry> entry = std::make_shared<CacheEntry>();
+        entry->path = "." + std::string(AssetPack::view(record.path));
+        entry->content_type = AssetPack::view(record.content_type);
+        entry->etag = AssetPack::view(record.etag);
+        entry->validators = HttpResponse::validatorsOf(entry->etag, record.mtime_sec, entry->path);
+        entry->inode = record.inode;
+        entry->size = record.body.length;
+        entry->mtime = {(time_t)record.mtime_sec, (long)record.mtime_nsec};
+        entry->slot = 0;
+        entry->referenced = false;
+        entry->mapped = AssetPack::view(record.body);
+        entry->packed = true;
+        entry->header = "Content-Type: " + entry->content_type + CRLF;
+        if (HttpResponse::isCompressible(entry->content_type))
+            entry->header += "Vary: Accept-Encoding" + CRLF;
+        entry->header += "Accept-Ranges: bytes" + CRLF +
+                         "Content-Length: " + std::to_string(entry->mapped.length()) + CRLF;
+
+        for (int e = 0; e < ENCODING_COUNT; ++e)
+        {
+            if (record.variants[e].length == 0)
+                continue;
+
+            std::shared_ptr<CacheEntry> variant = std::make_shared<CacheEntry>();
+            variant->path = entry->path + ENCODING_SUFFIXES[e];
+            variant->content_type = entry->content_type;
+            variant->etag = AssetPack::view(record.variant_etags[e]);
+            variant->validators = HttpResponse::validatorsOf(variant->etag, record.mtime_sec, entry->path);
+            variant->inode = entry->inode;
+            variant->size = record.variants[e].length;
+            variant->mtime = entry->mtime;
+            variant->slot = 0;
+            variant->referenced = false;
+            variant->mapped = AssetPack::view(record.variants[e]);
+            variant->packed = true;
+            variant->header = "Content-Type: " + entry->content_type + CRLF +
+                              "Content-Encoding: " + ENCODING_NAMES[e] + CRLF +
+                              "Vary: Accept-Encoding" + CRLF +
+                              "Accept-Ranges: bytes" + CRLF +
+                              "Content-Length: " + std::to_string(variant->mapped.length()) + CRLF;
+            entry->variants[e] = variant;
+        }
+        AssetPack::entries.push_back(entry);
+    }
+
+    if (!valid)
+    {
+        AssetPack::entries.clear();
+        munmap(mapping, AssetPack::size);
+        AssetPack::base = nullptr;
+        AssetPack::size = 0;
+        return false;
+    }
+
+    AssetPack::header = header;
+    Logger::info("Mapped " + std::to_string(header->count) + " packed files from " + file);
+    return true;
+}
+
+// Check if a pack was mapped, which then answers for all files
+bool AssetPack::loaded()
+{
+    return AssetPack::header != nullptr;
+}
+
+// Find the entry of a url by probing the mapped bucket index, or nullptr if the pack does not hold it
+std::shared_ptr<const CacheEntry> AssetPack::lookup(std::string_view url)
+{
+    if (AssetPack::header == nullptr)
+        return nullptr;
+
+    uint64_t hash = AssetPack::hashOf(url);
+    uint32_t mask = AssetPack::header->buckets - 1;
+    const uint32_t *index = (const uint32_t *)(AssetPack::base + AssetPack::header->index);
+    const Record *records = (const Record *)(AssetPack::base + AssetPack::header->records);
+    for (uint32_t bucket = hash & mask;; bucket = (bucket + 1) & mask)
+    {
+        uint32_t slot = index[bucket];
+        if (slot == 0 || slot > AssetPack::header->count)
+            return nullptr;
+        const Record &record = records[slot - 1];
+        if (record.hash == hash && AssetPack::view(record.path) == url)
+            return AssetPack::entries[slot - 1];
+    }
+}
+
+// Hash a path with 64-bit FNV-1a, which is stable across builds unlike std::hash
+uint64_t AssetPack::hashOf(std::string_view path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : path)
+    {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Gather the files below a directory that the server would serve, skipping hidden entries
+void AssetPack::collect(const std::string &directory, std::vector<std::string> &paths)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return;
+
+    while (dirent *entry = readdir(dir))
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        std::string path = directory + "/" + entry->d_name;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            continue;
+
+        std::string_view content_type = HttpResponse::toContentType(entry->d_name);
+        if (S_ISDIR(info.st_mode))
+            AssetPack::collect(path, paths);
+        else if (S_ISREG(info.st_mode) && !startsWith(content_type, "Error") && !endsWith(content_type, "directory"))
+            paths.push_back(path);
+    }
+    closedir(dir);
+}
+
+// Check if a span lies within the mapped pack
+bool AssetPack::inside(const Span &span)
+{
+    return span.offset <= AssetPack::size && span.length <= AssetPack::size - span.offset;
+}
+
+// Get the bytes of a span in the mapped pack
+std::string_view AssetPack::view(const Span &span)
+{
+    return std::string_view(AssetPack::base + span.offset, span.length);
+}
+
+// Parse the command line options, returns false on unknown or malformed options
+bool Config::parse(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg{argv[i]};
+        size_t pos = arg.find("=");
+        std::string key = arg.substr(0, pos);
+        std::string value = pos == std::string::npos ? "" : arg.substr(pos + 1);
+
+        bool result = false;
+        if (key == "--cache-size")
+            result = Config::parseSize(value, Config::cache_size);
+        else if (key == "--cache-entry-max")
+            result = Config::parseSize(value, Config::cache_entry_max);
+        else if (key == "--port")
+            result = Config::parseSize(value, Config::port) && Config::port > 0 && Config::port < 65536;
+        else if (key == "--backlog")
+            result = Config::parseSize(value, Config::backlog) && Config::backlog > 0;
+        else if (key == "--loops")
+            result = Config::parseSize(value, Config::loops);
+        else if (key == "--accept-batch")
+            result = Config::parseSize(value, Config::accept_batch);
+        else if (key == "--defer-accept")
+            result = Config::parseSize(value, Config::defer_accept);
+        else if (key == "--fastopen")
+            result = Config::parseSize(value, Config::fastopen);
+        else if (key == "--nodelay")
+            result = Config::parseSwitch(value, Config::nodelay);
+        else if (key == "--pin-cpus")
+            result = Config::parseSwitch(value, Config::pin_cpus);
+        else if (key == "--http2")
+            result = Config::parseSwitch(value, Config::http2);
+        else if (key == "--header-timeout")
+            result = Config::parseSize(value, Config::header_timeout);
+        else if (key == "--idle-timeout")
+            result = Config::parseSize(value, Config::idle_timeout);
+        else if (key == "--write-timeout")
+            result = Config::parseSize(value, Config::write_timeout);
+        else if (key == "--max-requests")
+            result = Config::parseSize(value, Config::max_requests) && Config::max_requests > 0;
+        else if (key == "--workers")
+            result = Config::parseSize(value, Config::workers);
+        else if (key == "--queue-size")
+            result = Config::parseSize(value, Config::queue_size) && Config::queue_size > 0;
+        else if (key == "--queue-timeout")
+            result = Config::parseSize(value, Config::queue_timeout);
+        else if (key == "--check-allocs")
+        {
+            Config::check_allocs = pos == std::string::npos ? "/index.html" : value;
+            result = startsWith(Config::check_allocs, "/");
+        }
+        else if (key == "--io")
+        {
+            Config::io = value;
+            result = value == "epoll" || value == "uring";
+        }
+        else if (key == "--pack")
+        {
+            Config::pack = value;
+            result = value.length() > 0;
+        }
+        else if (key == "--build-pack")
+        {
+            Config::build_pack = value;
+            result = value.length() > 0;
+        }
+        else if (key == "--upload-dir")
+        {
+            Config::upload_dir = value;
+            result = value.length() > 0;
+        }
+        else if (key == "--upload-max")
+            result = Config::parseSize(value, Config::upload_max);
+        else if (key == "--limit-connections")
+            result = Config::parseSize(value, Config::limit_connections) && Config::limit_connections < (1 << LIMITER_COUNT_BITS);
+        else if (key == "--limit-rate")
+            result = Config::parseSize(value, Config::limit_rate) && Config::limit_rate < (1 << 20);
+        else if (key == "--limit-burst")
+            result = Config::parseSize(value, Config::limit_burst) && Config::limit_burst < (1 << 20);
+        else if (key == "--limit-prefix")
+            result = Config::parseSize(value, Config::limit_prefix) && Config::limit_prefix <= 32;
+        else if (key == "--trace")
+        {
+            Config::trace = value;
+            result = value.length() > 0;
+        }
+        else if (key == "--trace-report")
+        {
+            Config::trace_report = value;
+            result = value.length() > 0;
+        }
+        else if (key == "--trace-format")
+        {
+            Config::trace_format = value;
+            result = value == "text" || value == "chrome";
+        }
+        else if (key == "--server-timing")
+            result = Config::parseSwitch(value, Config::server_timing);
+        else if (key == "--metrics")
+        {
+            Config::metrics_path = value == "off" ? "" : value;
+            result = value == "off" || (startsWith(value, "/") && value.length() > 1 && !endsWith(value, "/"));
+        }
+        else if (key == "--bench")
+        {
+            Config::bench = pos == std::string::npos ? "all" : value;
+            result = Config::parseBench(Config::bench);
+        }
+        else if (key == "--bench-duration")
+            result = Config::parseSize(value, Config::bench_duration) && Config::bench_duration > 0;
+        else if (key == "--bench-connections")
+            result = Config::parseSize(value, Config::bench_connections) && Config::bench_connections > 0;
+        else if (key == "--bench-rate")
+            result = Config::parseSize(value, Config::bench_rate);
+        else if (key == "--bench-idle")
+            result = Config::parseSize(value, Config::bench_idle);
+        else if (key == "--max-age")
+            result = Config::parseMaxAges(value);
+        else if (key == "--log-level")
+            result = Config::parseLogLevel(value, Logger::level);
+        else if (key == "--access-log")
+        {
+            result = value == "combined" || value == "common" || value == "off";
+            Logger::access_format = value;
+        }
+
+        if (!result)
+        {
+            std::cerr << "Invalid option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Parse a byte size with an optional K, M or G suffix
+bool Config::parseSize(const std::string &value, size_t &result)
+{
+    if (value.length() == 0)
+        return false;
+
+    char *end = nullptr;
+    unsigned long long size = strtoull(value.c_str(), &end, 10);
+    std::string suffix = toLower(end);
+
+    if (suffix == "k")
+        size <<= 10;
+    else if (suffix == "m")
+        size <<= 20;
+    else if (suffix == "g")
+        size <<= 30;
+    else if (suffix.length() > 0)
+        return false;
+
+    result = size;
+    return true;
+}
+
+// Parse a comma separated list of EXT:SECONDS, where * sets the default
+bool Config::parseMaxAges(const std::string &value)
+{
+    size_t start_pos = 0;
+    while (start_pos < value.length())
+    {
+        size_t end_pos = value.find(",", start_pos);
+        if (end_pos == std::string::npos)
+            end_pos = value.length();
+
+        std::string item = value.substr(start_pos, end_pos - start_pos);
+        start_pos = end_pos + 1;
+
+        size_t colon = item.find(":");
+        if (colon == std::string::npos || colon + 1 >= item.length())
+            return false;
+
+        std::string extension = toLower(item.substr(0, colon));
+        if (extension != "*" && lookupTable(HttpResponse::CONTENT_TYPES, std::string_view(extension)).length() == 0)
+            return false;
+
+        char *end = nullptr;
+        long seconds = strtol(item.c_str() + colon + 1, &end, 10);
+        if (*end != '\0' || seconds < 0)
+            return false;
+
+        Config::max_ages[extension] = seconds;
+    }
+
+    return true;
+}
+
+// Check a comma separated list of benchmark names, or all, so a misspelled name cannot pass as an empty run
+bool Config::parseBench(const std::string &value)
+{
+    if (value == "all")
+        return true;
+
+    std::string_view list{value};
+    while (true)
+    {
+        size_t comma = list.find(',');
+        std::string_view name = list.substr(0, comma);
+        if (std::find(std::begin(BENCH_NAMES), std::end(BENCH_NAMES), name) == std::end(BENCH_NAMES))
+            return false;
+        if (comma == std::string_view::npos)
+            return true;
+        list.remove_prefix(comma + 1);
+    }
+}
+
+// Parse a log level name
+bool Config::parseLogLevel(const std::string &value, LogLevel &result)
+{
+    if (value == "debug")
+        result = LogLevel::DEBUG;
+    else if (value == "info")
+        result = LogLevel::INFO;
+    else if (value == "error")
+        result = LogLevel::ERROR;
+    else if (value == "none")
+        result = LogLevel::NONE;
+    else
+        return false;
+
+    return true;
+}
+
+// Parse an on or off switch
+bool Config::parseSwitch(const std::string &value, bool &result)
+{
+    if (value == "on")
+        result = true;
+    else if (value == "off")
+        result = false;
+    else
+        return false;
+
+    return true;
+}
+
+// Get the slot of the calling thread, registering it on first use
+Metrics::Slot *Metrics::local()
+{
+    thread_local Slot *slot = nullptr;
+    if (slot == nullptr)
+    {
+        slot = new Slot();
+        std::lock_guard<std::mutex> lock(Metrics::mutex);
+        Metrics::slots.push_back(slot);
+    }
+    return slot;
+}
+
+// Add to a counter of the calling thread's slot
+void Metrics::add(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Count a phase duration into its histogram
+void Metrics::record(Phase phase, std::chrono::steady_clock::duration elapsed)
+{
+    uint64_t micros = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    Slot *slot = Metrics::local();
+    Metrics::add(slot->latencies[(int)phase][Metrics::bucketOf(micros)]);
+    Metrics::add(slot->latency_sums[(int)phase], micros);
+}
+
+// Remember a listener shard whose accept queue is reported
+void Metrics::addListener(int fd)
+{
+    std::lock_guard<std::mutex> lock(Metrics::mutex);
+    Metrics::listeners.push_back(fd);
+}
 
-    this->ifs.open("." + request->url, flags);
-    if (!this->ifs.is_open() || !this->ifs.good())
-    {
-        this->status_code = 404;
-        std::cerr << "Reading file failed with path " << request->url << std::endl;
-        Logger::log << "Reading file failed with path " << request->url << std::endl;
-        return;
-    }
+// Find the histogram bucket of a duration, linear below 8 us and 8 sub-buckets per power of two above
+size_t Metrics::bucketOf(uint64_t micros)
+{
+    if (micros < HISTOGRAM_SUB_BUCKETS)
+        return micros;
 
-    // store the file content
-    this->content = std::string{(std::istreambuf_iterator<char>(this->ifs)), std::istreambuf_iterator<char>()};
+    int exponent = 63 - __builtin_clzll(micros);
+    size_t bucket = (exponent - 2) * HISTOGRAM_SUB_BUCKETS + ((micros >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return std::min(bucket, HISTOGRAM_BUCKETS - 1);
+}
 
-    if (this->contentLength() < 0)
-    {
-        this->status_code = 404;
-        std::cerr << "Reading file size failed with path " << request->url << std::endl;
-        Logger::log << "Reading file size failed with path " << request->url << std::endl;
-        return;
-    }
+// Get the exclusive upper bound in microseconds of a histogram bucket
+uint64_t Metrics::bucketLimit(size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket + 1;
 
-    // read file successful
-    this->status_code = 200;
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+    return (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS + 1) << (exponent - 3);
 }
 
-HttpResponse::~HttpResponse()
+// Sum the cache hits of all threads
+unsigned long long Metrics::cacheHits()
 {
-    if (this->ifs.is_open())
-        this->ifs.close();
+    std::lock_guard<std::mutex> lock(Metrics::mutex);
+    unsigned long long total = 0;
+    for (Slot *slot : Metrics::slots)
+        total += slot->cache_hits.load(std::memory_order_relaxed);
+    return total;
 }
 
-// Get the length of the stored content
-int HttpResponse::contentLength() const
+// Sum the cache misses of all threads
+unsigned long long Metrics::cacheMisses()
 {
-    return this->content.length();
+    std::lock_guard<std::mutex> lock(Metrics::mutex);
+    unsigned long long total = 0;
+    for (Slot *slot : Metrics::slots)
+        total += slot->cache_misses.load(std::memory_order_relaxed);
+    return total;
 }
 
-// Generate the response message or debug message
-std::string HttpResponse::toString(bool debug)
+// Merge the slots of all threads into the Prometheus text exposition format
+std::string Metrics::render()
 {
-    // construct the debug message
-    if (debug)
+    unsigned long long opened = 0;
+    unsigned long long closed = 0;
+    unsigned long long refused = 0;
+    unsigned long long bytes = 0;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long path_hits = 0;
+    unsigned long long path_misses = 0;
+    unsigned long long spills = 0;
+    std::vector<unsigned long long> statuses(METRICS_STATUS_LIMIT, 0);
+    std::vector<unsigned long long> sums(PHASE_COUNT, 0);
+    std::vector<unsigned long long> latencies(PHASE_COUNT * HISTOGRAM_BUCKETS, 0);
+    unsigned long long accept_depth = 0;
+    unsigned long long accept_limit = 0;
     {
-        std::string value{""};
-        value += "HttpResponse {";
-        value += ("\n\tversion: " + this->version);
-        value += ("\n\tstatus_code: " + std::to_string(this->status_code));
-        value += ("\n\tcontent_type: " + this->content_type);
-        value += ("\n\tcontent_length: " + std::to_string(this->contentLength()));
-        value += ("\n\tconnection: " + this->connection);
-        value += ("\n\tis_file_read: ");
-        value += (this->ifs.is_open() && this->ifs.good()) ? "true" : "false";
-        value += "\n}\n";
-        return value;
-    }
-
-    // construct the response message
-    std::string response{""};
-    response += (this->version + SP);
-    response += (std::to_string(this->status_code) + SP);
-    response += (HttpResponse::toReasonPhrase(this->status_code) + CRLF);
-
-    response += ("Date: " + HttpResponse::currentDateTime() + CRLF);
+        std::lock_guard<std::mutex> lock(Metrics::mutex);
+        for (Slot *slot : Metrics::slots)
+        {
+            opened += slot->connections_opened.load(std::memory_order_relaxed);
+            closed += slot->connections_closed.load(std::memory_order_relaxed);
+            refused += slot->connections_refused.load(std::memory_order_relaxed);
+            bytes += slot->bytes_sent.load(std::memory_order_relaxed);
+            hits += slot->cache_hits.load(std::memory_order_relaxed);
+            misses += slot->cache_misses.load(std::memory_order_relaxed);
+            path_hits += slot->path_hits.load(std::memory_order_relaxed);
+            path_misses += slot->path_misses.load(std::memory_order_relaxed);
+            spills += slot->arena_spills.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < METRICS_STATUS_LIMIT; ++i)
+                statuses[i] += slot->statuses[i].load(std::memory_order_relaxed);
+            for (int phase = 0; phase < PHASE_COUNT; ++phase)
+            {
+                sums[phase] += slot->latency_sums[phase].load(std::memory_order_relaxed);
+                for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                    latencies[phase * HISTOGRAM_BUCKETS + i] += slot->latencies[phase][i].load(std::memory_order_relaxed);
+            }
+        }
 
-    response += ("Connection: " + this->connection + CRLF);
-    if (this->connection == "keep-alive")
-    {
-        response += ("Keep-Alive: timeout=5, max=1000" + CRLF);
+        // for a listening socket TCP_INFO reports the accept queue length and its limit
+        for (int fd : Metrics::listeners)
+        {
+            tcp_info info;
+            socklen_t length = sizeof(info);
+            if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+            {
+                accept_depth += info.tcpi_unacked;
+                accept_limit += info.tcpi_sacked;
+            }
+        }
     }
 
-    std::string contentType{"text/html"};
-
-    if (this->status_code >= 200 && this->status_code < 400 &&
-        this->content_type.length() > 0 && !startsWith(this->content_type, "Error"))
+    std::string text;
+    text.reserve(METRICS_RESERVE);
+    char line[256];
+    auto metric = [&](const char *name, const char *type, const char *help) {
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+        text += line;
+    };
+    auto value = [&](const char *name, unsigned long long number) {
+        snprintf(line, sizeof(line), "%s %llu\n", name, number);
+        text += line;
+    };
+
+    metric("http_connections_active", "gauge", "Client connections currently open.");
+    value("http_connections_active", opened - std::min(opened, closed));
+    metric("http_connections_total", "counter", "Client connections accepted.");
+    value("http_connections_total", opened);
+    metric("http_connections_refused_total", "counter", "Client connections closed at accept for exceeding the per-client limit.");
+    value("http_connections_refused_total", refused);
+
+    metric("http_accept_queue_depth", "gauge", "Connections waiting in the listener accept queues.");
+    value("http_accept_queue_depth", accept_depth);
+    metric("http_accept_queue_limit", "gauge", "Capacity of the listener accept queues.");
+    value("http_accept_queue_limit", accept_limit);
+    metric("http_worker_queue_depth", "gauge", "Requests waiting for a worker.");
+    value("http_worker_queue_depth", WorkerPool::depth());
+
+    metric("http_requests_total", "counter", "Responses sent by status code.");
+    for (size_t code = 0; code < METRICS_STATUS_LIMIT; ++code)
     {
-        contentType = this->content_type;
+        if (statuses[code] == 0)
+            continue;
+        snprintf(line, sizeof(line), "http_requests_total{code=\"%zu\"} %llu\n", code, statuses[code]);
+        text += line;
     }
-
-    response += ("Content-Type: " + contentType + CRLF);
-
-    if (this->status_code < 200 || this->status_code >= 400)
+    metric("http_response_bytes_total", "counter", "Bytes written to client sockets.");
+    value("http_response_bytes_total", bytes);
+
+    metric("http_cache_hits_total", "counter", "File cache lookups served from memory.");
+    value("http_cache_hits_total", hits);
+    metric("http_cache_misses_total", "counter", "File cache lookups that went to the file system.");
+    value("http_cache_misses_total", misses);
+    metric("http_cache_hit_ratio", "gauge", "Share of file cache lookups served from memory.");
+    snprintf(line, sizeof(line), "http_cache_hit_ratio %.4f\n", hits + misses > 0 ? (double)hits / (hits + misses) : 0.0);
+    text += line;
+
+    metric("http_path_index_hits_total", "counter", "Path lookups answered by the index, for present and missing files alike.");
+    value("http_path_index_hits_total", path_hits);
+    metric("http_path_index_misses_total", "counter", "Path lookups resolved beneath the docroot.");
+    value("http_path_index_misses_total", path_misses);
+
+    metric("http_arena_spills_total", "counter", "Response temporaries that outgrew the per-thread arena and came from the heap.");
+    value("http_arena_spills_total", spills);
+
+    // the fine buckets are folded into power-of-two bounds, and the quantiles are read from the fine ones
+    metric("http_request_phase_seconds", "histogram", "Time spent per request phase: worker queue, response build, socket write and total.");
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
     {
-        std::string html = HttpResponse::htmlTemplateOf(this->status_code);
-        response += ("Content-Length: " + std::to_string(html.length()) + CRLF + CRLF);
-        response += html;
-        return response;
+        unsigned long long *buckets = latencies.data() + phase * HISTOGRAM_BUCKETS;
+        unsigned long long cumulative = 0;
+        size_t bucket = 0;
+        for (uint64_t bound = 1; bound <= Metrics::bucketLimit(HISTOGRAM_BUCKETS - 1); bound <<= 1)
+        {
+            while (bucket < HISTOGRAM_BUCKETS && Metrics::bucketLimit(bucket) <= bound)
+                cumulative += buckets[bucket++];
+            snprintf(line, sizeof(line), "http_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", PHASE_NAMES[phase], bound / 1e6, cumulative);
+            text += line;
+        }
+        while (bucket < HISTOGRAM_BUCKETS)
+            cumulative += buckets[bucket++];
+        snprintf(line, sizeof(line), "http_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", PHASE_NAMES[phase], cumulative);
+        text += line;
+        snprintf(line, sizeof(line), "http_request_phase_seconds_sum{phase=\"%s\"} %g\n", PHASE_NAMES[phase], sums[phase] / 1e6);
+        text += line;
+        snprintf(line, sizeof(line), "http_request_phase_seconds_count{phase=\"%s\"} %llu\n", PHASE_NAMES[phase], cumulative);
+        text += line;
     }
 
-    response += ("Content-Length: " + std::to_string(this->contentLength()) + CRLF + CRLF);
+    metric("http_request_phase_quantile_seconds", "gauge", "Upper bound of the histogram bucket holding the quantile.");
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
+    {
+        unsigned long long *buckets = latencies.data() + phase * HISTOGRAM_BUCKETS;
+        unsigned long long total = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+            total += buckets[i];
 
-    response += this->content;
+        for (double quantile : quantiles)
+        {
+            unsigned long long cumulative = 0;
+            size_t bucket = 0;
+            while (bucket + 1 < HISTOGRAM_BUCKETS && (total == 0 || cumulative + buckets[bucket] < quantile * total))
+                cumulative += buckets[bucket++];
+            snprintf(line, sizeof(line), "http_request_phase_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %g\n",
+                     PHASE_NAMES[phase], quantile, total == 0 ? 0.0 : Metrics::bucketLimit(bucket) / 1e6);
+            text += line;
+        }
+    }
 
-    return response;
+    return text;
 }
 
-// Convert filename to content type based on extension
-std::string HttpResponse::toContentType(std::string name)
+// Open the log files and start the writer thread
+bool Logger::open(const std::string &info_path, const std::string &access_path)
 {
-    // filename is directory if no extension
-    int pos = name.find_last_of(".");
-    if (pos == std::string::npos || pos + 1 >= name.length())
-    {
-        return "text/directory";
-    }
+    Logger::info_fd = ::open(info_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (Logger::info_fd < 0)
+        return false;
 
-    std::string extension = name.substr(pos + 1);
-    std::map<std::string, std::string>::const_iterator it = HttpResponse::CONTENT_TYPES.find(extension);
-    if (it != HttpResponse::CONTENT_TYPES.cend())
+    if (Logger::access_format != "off")
     {
-        return it->second;
+        Logger::access_fd = ::open(access_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (Logger::access_fd < 0)
+            return false;
     }
 
-    return "Error: Unknown content type";
+    Logger::running = true;
+    Logger::writer = std::thread(Logger::run);
+    return true;
 }
 
-// Convert status code to reason phrase
-std::string HttpResponse::toReasonPhrase(int status_code)
+// Stop the writer thread after flushing the pending records
+void Logger::close()
 {
-    std::map<int, std::string>::const_iterator it = HttpResponse::REASON_PHRASES.find(status_code);
-    if (it != HttpResponse::REASON_PHRASES.cend())
-    {
-        return it->second;
-    }
-    return "Error: Unknown status code";
+    if (Logger::running.exchange(false) && Logger::writer.joinable())
+        Logger::writer.join();
+
+    if (Logger::info_fd >= 0)
+        ::close(Logger::info_fd);
+    if (Logger::access_fd >= 0)
+        ::close(Logger::access_fd);
+    Logger::info_fd = -1;
+    Logger::access_fd = -1;
 }
 
-// Convert status code to user-friendly message
-std::string HttpResponse::toMessage(int status_code)
+// Check if messages of the level are written
+bool Logger::enabled(LogLevel level)
 {
-    std::string message{""};
-    switch (status_code)
-    {
-    case 400:
-        message += "Please check the request format.";
-        break;
-
-    case 403:
-        message += "Directory listing is not allowed.";
-        break;
-
-    case 404:
-        message += "The requested file or directory cannot be found.";
-        break;
-
-    case 405:
-    case 501:
-        message += "GET is currently the only supported method.";
-        break;
-
-    case 415:
-        message += "The requested file format is currently not supported.";
-        break;
-
-    case 500:
-        message += "The server is experiencing some unknown errors.";
-        break;
-
-    case 503:
-        message += "The server is currently busy. Please try again later.";
-        break;
+    return level >= Logger::level && Logger::level != LogLevel::NONE;
+}
 
-    case 505:
-        message += "The requested HTTP version is not supported. Please consider using HTTP/1.1.";
-        break;
+// Log a verbose diagnostic message
+void Logger::debug(std::string_view message)
+{
+    if (Logger::enabled(LogLevel::DEBUG))
+        Logger::write(KIND_DEBUG, message);
+}
 
-    default:
-        message += "No message available.";
-        break;
-    }
+// Log an informational message
+void Logger::info(std::string_view message)
+{
+    if (Logger::enabled(LogLevel::INFO))
+        Logger::write(KIND_INFO, message);
+}
 
-    return message;
+// Log an error message
+void Logger::error(std::string_view message)
+{
+    if (Logger::enabled(LogLevel::ERROR))
+        Logger::write(KIND_ERROR, message);
 }
 
-// Get http-date formatted string of the current datetime
-std::string HttpResponse::currentDateTime()
+// Log an error message followed by its detail, joined in a per-thread buffer so the request path does not allocate
+void Logger::error(std::string_view message, std::string_view detail)
 {
-    time_t localTime;
-    time(&localTime);
-    tm *gmtTime = gmtime(&localTime);
-    char buf[80];
-    // example: Wed, 19 Dec 2010 16:00:21 GMT
-    strftime(buf, 80, "%a, %d %b %Y %X GMT", gmtTime);
-    return std::string{buf};
+    if (!Logger::enabled(LogLevel::ERROR))
+        return;
+
+    thread_local std::string line;
+    line.assign(message).append(detail);
+    Logger::write(KIND_ERROR, line);
 }
 
-// Generate html template based of status code
-std::string HttpResponse::htmlTemplateOf(int status_code)
+// Log a served request in Common or Combined Log Format
+void Logger::access(const char *ip, const HttpRequest &request, int status_code, long long bytes)
 {
-    std::string html{""};
-    std::ifstream ifs{"./templates/error.html"};
+    if (Logger::access_fd < 0)
+        return;
 
-    if (!ifs.is_open() || !ifs.good())
+    // the timestamp only changes once per second
+    thread_local time_t cached_time = 0;
+    thread_local char timestamp[32] = {0};
+    time_t now = time(nullptr);
+    if (now != cached_time)
     {
-        // basic error message
-        html += ("<h1>" + std::to_string(status_code) + " " + HttpResponse::toReasonPhrase(status_code) + "</h1>");
-        return html;
+        tm gmt;
+        gmtime_r(&now, &gmt);
+        strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S +0000", &gmt);
+        cached_time = now;
     }
 
-    // read the error page template
-    html = std::string{(std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>()};
-    ifs.close();
-
-    // substitute placeholders with actual values
-    bool result = true;
-    result = result && replaceAll(html, "{%status_code%}", std::to_string(status_code));
-    result = result && replaceAll(html, "{%reason_phrase%}", HttpResponse::toReasonPhrase(status_code));
-    result = result && replaceAll(html, "{%message%}", HttpResponse::toMessage(status_code));
+    std::string_view request_line = request.head.substr(0, request.head.find(CRLF));
+    char line[LOG_RECORD_SIZE * 4];
+    int length = 0;
 
-    if (!result)
+    if (Logger::access_format == "combined")
+    {
+        std::string_view referer = request.header("Referer");
+        std::string_view user_agent = request.header("User-Agent");
+        if (referer.length() == 0)
+            referer = "-";
+        if (user_agent.length() == 0)
+            user_agent = "-";
+        length = snprintf(line, sizeof(line), "%s - - [%s] \"%.*s\" %d %lld \"%.*s\" \"%.*s\"",
+                          ip, timestamp, (int)request_line.length(), request_line.data(), status_code, bytes,
+                          (int)referer.length(), referer.data(), (int)user_agent.length(), user_agent.data());
+    }
+    else
     {
-        std::cerr << "Substituting template error.html failed!\nContent:\n"
-                  << html << std::endl;
-        Logger::log << "Substituting template error.html failed!\nContent:\n"
-                    << html << std::endl;
+        length = snprintf(line, sizeof(line), "%s - - [%s] \"%.*s\" %d %lld",
+                          ip, timestamp, (int)request_line.length(), request_line.data(), status_code, bytes);
     }
 
-    return html;
+    if (length > 0)
+        Logger::write(KIND_ACCESS, std::string_view(line, std::min((size_t)length, sizeof(line) - 1)));
 }
 
-// Generate html template for directory listing based on the path
-std::string HttpResponse::htmlTemplateOf(std::string directory_path)
+// Get the ring of the calling thread, registering it on first use
+Logger::Ring *Logger::localRing()
 {
-    std::string html{""};
-    std::ifstream ifs{"./templates/dirlist.html"};
-
-    if (!ifs.is_open() || !ifs.good())
+    thread_local Ring *ring = nullptr;
+    if (ring == nullptr)
     {
-        html += ("<h1>Missing file template</h1>");
-        return html;
+        ring = new Ring();
+        std::lock_guard<std::mutex> lock(Logger::rings_mutex);
+        Logger::rings.push_back(ring);
     }
+    return ring;
+}
 
-    // read the directory listing page template
-    html = std::string{(std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>()};
-    ifs.close();
-
-    std::string list{""};
-    struct dirent **entList;
-    int count = scandir(directory_path.c_str(), &entList, NULL, alphasort);
+// Copy a message into the thread ring without blocking, dropping it if the ring is full
+void Logger::write(Kind kind, std::string_view message)
+{
+    Ring *ring = Logger::localRing();
+    const size_t capacity = sizeof(Record::text);
+    size_t count = message.length() == 0 ? 1 : (message.length() + capacity - 1) / capacity;
 
-    if (count < 0)
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    size_t tail = ring->tail.load(std::memory_order_acquire);
+    if (head - tail + count > LOG_RING_SIZE)
     {
-        return list;
+        ++ring->dropped;
+        return;
     }
 
-    // print directory before files
-    for (int i = count - 1; i >= 0; --i)
+    for (size_t i = 0; i < count; ++i)
     {
-        std::string name{entList[i]->d_name};
-
-        // append / character after directory name
-        if (entList[i]->d_type == DT_DIR)
-        {
-            name += "/";
-        }
-        else
-        {
-            continue;
-        }
+        Record &record = ring->records[(head + i) % LOG_RING_SIZE];
+        std::string_view piece = message.substr(i * capacity, capacity);
+        record.kind = kind;
+        record.more = i + 1 < count;
+        record.length = piece.length();
+        memcpy(record.text, piece.data(), piece.length());
+    }
 
-        // ignore current directory and parent entry
-        if (name == "./" || name == "../")
-        {
-            continue;
-        }
+    ring->head.store(head + count, std::memory_order_release);
+}
 
-        list += ("\n<li><a href=\"" + name + "\">" + name + "</a></li>");
+// Move all pending records into batched writes, returns false if there was nothing to write
+bool Logger::drain()
+{
+    std::vector<Ring *> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(Logger::rings_mutex);
+        snapshot = Logger::rings;
     }
 
-    // print files after directory
-    for (int i = count - 1; i >= 0; --i)
+    std::string info_batch, access_batch, out_batch, err_batch;
+    unsigned long long dropped = 0;
+
+    for (Ring *ring : snapshot)
     {
-        std::string name{entList[i]->d_name};
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
 
-        // append / character after directory name
-        if (entList[i]->d_type == DT_DIR)
+        // only consume whole messages
+        while (head > tail && ring->records[(head - 1) % LOG_RING_SIZE].more)
+            --head;
+
+        for (size_t i = tail; i < head; ++i)
         {
-            free(entList[i]);
-            continue;
+            const Record &record = ring->records[i % LOG_RING_SIZE];
+            std::string &batch = record.kind == KIND_ACCESS ? access_batch : info_batch;
+            batch.append(record.text, record.length);
+            if (record.kind == KIND_ERROR)
+                err_batch.append(record.text, record.length);
+            else if (record.kind != KIND_ACCESS)
+                out_batch.append(record.text, record.length);
+
+            if (!record.more)
+            {
+                batch += '\n';
+                if (record.kind == KIND_ERROR)
+                    err_batch += '\n';
+                else if (record.kind != KIND_ACCESS)
+                    out_batch += '\n';
+            }
         }
 
-        free(entList[i]);
-
-        list += ("\n<li><a href=\"" + name + "\">" + name + "</a></li>");
+        ring->tail.store(head, std::memory_order_release);
+        dropped += ring->dropped.exchange(0);
     }
 
-    free(entList);
-
-    if (startsWith(directory_path, "."))
+    if (dropped > 0)
     {
-        directory_path.erase(0, 1);
+        std::string message = "Logger dropped " + std::to_string(dropped) + " records\n";
+        info_batch += message;
+        err_batch += message;
     }
 
-    if (!endsWith(directory_path, "/"))
+    // one write per destination for the whole batch
+    std::pair<int, std::string *> targets[] = {
+        {Logger::info_fd, &info_batch},
+        {Logger::access_fd, &access_batch},
+        {STDOUT_FILENO, &out_batch},
+        {STDERR_FILENO, &err_batch},
+    };
+
+    bool written = false;
+    for (auto &target : targets)
     {
-        directory_path += "/";
+        size_t offset = 0;
+        while (target.first >= 0 && offset < target.second->length())
+        {
+            ssize_t result = ::write(target.first, target.second->data() + offset, target.second->length() - offset);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                break;
+            offset += result;
+        }
+        written = written || target.second->length() > 0;
     }
 
-    bool result = true;
-    result = result && replaceAll(html, "{%path%}", directory_path);
-    result = result && replaceAll(html, "{%list%}", list);
+    return written;
+}
 
-    if (!result)
+// Drain the rings until the logger is closed
+void Logger::run()
+{
+    while (Logger::running.load())
     {
-        std::cerr << "Substituting template dirlist.html failed!\nContent:\n"
-                  << html << std::endl;
-        Logger::log << "Substituting template dirlist.html failed!\nContent:\n"
-                    << html << std::endl;
+        if (!Logger::drain())
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_MS));
     }
 
-    return html;
+    Logger::drain();
 }
 
-// Check the status of the request
-int HttpRequest::status() const
+// Calibrate the time stamp counter against the steady clock and start stamping requests
+void Tracer::start(bool recording)
 {
-    if (this->method == HttpMethod::UNDEFINED)
-        return 501;
-
-    if (!startsWith(this->url, "/"))
-        return 400;
-
-    if (!startsWith(this->version, "HTTP/"))
-        return 505;
-
-    return 0; // good request
+    Tracer::active = true;
+    Tracer::recording = recording;
+
+#if defined(__x86_64__) || defined(__i386__)
+    // the counter is invariant across cores on the processors this runs on, so one rate serves all threads
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    uint64_t ticks = __rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(TRACE_CALIBRATE_MS));
+    ticks = __rdtsc() - ticks;
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - begin;
+    Tracer::nanos_per_tick = ticks == 0 ? 1.0 : (double)elapsed.count() / ticks;
+#endif
+
+    timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    Tracer::epoch_ticks = Tracer::now();
+    Tracer::epoch = (int64_t)wall.tv_sec * 1000000000 + wall.tv_nsec;
 }
 
-// Check the connection state
-bool HttpRequest::toCloseConnection() const
+// Read the time stamp counter, or the steady clock elsewhere, zero while tracing is off
+uint64_t Tracer::now()
 {
-    return this->connection == "close";
+    if (!Tracer::active)
+        return 0;
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
 }
 
-// Send a http response based on the request
-bool HttpRequest::sendResponse(int conn_fd)
+// Add a Server-Timing field with the phases done before the header is rendered, in milliseconds
+void Tracer::appendTiming(const TraceSpan &span, std::pmr::string &headers)
 {
-    HttpResponse *response = new HttpResponse(this);
-    std::string msg = response->toString();
-    std::string debug = "\nconn_fd: " + std::to_string(conn_fd) + "\n" + this->toString() + response->toString(true);
-
-    int result = send(conn_fd, msg.c_str(), msg.length(), 0);
+    uint32_t durations[] = {
+        Tracer::between(span.received, span.parsing),
+        Tracer::between(span.parsing, span.parsed),
+        Tracer::between(span.parsed, span.picked),
+        Tracer::between(span.picked, span.opened),
+    };
+
+    char field[160];
+    int length = snprintf(field, sizeof(field), "Server-Timing: ");
+    for (size_t i = 0; i < sizeof(durations) / sizeof(durations[0]); ++i)
+    {
+        length += snprintf(field + length, sizeof(field) - length, "%s%s;dur=%.3f", i == 0 ? "" : ", ",
+                           TRACE_PHASE_NAMES[i], durations[i] / 1e6);
+    }
+    headers.append(field, length);
+    headers += CRLF;
+}
 
-    delete response;
-    response = nullptr;
+// Turn the stamps of a built response into its record, sending the one still pending from the request before
+void Tracer::build(HttpRequest &request, int status_code, long long bytes, int fd)
+{
+    TraceSpan &span = request.trace;
+    if (Tracer::recording)
+    {
+        Tracer::finish(request);
+        span.built = Tracer::now();
 
-    if (result < 0)
-        return false;
+        // requests answered before they were parsed start where their first stamp is
+        uint64_t first = span.built;
+        for (uint64_t stamp : {span.opened, span.picked, span.parsing, span.received})
+        {
+            if (stamp != 0)
+                first = stamp;
+        }
 
-    // log the constructed response
-    std::cout << debug << std::endl;
-    Logger::log << debug << std::endl;
+        TraceRecord &record = span.record;
+        record.start = first > Tracer::epoch_ticks ? (uint64_t)((first - Tracer::epoch_ticks) * Tracer::nanos_per_tick) : 0;
+        record.bytes = bytes < 0 ? 0 : bytes;
+        record.phases[(int)TracePhase::RECEIVE] = Tracer::between(span.received, span.parsing);
+        record.phases[(int)TracePhase::PARSE] = Tracer::between(span.parsing, span.parsed);
+        record.phases[(int)TracePhase::QUEUE] = Tracer::between(span.parsed, span.picked);
+        record.phases[(int)TracePhase::OPEN] = Tracer::between(span.picked, span.opened);
+        record.phases[(int)TracePhase::RENDER] = Tracer::between(span.opened, span.built);
+        record.phases[(int)TracePhase::SEND] = 0;
+        record.thread = 0;
+        record.connection = fd;
+        record.status = status_code;
+        record.protocol = request.version == "HTTP/2" ? 2 : 1;
+        record.method = (int8_t)request.method;
+        memset(record.url, 0, sizeof(record.url));
+        memcpy(record.url, request.url.data(), std::min(request.url.length(), sizeof(record.url)));
+        span.pending = true;
+    }
 
-    return true;
+    // the next request on the connection starts from fresh stamps
+    span.received = 0;
+    span.parsing = 0;
+    span.parsed = 0;
+    span.picked = 0;
+    span.opened = 0;
 }
 
-// Generate the debug message
-std::string HttpRequest::toString() const
+// Time the sending of a pending record and copy it into the ring of the calling thread
+void Tracer::finish(HttpRequest &request)
 {
-    std::string value{""};
-    value += "HttpRequest {";
-    value += ("\n\tstatus: " + std::to_string(this->status()));
-    value += "\n\tmethod: ";
-    switch (this->method)
-    {
-    case HttpMethod::GET:
-        value += "GET";
-        break;
-    case HttpMethod::POST:
-        value += "POST";
-        break;
-    case HttpMethod::UNDEFINED:
-    default:
-        value += "UNDEFINED";
-    }
-    value += ("\n\turl: " + this->url);
-    value += ("\n\tversion: " + this->version);
-    value += ("\n\tconnection: " + this->connection);
-    value += "\n}\n";
-    return value;
+    TraceSpan &span = request.trace;
+    if (!span.pending)
+        return;
+    span.pending = false;
+    span.record.phases[(int)TracePhase::SEND] = Tracer::between(span.built, Tracer::now());
+
+    Ring *ring = Tracer::localRing();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceRecord &record = ring->records[head % TRACE_RING_SIZE];
+    record = span.record;
+    record.thread = ring->thread;
+    ring->head.store(head + 1, std::memory_order_release);
 }
 
-// Create a HttpRequest object by parsing the request message
-HttpRequest *HttpRequest::parse(std::string msg)
+// Write the records of all rings into a trace file replaced in one step, returns false if it could not be written
+bool Tracer::dump(const std::string &file, size_t &count)
 {
-    HttpRequest *request = new HttpRequest();
-
-    // parse the method
-    int start_pos = 0;
-    int end_pos = msg.find(SP, start_pos);
-    if (start_pos >= msg.length() || end_pos == std::string::npos)
+    std::vector<Ring *> snapshot;
     {
-        return request;
+        std::lock_guard<std::mutex> lock(Tracer::rings_mutex);
+        snapshot = Tracer::rings;
     }
 
-    request->method = HttpRequest::toMethod(msg.substr(start_pos, end_pos - start_pos));
-
-    // parse the url
-    start_pos = end_pos + 1;
-    end_pos = msg.find(SP, start_pos);
-    if (start_pos >= msg.length() || end_pos == std::string::npos)
+    // the owners keep writing, so records they may have overwritten during the copy are dropped afterwards
+    std::vector<TraceRecord> records;
+    for (Ring *ring : snapshot)
     {
-        return request;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        size_t offset = records.size();
+        for (uint64_t i = first; i < head; ++i)
+            records.push_back(ring->records[i % TRACE_RING_SIZE]);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t last = ring->head.load(std::memory_order_relaxed);
+        uint64_t overwritten = last >= TRACE_RING_SIZE ? last - TRACE_RING_SIZE + 1 : 0;
+        if (overwritten > first)
+            records.erase(records.begin() + offset, records.begin() + offset + std::min(overwritten - first, head - first));
     }
-
-    request->url = msg.substr(start_pos, end_pos - start_pos);
-
-    // redirect to index.html if root directory is requested
-    if (request->url == "/")
+    std::sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) { return a.start < b.start; });
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.phase_count = TRACE_PHASE_COUNT;
+    header.threads = snapshot.size();
+    header.count = records.size();
+    header.epoch = Tracer::epoch;
+
+    std::string temporary = file + ".tmp";
+    std::ofstream output(temporary, std::ios::binary | std::ios::trunc);
+    output.write((const char *)&header, sizeof(header));
+    output.write((const char *)records.data(), records.size() * sizeof(TraceRecord));
+    output.close();
+    if (!output || rename(temporary.c_str(), file.c_str()) != 0)
     {
-        request->url = "/index.html";
+        unlink(temporary.c_str());
+        return false;
     }
 
-    // strip the / characters at the end
-    while (endsWith(request->url, "/"))
+    count = records.size();
+    return true;
+}
+
+// Print the phase percentiles of a trace file, or convert it into Chrome trace event JSON
+bool Tracer::report(const std::string &file, const std::string &format)
+{
+    std::ifstream input(file, std::ios::binary);
+    Header header;
+    if (!input.read((char *)&header, sizeof(header)) || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord) || header.phase_count != TRACE_PHASE_COUNT)
+        return false;
+
+    std::vector<TraceRecord> records(header.count);
+    if (!input.read((char *)records.data(), records.size() * sizeof(TraceRecord)))
+        return false;
+
+    if (format == "chrome")
     {
-        request->url.erase(request->url.length() - 1);
+        // one async track per request with its phases nested in order, as the requests of a loop overlap
+        auto appendString = [](std::string &json, std::string_view value) {
+            json += '"';
+            for (char c : value)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    json += '\\';
+                    json += c;
+                }
+                else if ((unsigned char)c < 0x20 || (unsigned char)c >= 0x80)
+                {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+                    json += escaped;
+                }
+                else
+                {
+                    json += c;
+                }
+            }
+            json += '"';
+        };
+        auto appendEvent = [&](std::string &json, std::string_view name, char phase, size_t id, uint32_t thread, double micros) {
+            char line[128];
+            json += json.back() == '[' ? "\n{\"name\":" : ",\n{\"name\":";
+            appendString(json, name);
+            json.append(line, snprintf(line, sizeof(line), ",\"cat\":\"request\",\"ph\":\"%c\",\"id\":%zu,\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                                       phase, id, thread, micros));
+        };
+
+        std::string json{"{\"displayTimeUnit\":\"ns\",\"otherData\":{\"epoch\":"};
+        json += std::to_string(header.epoch);
+        json += "},\"traceEvents\":[";
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            const TraceRecord &record = records[i];
+            std::string_view url(record.url, strnlen(record.url, sizeof(record.url)));
+            char name[96];
+            snprintf(name, sizeof(name), "%s %.*s %u", record.method == (int8_t)HttpMethod::POST ? "POST" : "GET",
+                     (int)url.length(), url.data(), record.status);
+
+            double micros = record.start / 1e3;
+            appendEvent(json, name, 'b', i, record.thread, micros);
+            json.pop_back();
+            char line[160];
+            json.append(line, snprintf(line, sizeof(line), ",\"args\":{\"connection\":%u,\"protocol\":%u,\"bytes\":%llu}}",
+                                       record.connection, record.protocol, (unsigned long long)record.bytes));
+            for (int phase = 0; phase < TRACE_PHASE_COUNT; ++phase)
+            {
+                if (record.phases[phase] == 0)
+                    continue;
+                appendEvent(json, TRACE_PHASE_NAMES[phase], 'b', i, record.thread, micros);
+                micros += record.phases[phase] / 1e3;
+                appendEvent(json, TRACE_PHASE_NAMES[phase], 'e', i, record.thread, micros);
+            }
+            appendEvent(json, name, 'e', i, record.thread, micros);
+        }
+        json += "\n]}\n";
+        std::cout << json;
+        return (bool)std::cout;
     }
 
-    // parse the HTTP version
-    start_pos = end_pos + 1;
-    end_pos = msg.find(CRLF, start_pos);
-    if (start_pos >= msg.length() || end_pos == std::string::npos)
+    // phases a request did not go through are left out of their percentiles
+    std::vector<uint32_t> values[TRACE_PHASE_COUNT + 1];
+    uint64_t end = 0;
+    for (const TraceRecord &record : records)
     {
-        return request;
+        uint64_t total = 0;
+        for (int phase = 0; phase < TRACE_PHASE_COUNT; ++phase)
+        {
+            if (record.phases[phase] > 0)
+                values[phase].push_back(record.phases[phase]);
+            total += record.phases[phase];
+        }
+        values[TRACE_PHASE_COUNT].push_back(std::min<uint64_t>(total, std::numeric_limits<uint32_t>::max()));
+        end = std::max(end, record.start + total);
     }
 
-    request->version = msg.substr(start_pos, end_pos - start_pos);
-
-    // parse the Connection header
-    std::string header{"Connection: "};
-    start_pos = end_pos + 1;
-    start_pos = msg.find(header, start_pos);
-    if (start_pos == std::string::npos)
+    double seconds = records.empty() ? 0 : (end - records.front().start) / 1e9;
+    printf("%zu requests over %.3f s on %u threads\n", records.size(), seconds, header.threads);
+    printf("%-8s %10s %10s %10s %10s %10s %10s   (microseconds)\n", "phase", "count", "p50", "p90", "p99", "p99.9", "max");
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (int phase = 0; phase <= TRACE_PHASE_COUNT; ++phase)
     {
-        return request;
+        std::vector<uint32_t> &sorted = values[phase];
+        std::sort(sorted.begin(), sorted.end());
+        printf("%-8s %10zu", phase == TRACE_PHASE_COUNT ? "total" : TRACE_PHASE_NAMES[phase], sorted.size());
+        for (double quantile : quantiles)
+            printf(" %10.1f", sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(quantile * sorted.size()))] / 1e3);
+        printf(" %10.1f\n", sorted.empty() ? 0.0 : sorted.back() / 1e3);
     }
-    start_pos += header.length();
-    end_pos = msg.find(CRLF, start_pos);
-    if (start_pos >= msg.length() || end_pos == std::string::npos)
+    return true;
+}
+
+// Get the ring of the calling thread, registering it on first use
+Tracer::Ring *Tracer::localRing()
+{
+    thread_local Ring *ring = nullptr;
+    if (ring == nullptr)
     {
-        return request;
+        ring = new Ring();
+        std::lock_guard<std::mutex> lock(Tracer::rings_mutex);
+        ring->thread = Tracer::rings.size();
+        Tracer::rings.push_back(ring);
     }
-
-    request->connection = toLower(msg.substr(start_pos, end_pos - start_pos));
-
-    return request;
+    return ring;
 }
 
-// Find the enum of the given HTTP method
-HttpMethod HttpRequest::toMethod(std::string method)
+// Get the nanoseconds between two stamps, zero if either phase end was not reached
+uint32_t Tracer::between(uint64_t from, uint64_t to)
 {
-    if (method == "GET")
-        return HttpMethod::GET;
-
-    // * ignore other methods for now
-    return HttpMethod::UNDEFINED;
+    if (from == 0 || to <= from)
+        return 0;
+    return std::min<uint64_t>((to - from) * Tracer::nanos_per_tick, std::numeric_limits<uint32_t>::max());
 }
 
 // Initialize logger
-std::ofstream Logger::log;
-
-// Define the conversion map between file extensions and content types
-const std::map<std::string, std::string> HttpResponse::CONTENT_TYPES = {
+LogLevel Logger::level = LogLevel::DEBUG;
+std::string Logger::access_format = "combined";
+int Logger::info_fd = -1;
+int Logger::access_fd = -1;
+std::mutex Logger::rings_mutex;
+std::vector<Logger::Ring *> Logger::rings;
+std::thread Logger::writer;
+std::atomic<bool> Logger::running{false};
+
+// Initialize tracer
+bool Tracer::active = false;
+bool Tracer::recording = false;
+double Tracer::nanos_per_tick = 1.0;
+uint64_t Tracer::epoch_ticks = 0;
+int64_t Tracer::epoch = 0;
+std::mutex Tracer::rings_mutex;
+std::vector<Tracer::Ring *> Tracer::rings;
+
+// Initialize templates
+std::shared_ptr<const Templates::Set> Templates::set = std::make_shared<Templates::Set>();
+std::atomic<time_t> Templates::checked{0};
+
+// Initialize file cache
+FileCache::Shard FileCache::shards[CACHE_SHARDS];
+
+std::shared_mutex DirectoryCache::mutex;
+std::unordered_map<std::string, std::shared_ptr<const DirectoryListing>> DirectoryCache::listings;
+int DirectoryCache::inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+int PathIndex::root_fd = AT_FDCWD;
+int PathIndex::inotify_fd = -1;
+bool PathIndex::beneath = false;
+std::atomic<uint64_t> PathIndex::generation{0};
+PathIndex::Shard PathIndex::shards[PATH_INDEX_SHARDS];
+std::mutex PathIndex::directories_mutex;
+std::unordered_map<int, std::string> PathIndex::directories;
+
+const char *AssetPack::base = nullptr;
+size_t AssetPack::size = 0;
+const AssetPack::Header *AssetPack::header = nullptr;
+std::vector<std::shared_ptr<const CacheEntry>> AssetPack::entries;
+
+int Upload::directory = -1;
+std::atomic<uint64_t> Upload::sequence{0};
+
+std::unique_ptr<RateLimiter::Entry[]> RateLimiter::table;
+uint64_t RateLimiter::capacity = 0;
+
+std::mutex WorkerPool::mutex;
+std::condition_variable WorkerPool::ready;
+std::vector<Job *> WorkerPool::queue;
+size_t WorkerPool::queue_head = 0;
+size_t WorkerPool::queue_count = 0;
+std::vector<std::thread> WorkerPool::workers;
+bool WorkerPool::running = false;
+
+std::mutex Metrics::mutex;
+std::vector<Metrics::Slot *> Metrics::slots;
+std::vector<int> Metrics::listeners;
+
+// Initialize configuration defaults
+size_t Config::cache_size = 64 << 20;
+size_t Config::cache_entry_max = 256 << 10;
+size_t Config::workers = 0;
+size_t Config::queue_size = 1024;
+size_t Config::queue_timeout = 500;
+size_t Config::header_timeout = 10;
+size_t Config::idle_timeout = 5;
+size_t Config::write_timeout = 30;
+size_t Config::max_requests = 1000;
+size_t Config::port = SERVER_PORT;
+size_t Config::backlog = LISTENNQ;
+size_t Config::loops = 0;
+size_t Config::accept_batch = 64;
+size_t Config::defer_accept = 0;
+size_t Config::fastopen = 0;
+bool Config::nodelay = true;
+bool Config::pin_cpus = true;
+bool Config::http2 = true;
+std::string Config::check_allocs;
+std::string Config::bench;
+std::string Config::metrics_path = "/metrics";
+std::string Config::io = "epoll";
+std::string Config::pack;
+std::string Config::build_pack;
+std::string Config::upload_dir;
+size_t Config::upload_max = (size_t)4 << 30;
+size_t Config::limit_connections = 0;
+size_t Config::limit_rate = 0;
+size_t Config::limit_burst = 0;
+size_t Config::limit_prefix = 32;
+std::string Config::trace;
+std::string Config::trace_report;
+std::string Config::trace_format = "text";
+bool Config::server_timing = false;
+size_t Config::bench_duration = 5;
+size_t Config::bench_connections = 64;
+size_t Config::bench_rate = 0;
+size_t Config::bench_idle = 10000;
+std::map<std::string, long> Config::max_ages;
+
+std::atomic<uint64_t> HttpResponse::date_sequence{0};
+std::atomic<time_t> HttpResponse::date_second{0};
+std::atomic<uint64_t> HttpResponse::date_words[4];
+
+// Generate a random multipart boundary once per process
+const std::string HttpResponse::BYTERANGES_BOUNDARY = []() {
+    std::random_device device;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%08x%08x", device(), device());
+    return "BYTERANGES_" + std::string{buf};
+}();
+
+// Define the table between file extensions and content types, sorted for binary search
+constexpr TableEntry<std::string_view> HttpResponse::CONTENT_TYPES[CONTENT_TYPE_COUNT] = {
+    {"7z", "application/x-7z-compressed"},
     {"bmp", "image/bmp"},
     {"css", "text/css"},
     {"csv", "text/csv"},
     {"doc", "application/msword"},
     {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
-    {"gz", "application/gzip"},
     {"gif", "image/gif"},
+    {"gz", "application/gzip"},
     {"htm", "text/html"},
     {"html", "text/html"},
     {"ico", "image/vnd.microsoft.icon"},
@@ -845,9 +9793,9 @@ const std::map<std::string, std::string> HttpResponse::CONTENT_TYPES = {
     {"mp3", "audio/mpeg"},
     {"mp4", "video/mp4"},
     {"mpeg", "video/mpeg"},
-    {"png", "image/png"},
     {"pdf", "application/pdf"},
     {"php", "application/x-httpd-php"},
+    {"png", "image/png"},
     {"ppt", "application/vnd.ms-powerpoint"},
     {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
     {"rar", "application/vnd.rar"},
@@ -863,11 +9811,11 @@ const std::map<std::string, std::string> HttpResponse::CONTENT_TYPES = {
     {"xls", "application/vnd.ms-excel"},
     {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
     {"zip", "application/zip"},
-    {"7z", "application/x-7z-compressed"},
 };
+static_assert(isStrictlySorted(HttpResponse::CONTENT_TYPES), "CONTENT_TYPES must be sorted by extension");
 
-// Define the conversion map between status codes and reason phrases
-const std::map<int, std::string> HttpResponse::REASON_PHRASES = {
+// Define the table between status codes and reason phrases, sorted for binary search
+constexpr TableEntry<int> HttpResponse::REASON_PHRASES[REASON_PHRASE_COUNT] = {
     {100, "Continue"},
     {101, "Switching Protocols"},
     {200, "OK"},
@@ -902,6 +9850,7 @@ const std::map<int, std::string> HttpResponse::REASON_PHRASES = {
     {415, "Unsupported Media Type"},
     {416, "Requested range not satisfiable"},
     {417, "Expectation Failed"},
+    {429, "Too Many Requests"},
     {500, "Internal Server Error"},
     {501, "Not Implemented"},
     {502, "Bad Gateway"},
@@ -909,3 +9858,121 @@ const std::map<int, std::string> HttpResponse::REASON_PHRASES = {
     {504, "Gateway Time-out"},
     {505, "HTTP Version not supported"},
 };
+static_assert(isStrictlySorted(HttpResponse::REASON_PHRASES), "REASON_PHRASES must be sorted by status code");
+
+const std::pair<std::string_view, std::string_view> Hpack::STATIC_TABLE[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+const uint32_t Hpack::HUFFMAN_CODES[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+const uint8_t Hpack::HUFFMAN_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};